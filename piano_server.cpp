@@ -5,176 +5,6291 @@
 #include <chrono>        // Include time library (for high-precision timestamps)
 #include <thread>        // Include thread library (for sleep functions)
 #include <cmath>         // Include math library (required for std::pow function)
-#include <windows.h>     // Include Windows API header (required for Beep() function)
-#include <conio.h>       // Include Console I/O header (required for _getch() function)
+#include <atomic>        // Include atomics (lock-free communication with the audio thread)
+#include <algorithm>     // Include algorithms (std::min, std::max)
+#include <fstream>       // Include file streams (engine log file)
+#include <cstdlib>       // Include C standard library (std::atoi for command line options)
+#include <cstring>       // Include C string functions (std::strcmp for command line options)
+#include <cctype>        // Include character classes (std::isdigit for config parsing)
+#include <memory>        // Include smart pointers (metric storage with stable addresses)
+#include <sstream>       // Include string streams (building the metrics page)
+#include <array>         // Include fixed-size arrays (flat key lookup tables)
+#include <functional>    // Include function wrappers (audio graph nodes built from callables)
+#include <mutex>         // Include mutexes (thread pool injection queue and sleeping workers)
+#include <condition_variable> // Include condition variables (idle pool workers)
+#include <deque>         // Include double-ended queues (baseline pool for the benchmark)
+#include <cstdint>       // Include fixed-width integers (session file layout)
+#include <complex>       // Include complex numbers (FFT for the golden-audio spectral comparison)
+#include <iterator>      // Include stream iterators (reading whole WAV files)
+#include <future>        // Include futures (startup steps finishing in the background)
+#include <cstdio>        // Include C file I/O (raw MIDI byte streams)
+#include <climits>       // Include INT_MIN/INT_MAX (range checks when parsing config numbers)
+#include <cstddef>       // Include offsetof (gathering fields of packed recording entries)
+#include <csignal>       // Include signals (SIGINT/SIGTERM stop the headless service)
+#include <sys/stat.h>    // Include file status (config file modification times)
+#ifdef _WIN32
+#include <winsock2.h>    // Include Windows sockets (metrics HTTP endpoint), must come before windows.h
+#include <windows.h>     // Include Windows API (platform layer: console, beeps, thread priority)
+#include <mmsystem.h>    // Include Windows multimedia header (waveOut audio output)
+#include <conio.h>       // Include console I/O (platform layer: keyAvailable/readKey)
+#else
+#include <termios.h>     // Include terminal settings (unbuffered key input)
+#include <unistd.h>      // Include POSIX I/O (reading keys, closing sockets and descriptors)
+#include <sys/socket.h>  // Include BSD sockets (metrics HTTP endpoint, UDP MIDI output)
+#include <netinet/in.h>  // Include internet addresses
+#include <arpa/inet.h>   // Include inet_addr
+#include <poll.h>        // Include poll() (key presses, sequencer and inotify events with a timeout)
+#include <pthread.h>     // Include pthread scheduling and thread names
+#include <sched.h>       // Include realtime scheduling policies
+#include <dirent.h>      // Include directory listing (batch rendering a directory of recordings)
+#include <sys/mman.h>    // Include mmap (session files are mapped, not parsed)
+#include <fcntl.h>       // Include open() flags
+#include <cerrno>        // Include errno (telling a missing session file from a broken one)
+#endif
+#ifdef __linux__
+#include <sys/inotify.h> // Include inotify (config file change notifications)
+#endif
+#ifdef PIANO_WITH_JACK
+#include <jack/jack.h>   // Include JACK client API (low-latency audio backend)
+#include <jack/transport.h> // Include JACK transport (playback follows the session transport)
+#endif
+#ifdef PIANO_WITH_ALSA
+#include <alsa/asoundlib.h> // Include ALSA sequencer API (MIDI input on Linux)
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>   // Include AVX2 intrinsics (modal resonator banks, build with -mavx2)
+#endif
+
+#ifdef _WIN32
+#pragma comment(lib, "winmm.lib") // Link the Windows multimedia library (MinGW: add -lwinmm)
+#pragma comment(lib, "ws2_32.lib") // Link the Windows sockets library (MinGW: add -lws2_32)
+#endif
+
+// Platform layer: the few things that differ between Windows and Linux (console, keys, beeps,
+// thread priority, sockets). Everything else calls these instead of the OS.
+// Linux build: g++ -std=c++17 -O2 piano_server.cpp -pthread [-DPIANO_WITH_ALSA -lasound]
+// For perf, add -g -fno-omit-frame-pointer; threads are named (piano-audio, graph-worker, ...).
+#ifdef _WIN32
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0                // Windows never raises SIGPIPE
+#endif
+#else
+typedef int SOCKET;
+const SOCKET INVALID_SOCKET = -1;
+#endif
+
+// Function to sleep the calling thread
+void sleepMillis(long long ms) {
+    if (ms > 0) std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+// Function to make a tone without a sound device (blocks for the duration like Windows Beep)
+void beep(double frequency, int ms) {
+#ifdef _WIN32
+    Beep(static_cast<DWORD>(frequency), static_cast<DWORD>(ms));
+#else
+    (void)frequency;                  // A terminal bell has one pitch
+    std::cout << '\a' << std::flush;
+    sleepMillis(ms);
+#endif
+}
+
+// Function to clear the console window
+void clearScreen() {
+#ifdef _WIN32
+    system("cls");
+#else
+    std::cout << "\x1b[2J\x1b[H" << std::flush;
+#endif
+}
+
+// Function to set the console window title
+void setConsoleTitle(const std::string& title) {
+#ifdef _WIN32
+    SetConsoleTitleA(title.c_str());
+#else
+    std::cout << "\x1b]0;" << title << "\x07" << std::flush;
+#endif
+}
+
+// Function to check whether a key press is waiting
+bool keyAvailable() {
+#ifdef _WIN32
+    return _kbhit() != 0;
+#else
+    pollfd p = {STDIN_FILENO, POLLIN, 0};
+    return poll(&p, 1, 0) > 0;
+#endif
+}
+
+// Function to read one key press without waiting for Enter (Enter reads as '\r' everywhere)
+char readKey() {
+#ifdef _WIN32
+    return static_cast<char>(_getch());
+#else
+    char c;
+    if (read(STDIN_FILENO, &c, 1) != 1) return 'Q'; // Input closed: quit
+    return c == '\n' ? '\r' : c;
+#endif
+}
+
+// Raw console class (keys arrive one at a time and unechoed while it exists; Windows needs nothing)
+class RawConsole {
+private:
+#ifndef _WIN32
+    termios saved = {};
+    bool active = false;
+#endif
+
+public:
+    RawConsole() {
+#ifndef _WIN32
+        if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved) != 0) return;
+        termios raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        active = tcsetattr(STDIN_FILENO, TCSANOW, &raw) == 0;
+#endif
+    }
+    ~RawConsole() {
+#ifndef _WIN32
+        if (active) tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+#endif
+    }
+};
+
+// Function to give the calling thread realtime priority (audio threads; ignored if not allowed)
+void raiseThreadPriority() {
+#ifdef _WIN32
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+#else
+    sched_param param = {};
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO) / 2;
+    pthread_setschedparam(pthread_self(), SCHED_FIFO, &param); // Needs rtprio; plain priority otherwise
+#endif
+}
+
+// Function to name the calling thread (shows up in perf, top -H and debuggers)
+void nameThread(const char* name) {
+#ifdef __linux__
+    pthread_setname_np(pthread_self(), name); // At most 15 characters
+#else
+    (void)name;
+#endif
+}
+
+// Function to initialize sockets before first use (Windows needs WSAStartup, paired with socketsCleanup)
+bool socketsStartup() {
+#ifdef _WIN32
+    WSADATA wsa;
+    return WSAStartup(MAKEWORD(2, 2), &wsa) == 0;
+#else
+    return true;
+#endif
+}
+
+void socketsCleanup() {
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+// Function to close a socket (also wakes a thread blocked in accept() on it)
+void closeSocket(SOCKET s) {
+#ifdef _WIN32
+    closesocket(s);
+#else
+    shutdown(s, SHUT_RDWR);           // close() alone does not wake accept() on Linux
+    close(s);
+#endif
+}
+
+// Function to make recv() on a socket give up after timeoutMs (a silent peer cannot block us forever)
+void setReceiveTimeout(SOCKET s, int timeoutMs) {
+#ifdef _WIN32
+    DWORD timeout = static_cast<DWORD>(timeoutMs);
+#else
+    timeval timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000};
+#endif
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+}
+
+// Function to create a directory if it does not exist yet (parent directories must exist)
+bool makeDirectory(const std::string& directory) {
+#ifdef _WIN32
+    return CreateDirectoryA(directory.c_str(), nullptr) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+    return mkdir(directory.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+// Function to list the files in a directory whose names end in suffix (sorted, full paths)
+// Returns false if the path is not a directory that can be read.
+bool listDirectory(const std::string& directory, const std::string& suffix, std::vector<std::string>& paths) {
+    std::vector<std::string> names;
+#ifdef _WIN32
+    WIN32_FIND_DATAA entry;
+    HANDLE find = FindFirstFileA((directory + "\\*" + suffix).c_str(), &entry);
+    if (find == INVALID_HANDLE_VALUE) return GetLastError() == ERROR_FILE_NOT_FOUND; // Directory without matches
+    do {
+        if (!(entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) names.push_back(entry.cFileName);
+    } while (FindNextFileA(find, &entry));
+    FindClose(find);
+#else
+    DIR* dir = opendir(directory.c_str());
+    if (!dir) return false;
+    while (dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            names.push_back(name);
+        }
+    }
+    closedir(dir);
+#endif
+    std::sort(names.begin(), names.end());
+    for (const auto& name : names) paths.push_back(directory + "/" + name);
+    return true;
+}
 
 const int BASE_DURATION = 200; // Define a constant integer for note duration (200 milliseconds)
+const int SAMPLE_RATE = 44100; // Output sample rate of the software synth (samples per second)
+const int MAX_VOICES = 64;     // Maximum number of notes that can sound at the same time (voices are tracked in 64-bit masks)
+const int METRICS_PORT = 9464; // Default local port of the Prometheus metrics endpoint
+const int METRICS_RECV_TIMEOUT_MS = 2000; // How long the metrics endpoint waits for a request line
+const int CONTROL_PORT = 9465; // Default local port of the headless control API
+const int MAX_LAYOUT_SEMITONES = 48; // Highest semitone offset a key layout may use (4 octaves)
+
+// Note names (index = semitone above C); frequencies come from the active tuning table
+const char* const NOTE_NAMES[12] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+
+// Function to build the frequency of every MIDI note (A4 = note 69 = 440 Hz)
+std::array<double, 128> buildMidiFrequencies() {
+    std::array<double, 128> table;
+    for (int n = 0; n < 128; n++) table[n] = 440.0 * std::pow(2.0, (n - 69) / 12.0);
+    return table;
+}
+
+const std::array<double, 128> MIDI_FREQUENCIES = buildMidiFrequencies(); // MIDI note -> hertz
+
+// Function to read the steady clock in nanoseconds (the clock the audio thread compares against)
+long long steadyNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Function to read the system clock in milliseconds since the epoch (recording timestamps)
+long long systemMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Clock class (where the recorder, the playback scheduler and the engine get the time from)
+class Clock {
+public:
+    virtual ~Clock() {}
+    virtual long long nowMs() = 0;          // Milliseconds since the epoch (recording timestamps)
+    virtual long long nowNs() = 0;          // Monotonic nanoseconds (latency measurements)
+    virtual void sleepMs(long long ms) = 0; // Wait; a virtual clock just moves forward
+};
+
+// System clock class (the real time)
+class SystemClock : public Clock {
+public:
+    long long nowMs() override { return systemMillis(); }
+    long long nowNs() override { return steadyNanos(); }
+    void sleepMs(long long ms) override { sleepMillis(ms); }
+};
+
+// Function to get the clock everything uses unless told otherwise
+Clock& systemClock() {
+    static SystemClock clock;
+    return clock;
+}
+
+// Virtual clock class (simulated time that only moves when advanced or slept on)
+// Sleeping returns at once, so an hour of simulated playing runs as fast as the code under test,
+// and every timestamp is exactly predictable. Safe to read from several threads.
+class VirtualClock : public Clock {
+private:
+    std::atomic<long long> ns;
+
+public:
+    explicit VirtualClock(long long startMs = 0) : ns(startMs * 1000000LL) {}
+    long long nowMs() override { return ns.load(std::memory_order_acquire) / 1000000LL; }
+    long long nowNs() override { return ns.load(std::memory_order_acquire); }
+    void sleepMs(long long ms) override { if (ms > 0) advanceNs(ms * 1000000LL); }
+    void advanceNs(long long delta) { ns.fetch_add(delta, std::memory_order_acq_rel); }
+};
+
+// Note kind enumeration (what a recorded entry represents)
+enum class NoteKind : unsigned char { Note, NoteOff, Sustain, Sostenuto };
+
+// Note structure definition
+struct Note {
+    NoteKind kind = NoteKind::Note; // Played note, key release or pedal change
+    std::string name;       // String to store the display name of the note
+    double frequency;       // Double precision float for the note's frequency in hertz
+    long long timestamp;    // Long long integer for the time offset from start of recording
+    unsigned char instrument = 0; // Instrument the note was played with (see Instrument)
+    float gain = 1.0f;      // Zone loudness the note was played with
+    unsigned char velocity = 100; // How hard the note was struck (1-127, MIDI scale)
+    unsigned char key = 60; // MIDI note number (60 = middle C), matches a note to its NoteOff
+    int duration = BASE_DURATION; // Milliseconds until the automatic note-off (0 = wait for a NoteOff entry)
+    bool pedalDown = false; // Pedal entries: true when the pedal went down
+};
+
+// Recording structure definition
+struct Recording {
+    std::string name;       // String to store the name of the recording
+    std::vector<Note> notes; // Vector (dynamic list) to store the sequence of Note objects
+};
+
+// Key binding structure definition (one keyboard key and the semitone it plays, counted from C)
+struct KeyBinding {
+    char key;
+    int semitone;
+};
+
+// Flat key table type: one entry per possible char, -1 means "not a note key"
+// Indexing by the char itself is a perfect hash, so looking a key up is a single load
+// no matter how many keys the layout has.
+typedef std::array<signed char, 256> KeyTable;
+
+// Function to compile a list of bindings into a flat key table (usable at compile time)
+template <size_t N>
+constexpr KeyTable compileKeyTable(const KeyBinding (&bindings)[N]) {
+    KeyTable table{};
+    for (size_t i = 0; i < table.size(); i++) table[i] = -1;
+    for (size_t i = 0; i < N; i++) table[static_cast<unsigned char>(bindings[i].key)] = static_cast<signed char>(bindings[i].semitone);
+    return table;
+}
+
+// Built-in layout: the original 12 keys (white keys z-m, black keys on the row above)
+constexpr KeyBinding QWERTY_BINDINGS[] = {
+    {'z', 0}, {'s', 1}, {'x', 2}, {'d', 3}, {'c', 4}, {'v', 5},
+    {'g', 6}, {'b', 7}, {'h', 8}, {'n', 9}, {'j', 10}, {'m', 11}};
+
+// Built-in layout: two rows like a tracker (bottom rows = this octave, top rows = next octave)
+constexpr KeyBinding QWERTY_TWO_ROW_BINDINGS[] = {
+    {'z', 0}, {'s', 1}, {'x', 2}, {'d', 3}, {'c', 4}, {'v', 5}, {'g', 6}, {'b', 7}, {'h', 8},
+    {'n', 9}, {'j', 10}, {'m', 11}, {',', 12}, {'l', 13}, {'.', 14}, {';', 15}, {'/', 16},
+    {'q', 12}, {'2', 13}, {'w', 14}, {'3', 15}, {'e', 16}, {'r', 17}, {'5', 18}, {'t', 19},
+    {'6', 20}, {'y', 21}, {'7', 22}, {'u', 23}, {'i', 24}, {'9', 25}, {'o', 26}, {'0', 27}, {'p', 28}};
+
+// Built-in layout: AZERTY keyboards (same physical keys as the original layout)
+constexpr KeyBinding AZERTY_BINDINGS[] = {
+    {'w', 0}, {'s', 1}, {'x', 2}, {'d', 3}, {'c', 4}, {'v', 5},
+    {'g', 6}, {'b', 7}, {'h', 8}, {'n', 9}, {'j', 10}, {',', 11}};
+
+// Built-in tables are compiled by the compiler, nothing is built at startup
+constexpr KeyTable QWERTY_TABLE = compileKeyTable(QWERTY_BINDINGS);
+constexpr KeyTable QWERTY_TWO_ROW_TABLE = compileKeyTable(QWERTY_TWO_ROW_BINDINGS);
+constexpr KeyTable AZERTY_TABLE = compileKeyTable(AZERTY_BINDINGS);
+
+// Key layout structure definition (a named, compiled key table)
+struct KeyLayout {
+    std::string name;       // Name shown in the interface and used in the config file
+    KeyTable table;         // char -> semitone above C of the current octave (-1 = unbound)
+
+    // Function to look a key up (single table load)
+    int resolve(char key) const { return table[static_cast<unsigned char>(key)]; }
+};
+
+// Function to return the layouts that ship with the program
+std::vector<KeyLayout> builtInLayouts() {
+    std::vector<KeyLayout> layouts;
+    layouts.push_back({"qwerty", QWERTY_TABLE});
+    layouts.push_back({"qwerty-two-row", QWERTY_TWO_ROW_TABLE});
+    layouts.push_back({"azerty", AZERTY_TABLE});
+    return layouts;
+}
+
+// Function to remove spaces and tabs from both ends of a string
+std::string trim(const std::string& text) {
+    size_t begin = text.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) return "";
+    size_t end = text.find_last_not_of(" \t\r");
+    return text.substr(begin, end - begin + 1);
+}
+
+// Function to parse a whole config value as an integer ("4abc" or "up" are rejected)
+bool parseInteger(const std::string& text, int& value) {
+    char* end = nullptr;
+    long parsed = std::strtol(text.c_str(), &end, 10);
+    if (end == text.c_str() || *end != '\0' || parsed < INT_MIN || parsed > INT_MAX) return false;
+    value = static_cast<int>(parsed);
+    return true;
+}
+
+// Function to parse a whole config value as a finite number ("1.5x" or "nan" are rejected)
+bool parseNumber(const std::string& text, double& value) {
+    char* end = nullptr;
+    double parsed = std::strtod(text.c_str(), &end);
+    if (end == text.c_str() || *end != '\0' || !std::isfinite(parsed)) return false;
+    value = parsed;
+    return true;
+}
+
+// Function to parse a note value from the config file: a semitone number ("13")
+// or a note name with an optional octave offset ("C#", "D+1"). Returns -1 if invalid.
+int parseSemitone(const std::string& text) {
+    if (text.empty()) return -1;
+    if (std::isdigit(static_cast<unsigned char>(text[0]))) {
+        for (char c : text) if (!std::isdigit(static_cast<unsigned char>(c))) return -1;
+        int value = std::atoi(text.c_str());
+        return value < MAX_LAYOUT_SEMITONES ? value : -1;
+    }
+    size_t plus = text.find('+');
+    std::string name = text.substr(0, plus);
+    int offset = 0;
+    if (plus != std::string::npos) {
+        std::string digits = text.substr(plus + 1);
+        if (digits.empty()) return -1;
+        for (char c : digits) if (!std::isdigit(static_cast<unsigned char>(c))) return -1;
+        offset = std::atoi(digits.c_str());
+    }
+    for (int i = 0; i < 12; i++) {
+        if (name == NOTE_NAMES[i]) {
+            int value = i + 12 * offset;
+            return value < MAX_LAYOUT_SEMITONES ? value : -1;
+        }
+    }
+    return -1;
+}
+
+// Instrument enumeration (timbres the software synth can play)
+enum class Instrument : unsigned char { Square, Sine, Triangle, String, Modal, Fm };
+const int NUM_INSTRUMENTS = 6;
+const char* const INSTRUMENT_NAMES[NUM_INSTRUMENTS] = {"square", "sine", "triangle", "string", "modal", "fm"};
+
+// FM algorithm enumeration (how the four FM operators are wired)
+enum class FmAlgorithm : unsigned char { Stack, Pairs, Branch, Additive };
+const int NUM_FM_ALGORITHMS = 4;
+const char* const FM_ALGORITHM_NAMES[NUM_FM_ALGORITHMS] = {"stack", "pairs", "branch", "additive"};
+
+// Keyboard zone structure definition
+// A zone takes a range of layout keys and plays them in its own octave with its own instrument.
+// Zones may overlap: a key inside several zones sounds all of them (layers).
+const int MAX_LAYERS = 4;   // Most zones a single key can sound at once
+
+struct KeyZone {
+    std::string name;           // Name shown in the interface
+    std::string layout;         // Layout the zone belongs to (empty = every layout)
+    int lowSemitone = 0;        // First layout semitone covered by the zone
+    int highSemitone = MAX_LAYOUT_SEMITONES - 1; // Last layout semitone covered by the zone
+    int octaveShift = 0;        // Octaves added on top of the global octave
+    Instrument instrument = Instrument::Square; // Timbre used for the zone
+    float gain = 1.0f;          // Loudness of the zone relative to the others
+};
+
+// Piano config structure definition (everything read from the config file)
+struct PianoConfig {
+    std::vector<KeyLayout> layouts = builtInLayouts(); // Built-in layouts plus any from the file
+    std::vector<KeyZone> zones;                        // Empty = one zone with the default instrument
+    std::string defaultLayout;                         // Layout selected at startup
+    Instrument midiInstrument = Instrument::Square;    // Timbre for notes from a MIDI keyboard
+    FmAlgorithm fmAlgorithm = FmAlgorithm::Stack;      // Operator wiring of the fm instrument
+    std::string tuningFile;                            // Scala scale to select (empty = keep the current tuning)
+    std::string keyboardMapFile;                       // Scala keyboard mapping for tuningFile
+    int oversample = 0;                                // 0 = not set in the file (command line value stays)
+    float drive = -1.0f;                               // < 0 = not set in the file
+};
+
+// Function to parse a zone key range like "C-B", "0-11" or "C+1-E+2". Returns false if invalid.
+bool parseSemitoneRange(const std::string& text, int& low, int& high) {
+    size_t dash = text.find('-');
+    if (dash == std::string::npos) {
+        low = high = parseSemitone(trim(text));   // Single key zone
+    } else {
+        low = parseSemitone(trim(text.substr(0, dash)));
+        high = parseSemitone(trim(text.substr(dash + 1)));
+    }
+    return low >= 0 && high >= low;
+}
+
+// Function to load the piano config file (key layouts and zones)
+// Format:
+//   default = my-layout        (optional, layout selected at startup)
+//   fm_algorithm = pairs       (optional: stack, pairs, branch or additive)
+//   tuning = just.scl          (optional Scala scale, relative to the config file)
+//   keyboard_map = white.kbm   (optional Scala keyboard mapping for the scale)
+//   oversample = 4             (optional: 1, 2, 4 or 8)
+//   drive = 1.5                (optional master saturation, 0 = off)
+//   [layout my-layout]
+//   z = C                      (key = note name, note name + octave offset, or semitone number)
+//   q = C+1
+//   [zone bass]
+//   layout = my-layout         (optional, zone only applies to this layout)
+//   keys = C-B                 (range of layout semitones)
+//   octave = -2                (added to the global octave)
+//   instrument = sine          (square, sine, triangle, string, modal or fm)
+//   gain = 0.8
+// Layouts are compiled into flat tables here, once, so playing never parses anything.
+// Returns false and fills error (with the line number) if the file is invalid.
+bool loadPianoConfig(const std::string& path, PianoConfig& config, std::string& error) {
+    std::ifstream file(path);
+    if (!file) {
+        error = "cannot open " + path;
+        return false;
+    }
+    std::vector<KeyLayout> loaded;
+    std::vector<KeyZone> zones;
+    enum { TOP, LAYOUT, ZONE } section = TOP;    // Which kind of section the lines belong to
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line)) {
+        lineNumber++;
+        std::string where = path + ":" + std::to_string(lineNumber) + ": ";
+        line = trim(line);
+        if (line.empty() || line[0] == '#') continue; // Blank line or comment
+        if (line[0] == '[') {                       // Section header
+            std::string header = line.back() == ']' ? trim(line.substr(1, line.size() - 2)) : "";
+            size_t space = header.find(' ');
+            std::string kind = header.substr(0, space);
+            std::string name = space == std::string::npos ? "" : trim(header.substr(space + 1));
+            if ((kind != "layout" && kind != "zone") || name.empty()) {
+                error = where + "expected [layout <name>] or [zone <name>]";
+                return false;
+            }
+            if (kind == "layout") {
+                KeyLayout layout;
+                layout.name = name;
+                layout.table.fill(-1);
+                loaded.push_back(layout);
+                section = LAYOUT;
+            } else {
+                KeyZone zone;
+                zone.name = name;
+                zones.push_back(zone);
+                section = ZONE;
+            }
+            continue;
+        }
+        size_t equals = line.find('=', 1);          // Start at 1 so '=' itself can be bound as a key
+        if (equals == std::string::npos) {
+            error = where + "expected <key> = <value>";
+            return false;
+        }
+        std::string left = trim(line.substr(0, equals));
+        std::string right = trim(line.substr(equals + 1));
+        if (section == TOP) {                       // Settings before the first section
+            if (left == "default") {
+                config.defaultLayout = right;
+                continue;
+            }
+            if (left == "midi_instrument") {
+                int found = -1;
+                for (int i = 0; i < NUM_INSTRUMENTS; i++) if (right == INSTRUMENT_NAMES[i]) found = i;
+                if (found < 0) {
+                    error = where + "unknown instrument '" + right + "'";
+                    return false;
+                }
+                config.midiInstrument = static_cast<Instrument>(found);
+                continue;
+            }
+            if (left == "fm_algorithm") {
+                int found = -1;
+                for (int i = 0; i < NUM_FM_ALGORITHMS; i++) if (right == FM_ALGORITHM_NAMES[i]) found = i;
+                if (found < 0) {
+                    error = where + "unknown FM algorithm '" + right + "'";
+                    return false;
+                }
+                config.fmAlgorithm = static_cast<FmAlgorithm>(found);
+                continue;
+            }
+            if (left == "tuning" || left == "keyboard_map") {
+                bool absolute = !right.empty() && (right[0] == '/' || right[0] == '\\' || (right.size() > 1 && right[1] == ':'));
+                size_t slash = path.find_last_of("/\\");
+                std::string resolved = absolute || slash == std::string::npos ? right : path.substr(0, slash + 1) + right;
+                (left == "tuning" ? config.tuningFile : config.keyboardMapFile) = resolved;
+                continue;
+            }
+            if (left == "oversample") {
+                int factor = 0;
+                if (!parseInteger(right, factor) || (factor != 1 && factor != 2 && factor != 4 && factor != 8)) {
+                    error = where + "oversample must be 1, 2, 4 or 8";
+                    return false;
+                }
+                config.oversample = factor;
+                continue;
+            }
+            if (left == "drive") {
+                double drive = 0.0;
+                if (!parseNumber(right, drive) || drive < 0.0) {
+                    error = where + "drive must be a number, not negative";
+                    return false;
+                }
+                config.drive = static_cast<float>(drive);
+                continue;
+            }
+            error = where + "unknown setting '" + left + "'";
+            return false;
+        }
+        if (section == ZONE) {
+            KeyZone& zone = zones.back();
+            if (left == "layout") {
+                zone.layout = right;
+            } else if (left == "keys") {
+                if (!parseSemitoneRange(right, zone.lowSemitone, zone.highSemitone)) {
+                    error = where + "invalid key range '" + right + "'";
+                    return false;
+                }
+            } else if (left == "octave") {
+                if (!parseInteger(right, zone.octaveShift) || zone.octaveShift < -4 || zone.octaveShift > 4) {
+                    error = where + "octave shift must be a whole number between -4 and 4";
+                    return false;
+                }
+            } else if (left == "instrument") {
+                int found = -1;
+                for (int i = 0; i < NUM_INSTRUMENTS; i++) if (right == INSTRUMENT_NAMES[i]) found = i;
+                if (found < 0) {
+                    error = where + "unknown instrument '" + right + "'";
+                    return false;
+                }
+                zone.instrument = static_cast<Instrument>(found);
+            } else if (left == "gain") {
+                double gain = 0.0;
+                if (!parseNumber(right, gain) || gain < 0.0 || gain > 4.0) {
+                    error = where + "gain must be a number between 0 and 4";
+                    return false;
+                }
+                zone.gain = static_cast<float>(gain);
+            } else {
+                error = where + "unknown zone setting '" + left + "'";
+                return false;
+            }
+            continue;
+        }
+        if (left.size() != 1) {
+            error = where + "key must be a single character, got '" + left + "'";
+            return false;
+        }
+        char key = left[0];
+        if (key == '+' || key == '-' || key == '\t' || key == ' ' || std::isupper(static_cast<unsigned char>(key))) {
+            error = where + "'" + left + "' is reserved for commands";
+            return false;
+        }
+        int semitone = parseSemitone(right);
+        if (semitone < 0) {
+            error = where + "invalid note '" + right + "'";
+            return false;
+        }
+        loaded.back().table[static_cast<unsigned char>(key)] = static_cast<signed char>(semitone);
+    }
+    for (auto& layout : loaded) {                   // A file layout replaces a built-in one of the same name
+        bool replaced = false;
+        for (auto& existing : config.layouts) {
+            if (existing.name == layout.name) {
+                existing = layout;
+                replaced = true;
+            }
+        }
+        if (!replaced) config.layouts.push_back(layout);
+    }
+    config.zones.insert(config.zones.end(), zones.begin(), zones.end());
+
+    // A key can only sound MAX_LAYERS zones: report stacks that would lose layers
+    for (const auto& layout : config.layouts) {
+        for (int c = 0; c < 256; c++) {
+            int semitone = layout.table[c];
+            if (semitone < 0) continue;
+            std::vector<std::string> covering;
+            for (const auto& zone : config.zones) {
+                if (!zone.layout.empty() && zone.layout != layout.name) continue;
+                if (semitone >= zone.lowSemitone && semitone <= zone.highSemitone) covering.push_back(zone.name);
+            }
+            if (covering.size() <= static_cast<size_t>(MAX_LAYERS)) continue;
+            error = path + ": key '" + std::string(1, static_cast<char>(c)) + "' of layout " + layout.name + " is in zones";
+            for (const auto& name : covering) error += " " + name;
+            error += " (at most " + std::to_string(MAX_LAYERS) + " zones may overlap)";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Zone target structure definition (one voice a key fans out to)
+struct ZoneTarget {
+    int semitone;           // Semitone above C of the current octave, zone shift included
+    Instrument instrument;  // Timbre to play
+    float gain;             // Zone loudness
+};
+
+// Key fan-out structure definition (every voice one key starts)
+struct KeyFanout {
+    int count = 0;
+    ZoneTarget targets[MAX_LAYERS];
+};
+
+// Flat fan-out table type (indexed by the key char, like KeyTable)
+typedef std::array<KeyFanout, 256> FanoutTable;
+
+// Function to resolve layout + zones into a fan-out table
+// Done when the layout changes, so pressing a key is one table load plus one noteOn per layer.
+FanoutTable compileZones(const KeyLayout& layout, const std::vector<KeyZone>& zones) {
+    std::vector<KeyZone> active;
+    for (const auto& zone : zones) {
+        if (zone.layout.empty() || zone.layout == layout.name) active.push_back(zone);
+    }
+    if (active.empty()) active.push_back(KeyZone()); // No zones: whole keyboard, default instrument
+
+    FanoutTable table;
+    for (int c = 0; c < 256; c++) {
+        int semitone = layout.table[c];
+        if (semitone < 0) continue;
+        KeyFanout& fanout = table[c];
+        for (const auto& zone : active) {
+            if (semitone < zone.lowSemitone || semitone > zone.highSemitone) continue;
+            if (fanout.count == MAX_LAYERS) break; // Cannot happen: loadPianoConfig rejects deeper stacks
+            ZoneTarget& t = fanout.targets[fanout.count++];
+            t.semitone = semitone + 12 * zone.octaveShift;
+            t.instrument = zone.instrument;
+            t.gain = zone.gain;
+        }
+    }
+    return table;
+}
+
+// Tuning table structure definition (frequency of every MIDI note in one tuning system)
+// Built once when a tuning is loaded, so playing a note is a single table load.
+struct TuningTable {
+    std::string name;                 // Shown in the status line
+    std::array<double, 128> hz;       // MIDI note -> frequency (0 = key not mapped, silent)
+};
+
+// Scala scale structure definition (contents of a .scl file)
+struct ScalaScale {
+    std::string description;
+    std::vector<double> cents;        // Degrees 1..N above the root; the last one is the period (usually 1200)
+};
+
+// Scala keyboard mapping structure definition (contents of a .kbm file)
+struct KeyboardMap {
+    int size = 0;                     // Keys per repeat of the map (0 = every key is the next degree)
+    int firstKey = 0;                 // Keys outside first..last stay unmapped
+    int lastKey = 127;
+    int middleKey = 60;               // Key that plays degree 0
+    int referenceKey = 69;            // Key tuned to referenceHz
+    double referenceHz = 440.0;
+    int octaveDegree = 0;             // Degree one map repeat moves by (0 = scale size)
+    std::vector<int> degrees;         // Degree per map position (-1 = 'x', not mapped)
+};
+
+// Function to read the next line of a Scala file that is not a comment ('!'). Returns false at the end.
+bool nextScalaLine(std::istream& in, std::string& line) {
+    while (std::getline(in, line)) {
+        if (!line.empty() && line[0] == '!') continue;
+        line = trim(line);
+        return true;
+    }
+    return false;
+}
+
+// Function to parse one Scala pitch: cents if it has a dot ("386.31"), otherwise a ratio ("5/4" or "2")
+bool parseScalaPitch(const std::string& text, double& cents) {
+    std::istringstream in(text);
+    std::string token;
+    in >> token;                      // Anything after the value is a comment
+    if (token.empty()) return false;
+    if (token.find('.') != std::string::npos) {
+        char* end = nullptr;
+        cents = std::strtod(token.c_str(), &end);
+        return *end == '\0';
+    }
+    size_t slash = token.find('/');
+    char* end = nullptr;
+    double numerator = std::strtod(token.substr(0, slash).c_str(), &end);
+    if (*end != '\0') return false;
+    double denominator = 1.0;
+    if (slash != std::string::npos) {
+        denominator = std::strtod(token.substr(slash + 1).c_str(), &end);
+        if (*end != '\0') return false;
+    }
+    if (numerator <= 0.0 || denominator <= 0.0) return false;
+    cents = 1200.0 * std::log2(numerator / denominator);
+    return true;
+}
+
+// Function to parse a .scl file. Returns false and fills error if the text is invalid.
+bool parseScala(std::istream& in, ScalaScale& scale, std::string& error) {
+    std::string line;
+    if (!nextScalaLine(in, line)) {
+        error = "missing description line";
+        return false;
+    }
+    scale.description = line;
+    if (!nextScalaLine(in, line)) {
+        error = "missing note count";
+        return false;
+    }
+    int count = std::atoi(line.c_str());
+    if (count <= 0 || count > 1024) {
+        error = "bad note count '" + line + "'";
+        return false;
+    }
+    scale.cents.clear();
+    while (static_cast<int>(scale.cents.size()) < count && nextScalaLine(in, line)) {
+        double cents;
+        if (!parseScalaPitch(line, cents)) {
+            error = "bad pitch '" + line + "'";
+            return false;
+        }
+        scale.cents.push_back(cents);
+    }
+    if (static_cast<int>(scale.cents.size()) != count) {
+        error = "expected " + std::to_string(count) + " pitches";
+        return false;
+    }
+    return true;
+}
+
+// Function to parse a .kbm file. Returns false and fills error if the text is invalid.
+bool parseKeyboardMap(std::istream& in, KeyboardMap& map, std::string& error) {
+    std::string line;
+    double fields[7];
+    for (int i = 0; i < 7; i++) {
+        if (!nextScalaLine(in, line)) {
+            error = "missing header field " + std::to_string(i + 1);
+            return false;
+        }
+        fields[i] = std::atof(line.c_str());
+    }
+    map.size = static_cast<int>(fields[0]);
+    map.firstKey = static_cast<int>(fields[1]);
+    map.lastKey = static_cast<int>(fields[2]);
+    map.middleKey = static_cast<int>(fields[3]);
+    map.referenceKey = static_cast<int>(fields[4]);
+    map.referenceHz = fields[5];
+    map.octaveDegree = static_cast<int>(fields[6]);
+    if (map.size < 0 || map.referenceHz <= 0.0 || map.referenceKey < 0 || map.referenceKey > 127) {
+        error = "bad header";
+        return false;
+    }
+    map.degrees.clear();
+    while (static_cast<int>(map.degrees.size()) < map.size && nextScalaLine(in, line)) {
+        map.degrees.push_back(line.empty() || line[0] == 'x' ? -1 : std::atoi(line.c_str()));
+    }
+    if (static_cast<int>(map.degrees.size()) < map.size) {
+        map.degrees.resize(map.size, -1);     // Scala treats missing entries as unmapped
+    }
+    return true;
+}
+
+// Function to compile a scale and a keyboard mapping into a 128-note table
+// Returns false if the reference key is not mapped (nothing to tune the table to).
+bool compileTuning(const ScalaScale& scale, const KeyboardMap& map, const std::string& name, TuningTable& table,
+                   std::string& error) {
+    const int notes = static_cast<int>(scale.cents.size());
+    const double period = scale.cents.back();
+    const int octaveDegree = map.octaveDegree > 0 ? map.octaveDegree : notes;
+    auto centsOf = [&](int key, bool& mapped) {
+        mapped = key >= map.firstKey && key <= map.lastKey;
+        int degree = key - map.middleKey;
+        if (map.size > 0) {
+            int offset = key - map.middleKey;
+            int repeat = offset >= 0 ? offset / map.size : -((-offset + map.size - 1) / map.size);
+            int entry = map.degrees[offset - repeat * map.size];
+            if (entry < 0) mapped = false;
+            degree = entry + repeat * octaveDegree;
+        }
+        int octave = degree >= 0 ? degree / notes : -((-degree + notes - 1) / notes);
+        int step = degree - octave * notes;
+        return octave * period + (step == 0 ? 0.0 : scale.cents[step - 1]);
+    };
+    bool mapped;
+    double referenceCents = centsOf(map.referenceKey, mapped);
+    if (!mapped) {
+        error = "reference key " + std::to_string(map.referenceKey) + " is not mapped";
+        return false;
+    }
+    table.name = name;
+    for (int key = 0; key < 128; key++) {
+        double cents = centsOf(key, mapped);
+        table.hz[key] = mapped ? map.referenceHz * std::pow(2.0, (cents - referenceCents) / 1200.0) : 0.0;
+    }
+    return true;
+}
+
+// Function to load a tuning from a .scl file and an optional .kbm file (empty path = Scala's default map)
+bool loadTuning(const std::string& sclPath, const std::string& kbmPath, TuningTable& table, std::string& error) {
+    std::ifstream scl(sclPath);
+    if (!scl) {
+        error = "cannot open " + sclPath;
+        return false;
+    }
+    ScalaScale scale;
+    if (!parseScala(scl, scale, error)) {
+        error = sclPath + ": " + error;
+        return false;
+    }
+    KeyboardMap map;
+    if (!kbmPath.empty()) {
+        std::ifstream kbm(kbmPath);
+        if (!kbm) {
+            error = "cannot open " + kbmPath;
+            return false;
+        }
+        if (!parseKeyboardMap(kbm, map, error)) {
+            error = kbmPath + ": " + error;
+            return false;
+        }
+    }
+    std::string name = sclPath.substr(sclPath.find_last_of("/\\") + 1);
+    if (!compileTuning(scale, map, name, table, error)) {
+        error = sclPath + ": " + error;
+        return false;
+    }
+    return true;
+}
+
+// Function to build the tunings every build has: equal temperament, 5-limit just intonation
+// (on C) and quarter-comma meantone, all with A4 = 440 Hz
+std::vector<TuningTable> builtInTunings() {
+    const char* const scales[][2] = {
+        {"12-tet", "equal\n12\n100.\n200.\n300.\n400.\n500.\n600.\n700.\n800.\n900.\n1000.\n1100.\n2/1\n"},
+        {"just", "5-limit just\n12\n16/15\n9/8\n6/5\n5/4\n4/3\n45/32\n3/2\n8/5\n5/3\n9/5\n15/8\n2/1\n"},
+        {"meantone", "1/4-comma meantone\n12\n76.049\n193.157\n310.265\n386.314\n503.422\n579.471\n696.578\n"
+                     "772.627\n889.735\n1006.843\n1082.892\n2/1\n"},
+    };
+    std::vector<TuningTable> tunings;
+    for (const auto& entry : scales) {
+        std::istringstream in(entry[1]);
+        ScalaScale scale;
+        std::string error;
+        TuningTable table;
+        parseScala(in, scale, error);
+        compileTuning(scale, KeyboardMap(), entry[0], table, error);
+        tunings.push_back(table);
+    }
+    return tunings;
+}
+
+// Tuning set class (every loaded tuning plus the one in use)
+// Tables are never changed or freed after they are added, so a reader holding the pointer from
+// current() is always safe; switching tuning is one atomic store, and notes already sounding
+// keep the frequency they were started with (the audio thread never looks at the table).
+class TuningSet {
+private:
+    std::vector<std::unique_ptr<const TuningTable>> tables;
+    std::atomic<const TuningTable*> active{nullptr};
+    std::atomic<size_t> activeIndex{0};
+
+public:
+    TuningSet() {
+        for (const auto& t : builtInTunings()) add(t);
+        select(0);
+    }
+
+    // Function to add a tuning, returns its index (keyboard thread only; other threads only use current())
+    size_t add(const TuningTable& table) {
+        tables.emplace_back(new TuningTable(table));
+        return tables.size() - 1;
+    }
+
+    // Function to switch tuning (keyboard thread only, like add; other threads only use current())
+    void select(size_t index) {
+        index %= tables.size();
+        activeIndex.store(index, std::memory_order_relaxed);
+        active.store(tables[index].get(), std::memory_order_release);
+    }
+    void next() { select(activeIndex.load(std::memory_order_relaxed) + 1); }
+
+    // Function to find a tuning with the same name and table, adding it if there is none (keyboard thread)
+    size_t addUnique(const TuningTable& table) {
+        for (size_t i = 0; i < tables.size(); i++) {
+            if (tables[i]->name == table.name && tables[i]->hz == table.hz) return i;
+        }
+        return add(table);
+    }
+
+    // Function to get the tuning in use (any thread, lock-free)
+    const TuningTable& current() const { return *active.load(std::memory_order_acquire); }
+};
+
+// Counter metric (only ever goes up, e.g. total notes played)
+// Each metric sits on its own cache line so threads updating different metrics never fight
+struct alignas(64) Counter {
+    std::atomic<unsigned long long> value{0};
+    void add(unsigned long long n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+};
+
+// Gauge metric (current level, e.g. voices sounding right now)
+struct alignas(64) Gauge {
+    std::atomic<long long> value{0};
+    void set(long long v) { value.store(v, std::memory_order_relaxed); }
+};
+
+// Histogram metric (distribution of durations, e.g. audio callback CPU time)
+struct alignas(64) Histogram {
+    static const int MAX_BUCKETS = 16;
+    double bounds[MAX_BUCKETS];        // Upper bound of each bucket in seconds (fixed at registration)
+    int numBounds = 0;
+    std::atomic<unsigned long long> buckets[MAX_BUCKETS + 1]; // Last bucket catches everything above
+    std::atomic<unsigned long long> sumNanos{0}; // Sum of observed values, in nanoseconds
+
+    // Function to record one observation in seconds (relaxed atomics, no locks)
+    void observe(double seconds) {
+        if (!(seconds > 0.0)) seconds = 0.0; // Event stamped ahead of the reading clock (or NaN): count it as 0
+        int b = 0;
+        while (b < numBounds && seconds > bounds[b]) b++;
+        buckets[b].fetch_add(1, std::memory_order_relaxed);
+        sumNanos.fetch_add(static_cast<unsigned long long>(seconds * 1e9), std::memory_order_relaxed);
+    }
+};
+
+// Metrics registry class
+// Metrics are registered once at startup; after that the hot paths only touch atomics and
+// the HTTP thread only reads them, so scraping never blocks the audio thread.
+class MetricsRegistry {
+private:
+    // Registry entry structure definition (name and help text for one metric)
+    struct Entry {
+        std::string name;
+        std::string help;
+        const Counter* counter = nullptr;
+        const Gauge* gauge = nullptr;
+        const Histogram* histogram = nullptr;
+    };
+    std::vector<Entry> entries;                        // In registration order
+    std::vector<std::unique_ptr<Counter>> counters;    // Owned storage (addresses never move)
+    std::vector<std::unique_ptr<Gauge>> gauges;
+    std::vector<std::unique_ptr<Histogram>> histograms;
+
+public:
+    // Function to register a counter
+    Counter& counter(const std::string& name, const std::string& help) {
+        counters.emplace_back(new Counter());
+        Entry e;
+        e.name = name;
+        e.help = help;
+        e.counter = counters.back().get();
+        entries.push_back(e);
+        return *counters.back();
+    }
+
+    // Function to register a gauge
+    Gauge& gauge(const std::string& name, const std::string& help) {
+        gauges.emplace_back(new Gauge());
+        Entry e;
+        e.name = name;
+        e.help = help;
+        e.gauge = gauges.back().get();
+        entries.push_back(e);
+        return *gauges.back();
+    }
+
+    // Function to register a histogram with the given bucket bounds (seconds)
+    Histogram& histogram(const std::string& name, const std::string& help, const std::vector<double>& bounds) {
+        histograms.emplace_back(new Histogram());
+        Histogram& h = *histograms.back();
+        h.numBounds = std::min(static_cast<int>(bounds.size()), static_cast<int>(Histogram::MAX_BUCKETS));
+        for (int i = 0; i < h.numBounds; i++) h.bounds[i] = bounds[i];
+        for (auto& b : h.buckets) b.store(0, std::memory_order_relaxed);
+        Entry e;
+        e.name = name;
+        e.help = help;
+        e.histogram = &h;
+        entries.push_back(e);
+        return h;
+    }
+
+    // Function to render every metric in the Prometheus text exposition format
+    std::string exposition() const {
+        std::ostringstream out;
+        for (const auto& e : entries) {
+            out << "# HELP " << e.name << " " << e.help << "\n";
+            if (e.counter) {
+                out << "# TYPE " << e.name << " counter\n";
+                out << e.name << " " << e.counter->value.load(std::memory_order_relaxed) << "\n";
+            } else if (e.gauge) {
+                out << "# TYPE " << e.name << " gauge\n";
+                out << e.name << " " << e.gauge->value.load(std::memory_order_relaxed) << "\n";
+            } else {
+                const Histogram& h = *e.histogram;
+                out << "# TYPE " << e.name << " histogram\n";
+                unsigned long long cumulative = 0; // Prometheus buckets are cumulative
+                for (int b = 0; b <= h.numBounds; b++) {
+                    cumulative += h.buckets[b].load(std::memory_order_relaxed);
+                    out << e.name << "_bucket{le=\"";
+                    if (b < h.numBounds) out << h.bounds[b];
+                    else out << "+Inf";
+                    out << "\"} " << cumulative << "\n";
+                }
+                out << e.name << "_sum " << h.sumNanos.load(std::memory_order_relaxed) / 1e9 << "\n";
+                out << e.name << "_count " << cumulative << "\n";
+            }
+        }
+        return out.str();
+    }
+};
+
+// Piano metrics structure definition (every metric the engine exports)
+struct PianoMetrics {
+    MetricsRegistry registry;
+    Counter& notesPlayed = registry.counter("piano_notes_played_total", "Notes started from the keyboard.");
+    Counter& scheduledNotes = registry.counter("piano_scheduled_notes_total", "Notes dispatched by recording playback.");
+    Counter& engineEvents = registry.counter("piano_engine_events_total", "Events consumed by the audio thread.");
+    Counter& queueOverflows = registry.counter("piano_event_queue_overflows_total", "Events dropped because the engine queue was full.");
+    Gauge& eventQueueDepth = registry.gauge("piano_event_queue_depth", "Events waiting for the audio thread at the start of the last block.");
+    Gauge& activeVoices = registry.gauge("piano_active_voices", "Voices sounding after the last block.");
+    Counter& xruns = registry.counter("piano_xruns_total", "Audio callbacks that missed their deadline.");
+    Gauge& periodFrames = registry.gauge("piano_period_frames", "Audio period size in frames.");
+    Histogram& callbackSeconds = registry.histogram("piano_callback_seconds", "CPU time spent rendering one audio period.",
+        {0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05});
+    Histogram& midiLatencySeconds = registry.histogram("piano_midi_latency_seconds", "Time from the MIDI timestamp until the audio thread picked the event up.",
+        {0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1});
+    Counter& recordingBytes = registry.counter("piano_recording_bytes_total", "Bytes appended to recordings.");
+};
+
+// Lock-free single producer / single consumer queue
+// Used to hand events from the keyboard thread to the audio thread without locks
+template <typename T, size_t Capacity>
+class SpscQueue {
+private:
+    T items[Capacity];               // Fixed storage, nothing is allocated after construction
+    std::atomic<size_t> head{0};     // Index of the next item to read (only moved by the consumer)
+    std::atomic<size_t> tail{0};     // Index of the next free slot (only moved by the producer)
+
+public:
+    // Function to add an item (producer side), returns false if the queue is full
+    bool push(const T& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t next = (t + 1) % Capacity;
+        if (next == head.load(std::memory_order_acquire)) return false; // Queue is full
+        items[t] = item;
+        tail.store(next, std::memory_order_release); // Publish the item to the consumer
+        return true;
+    }
+
+    // Function to take an item (consumer side), returns false if the queue is empty
+    bool pop(T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false; // Queue is empty
+        item = items[h];
+        head.store((h + 1) % Capacity, std::memory_order_release); // Give the slot back to the producer
+        return true;
+    }
+
+    // Function to estimate how many items are waiting (safe from either side)
+    size_t size() const {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_relaxed);
+        return (t + Capacity - h) % Capacity;
+    }
+};
+
+// Lock-free multi producer / multi consumer queue (bounded, one sequence number per slot)
+// Used as the ready list of the audio graph: any worker can push a node that became ready
+template <typename T, size_t Capacity>
+class MpmcQueue {
+private:
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+    struct Cell {
+        std::atomic<size_t> sequence; // Tells whether the slot is free or holds an item for this lap
+        T item;
+    };
+    Cell cells[Capacity];
+    alignas(64) std::atomic<size_t> tail{0}; // Next slot to write (producers)
+    alignas(64) std::atomic<size_t> head{0}; // Next slot to read (consumers)
+
+public:
+    MpmcQueue() {
+        for (size_t i = 0; i < Capacity; i++) cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // Function to add an item, returns false if the queue is full
+    bool push(const T& item) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[pos & (Capacity - 1)];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            long long diff = static_cast<long long>(seq) - static_cast<long long>(pos);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.item = item;
+                    cell.sequence.store(pos + 1, std::memory_order_release); // Publish to consumers
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;                 // Queue is full
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Function to take an item, returns false if the queue is empty
+    bool pop(T& item) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[pos & (Capacity - 1)];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            long long diff = static_cast<long long>(seq) - static_cast<long long>(pos + 1);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    item = cell.item;
+                    cell.sequence.store(pos + Capacity, std::memory_order_release); // Free the slot for the next lap
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;                 // Queue is empty
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+// Graph node interface (one processing step of the audio graph: a voice bank, a bus, an effect, the output)
+// process() gets one buffer per connected input port and writes one mono block to its output port.
+// It runs on whichever graph thread picks it up, so it may only touch its own state.
+class GraphNode {
+public:
+    virtual ~GraphNode() {}
+    virtual void process(const float* const* inputs, int inputCount, float* output, int frames) = 0;
+    virtual const char* describe() const = 0;
+};
+
+// Function node class (wraps a callable, used for the engine's voice banks)
+class FunctionNode : public GraphNode {
+private:
+    std::function<void(float*, int)> render; // Fills the output block, ignores inputs
+    const char* name;
+
+public:
+    FunctionNode(std::function<void(float*, int)> fn, const char* label) : render(std::move(fn)), name(label) {}
+
+    void process(const float* const*, int, float* output, int frames) override { render(output, frames); }
+    const char* describe() const override { return name; }
+};
+
+// Mix node class (sums every input port, then applies a gain)
+class MixNode : public GraphNode {
+private:
+    float gain;
+
+public:
+    explicit MixNode(float g = 1.0f) : gain(g) {}
+
+    void process(const float* const* inputs, int inputCount, float* output, int frames) override {
+        std::fill(output, output + frames, 0.0f);
+        for (int port = 0; port < inputCount; port++) {
+            const float* in = inputs[port];
+            for (int i = 0; i < frames; i++) output[i] += in[i];
+        }
+        if (gain != 1.0f) {
+            for (int i = 0; i < frames; i++) output[i] *= gain;
+        }
+    }
+    const char* describe() const override { return "mix"; }
+};
+
+const int MAX_BLOCK_FRAMES = 4096; // Largest block a graph processes in one go (longer requests are split)
+const int MAX_GRAPH_NODES = 256;   // Size of the ready list, so also the node limit of one graph
+const int GRAPH_SPIN_US = 200;      // How long graph workers spin after a block before parking
+const int GRAPH_PARK_MS = 1;        // Longest a parked graph worker sleeps before checking for a block
+
+// Audio graph class (nodes connected output -> input port, processed once per block)
+// Every node owns a buffer allocated when the graph is compiled. Each block the pending
+// counter of a node is reset to the number of its inputs; a node whose inputs are all done
+// goes on a lock-free ready list, and the audio thread plus the worker threads pull from it.
+// The last finished input of a node is what makes it ready, so no thread ever waits on a lock.
+class AudioGraph {
+private:
+    struct NodeSlot {
+        std::unique_ptr<GraphNode> node;
+        std::vector<int> inputs;          // Nodes feeding the input ports, in port order
+        std::vector<int> dependents;      // Nodes fed by this one
+        std::vector<float> buffer;        // Output port (MAX_BLOCK_FRAMES samples)
+        std::vector<const float*> inputBuffers; // Input port pointers, resolved once at compile time
+        std::atomic<int> pending{0};      // Inputs still to be processed this block
+    };
+
+    std::vector<std::unique_ptr<NodeSlot>> nodes;
+    std::vector<int> sources;             // Nodes without inputs (ready at the start of every block)
+    int outputNode = -1;                  // Sink whose output port is the caller's buffer
+    bool compiled = false;
+    MpmcQueue<int, MAX_GRAPH_NODES> ready; // Nodes whose inputs are all done
+    std::atomic<int> remaining{0};        // Nodes not yet processed this block
+    std::atomic<unsigned> blockNumber{0}; // Bumped to wake the workers for a new block
+    std::atomic<bool> stopping{false};
+    std::atomic<int> sleepers{0};         // Workers parked on the condition variable
+    std::mutex parkMutex;
+    std::condition_variable parked;       // Notified without the lock, so parked workers also time out
+    float* blockOutput = nullptr;         // Caller's buffer for the current block
+    int blockFrames = 0;                  // Length of the current block
+    std::vector<std::thread> workers;
+
+    // Function to process one node and release the nodes waiting on it (any graph thread)
+    void runNode(int index) {
+        NodeSlot& slot = *nodes[index];
+        float* out = index == outputNode ? blockOutput : slot.buffer.data();
+        slot.node->process(slot.inputBuffers.data(), static_cast<int>(slot.inputBuffers.size()), out, blockFrames);
+        for (int d : slot.dependents) {
+            if (nodes[d]->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) ready.push(d); // Last input done
+        }
+        remaining.fetch_sub(1, std::memory_order_acq_rel);
+    }
+
+    // Function to help with the current block until every node is done
+    void drain() {
+        int index;
+        while (remaining.load(std::memory_order_acquire) > 0) {
+            if (ready.pop(index)) runNode(index);
+            else std::this_thread::yield(); // A dependency is still running on another thread
+        }
+    }
+
+    // Function run by each worker thread
+    // Spins for a short while after each block (the next one often follows at once when the
+    // device catches up), then parks so an idle engine does not keep a core busy.
+    void workerLoop() {
+        nameThread("graph-worker");
+        unsigned seen = blockNumber.load();
+        auto idleSince = std::chrono::steady_clock::now();
+        while (!stopping.load(std::memory_order_acquire)) {
+            unsigned now = blockNumber.load();
+            if (now != seen) {
+                seen = now;
+                drain();
+                idleSince = std::chrono::steady_clock::now();
+                continue;
+            }
+            if (std::chrono::steady_clock::now() - idleSince < std::chrono::microseconds(GRAPH_SPIN_US)) {
+                std::this_thread::yield();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(parkMutex);
+            sleepers.fetch_add(1);
+            // A notify can slip in before we wait; the timeout bounds that to one block the audio thread drains alone
+            parked.wait_for(lock, std::chrono::milliseconds(GRAPH_PARK_MS),
+                            [&] { return blockNumber.load() != seen || stopping.load(); });
+            sleepers.fetch_sub(1);
+        }
+    }
+
+    // Function to wake parked workers (audio thread, never takes the lock)
+    void wakeWorkers() {
+        if (sleepers.load() == 0) return;
+        parked.notify_all();
+    }
+
+public:
+    ~AudioGraph() { setWorkers(0); }
+
+    // Function to add a node, returns its id (only before compile())
+    int addNode(std::unique_ptr<GraphNode> node) {
+        auto slot = std::unique_ptr<NodeSlot>(new NodeSlot());
+        slot->node = std::move(node);
+        nodes.push_back(std::move(slot));
+        compiled = false;
+        return static_cast<int>(nodes.size()) - 1;
+    }
+
+    // Function to connect the output port of one node to the next input port of another
+    void connect(int from, int to) {
+        nodes[to]->inputs.push_back(from);
+        nodes[from]->dependents.push_back(to);
+        compiled = false;
+    }
+
+    // Function to check the graph and allocate every buffer (not real-time safe)
+    // Returns false if the graph has a cycle, is too big, or the output node feeds another node
+    bool compile(int output, std::string& error) {
+        if (nodes.size() > static_cast<size_t>(MAX_GRAPH_NODES)) {
+            error = "graph has more than " + std::to_string(MAX_GRAPH_NODES) + " nodes";
+            return false;
+        }
+        if (output < 0 || output >= static_cast<int>(nodes.size()) || !nodes[output]->dependents.empty()) {
+            error = "output node must be a sink";
+            return false;
+        }
+        std::vector<int> indegree(nodes.size());
+        std::vector<int> order;               // Kahn's algorithm, only used to reject cycles
+        for (size_t i = 0; i < nodes.size(); i++) {
+            indegree[i] = static_cast<int>(nodes[i]->inputs.size());
+            if (indegree[i] == 0) order.push_back(static_cast<int>(i));
+        }
+        for (size_t next = 0; next < order.size(); next++) {
+            for (int d : nodes[order[next]]->dependents) {
+                if (--indegree[d] == 0) order.push_back(d);
+            }
+        }
+        if (order.size() != nodes.size()) {
+            error = "graph has a cycle";
+            return false;
+        }
+        sources.clear();
+        for (size_t i = 0; i < nodes.size(); i++) {
+            NodeSlot& slot = *nodes[i];
+            slot.buffer.assign(MAX_BLOCK_FRAMES, 0.0f);
+            if (slot.inputs.empty()) sources.push_back(static_cast<int>(i));
+        }
+        for (auto& slot : nodes) {            // After every buffer exists, so the pointers stay valid
+            slot->inputBuffers.clear();
+            for (int in : slot->inputs) slot->inputBuffers.push_back(nodes[in]->buffer.data());
+        }
+        outputNode = output;
+        compiled = true;
+        return true;
+    }
+
+    // Function to change the number of worker threads (0 = everything runs on the audio thread)
+    void setWorkers(int count) {
+        stopping.store(true, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> lock(parkMutex);
+            parked.notify_all();
+        }
+        for (auto& t : workers) t.join();
+        workers.clear();
+        stopping.store(false, std::memory_order_release);
+        for (int i = 0; i < count; i++) workers.emplace_back([this] { workerLoop(); });
+    }
+
+    int workerCount() const { return static_cast<int>(workers.size()); }
+    size_t nodeCount() const { return nodes.size(); }
+
+    // Function to process one block, the output node writes straight into out (audio thread)
+    void process(float* out, int frames) {
+        if (!compiled) {
+            std::fill(out, out + frames, 0.0f);
+            return;
+        }
+        while (frames > 0) {
+            int chunk = std::min(frames, MAX_BLOCK_FRAMES);
+            blockOutput = out;
+            blockFrames = chunk;
+            for (auto& slot : nodes) slot->pending.store(static_cast<int>(slot->inputs.size()), std::memory_order_relaxed);
+            remaining.store(static_cast<int>(nodes.size()), std::memory_order_release);
+            for (int s : sources) ready.push(s); // Release publishes the block settings to whoever pops
+            blockNumber.fetch_add(1);         // Sequentially consistent, paired with the sleepers count
+            wakeWorkers();
+            drain();                          // The audio thread works too, then waits for the last node
+            out += chunk;
+            frames -= chunk;
+        }
+    }
+};
+
+// Half-band filter class (low-pass at a quarter of the sample rate, for 2x up and down steps)
+// Windowed sinc with every other tap zero, so one 2x step costs BRANCH multiplies per
+// low-rate sample. The history is stored twice so the taps are always one contiguous run.
+class HalfBandFilter {
+public:
+    static const int TAPS = 63;               // 4k+3 taps: the centre tap lands on an odd index
+    static const int BRANCH = (TAPS + 1) / 2; // Non-zero taps besides the centre (even indexes)
+    static const int CENTER = (TAPS - 1) / 2;
+
+private:
+    float history[2 * TAPS] = {};             // Newest sample at history[position]
+    int position = 0;
+
+    // Function to get the even-index taps (built once, shared by every filter)
+    static const float* branch() {
+        static const std::array<float, BRANCH> taps = [] {
+            std::array<float, BRANCH> t{};
+            const double pi = 3.14159265358979323846;
+            double sum = 0.0;
+            for (int b = 0; b < BRANCH; b++) {
+                int k = 2 * b;
+                double d = k - CENTER;                                  // Always odd, never zero
+                double sinc = std::sin(pi * d / 2.0) / (pi * d / 2.0);
+                double window = 0.42 - 0.5 * std::cos(2.0 * pi * k / (TAPS - 1)) + 0.08 * std::cos(4.0 * pi * k / (TAPS - 1));
+                t[b] = static_cast<float>(0.5 * sinc * window);
+                sum += t[b];
+            }
+            for (auto& v : t) v = static_cast<float>(v * 0.5 / sum); // Branch sums to 1/2, centre is the other 1/2
+            return t;
+        }();
+        return taps.data();
+    }
+
+    void push(float x) {
+        position = (position == 0 ? TAPS : position) - 1;
+        history[position] = history[position + TAPS] = x;
+    }
+
+public:
+    void reset() {
+        std::fill(history, history + 2 * TAPS, 0.0f);
+        position = 0;
+    }
+
+    // Function to halve the rate: in has 2*count samples, out gets count
+    void down(const float* in, float* out, int count) {
+        const float* taps = branch();
+        for (int m = 0; m < count; m++) {
+            push(in[2 * m]);
+            push(in[2 * m + 1]);
+            const float* h = history + position;  // h[k] = k samples ago
+            float acc = 0.5f * h[CENTER];
+            for (int b = 0; b < BRANCH; b++) acc += taps[b] * h[2 * b];
+            out[m] = acc;
+        }
+    }
+
+    // Function to double the rate: in has count samples, out gets 2*count
+    void up(const float* in, float* out, int count) {
+        const float* taps = branch();
+        for (int m = 0; m < count; m++) {
+            push(in[m]);
+            const float* h = history + position;
+            float acc = 0.0f;
+            for (int b = 0; b < BRANCH; b++) acc += taps[b] * h[b];
+            out[2 * m] = 2.0f * acc;              // Zero stuffing halves the level, so double it
+            out[2 * m + 1] = h[(CENTER - 1) / 2]; // Centre tap (2 * 0.5) on the odd phase
+        }
+    }
+};
+
+const int MAX_OVERSAMPLE_STAGES = 3;  // 8x
+const int OVERSAMPLE_CHUNK = 256;     // Base-rate frames processed per pass (scratch stays small)
+
+// Oversampler class (cascade of half-band stages, 2x per stage)
+// Used around nonlinear steps only: take a block up to factor x the rate, apply the nonlinearity
+// there, and come back down, so the harmonics it creates above the base Nyquist are filtered out
+// instead of folding back as aliases.
+class Oversampler {
+private:
+    int stages = 0;                           // log2 of the factor
+    HalfBandFilter upFilters[MAX_OVERSAMPLE_STAGES];
+    HalfBandFilter downFilters[MAX_OVERSAMPLE_STAGES];
+    float scratch[2][OVERSAMPLE_CHUNK << MAX_OVERSAMPLE_STAGES]; // Ping-pong buffers between stages
+
+public:
+    // Function to set the factor (1, 2, 4 or 8) and clear the filters (not while rendering)
+    void setFactor(int factor) {
+        stages = 0;
+        while (stages < MAX_OVERSAMPLE_STAGES && (1 << stages) < factor) stages++;
+        for (auto& f : upFilters) f.reset();
+        for (auto& f : downFilters) f.reset();
+    }
+    int factor() const { return 1 << stages; }
+
+    // Function to run a nonlinearity at factor x the rate over a block (in place)
+    template <typename Shape>
+    void process(float* block, int frames, Shape shape) {
+        for (int start = 0; start < frames; start += OVERSAMPLE_CHUNK) {
+            int count = std::min(OVERSAMPLE_CHUNK, frames - start);
+            float* src = block + start;
+            for (int s = 0; s < stages; s++) {
+                float* dst = scratch[s & 1];
+                upFilters[s].up(src, dst, count << s);
+                src = dst;
+            }
+            int high = count << stages;
+            for (int i = 0; i < high; i++) src[i] = shape(src[i]);
+            if (stages == 0) continue;
+            for (int s = stages - 1; s >= 0; s--) {
+                float* dst = s == 0 ? block + start : scratch[(s + 1) & 1];
+                downFilters[s].down(src, dst, count << s);
+                src = dst;
+            }
+        }
+    }
+};
+
+// Decimator class (the down half of an oversampler, for sources generated at the high rate)
+class Decimator {
+private:
+    HalfBandFilter filters[MAX_OVERSAMPLE_STAGES];
+
+public:
+    void reset() {
+        for (auto& f : filters) f.reset();
+    }
+
+    // Function to bring block (frames << stages samples) down to frames samples, in place
+    void down(float* block, int frames, int stages) {
+        for (int s = stages - 1; s >= 0; s--) filters[s].down(block, block, frames << s); // Writes behind the reads
+    }
+};
+
+// Saturator node class (soft clipping on the master bus, oversampled so it does not alias)
+// drive 0 passes the signal through untouched
+class SaturatorNode : public GraphNode {
+private:
+    float drive = 0.0f;
+    Oversampler oversampler;
+
+public:
+    // Function to configure the node (not while rendering)
+    void configure(float amount, int factor) {
+        drive = amount;
+        if (factor != oversampler.factor()) oversampler.setFactor(factor); // Keep the filter state otherwise
+    }
+
+    void process(const float* const* inputs, int inputCount, float* output, int frames) override {
+        if (inputCount > 0) std::copy(inputs[0], inputs[0] + frames, output);
+        else std::fill(output, output + frames, 0.0f);
+        if (drive <= 0.0f) return;
+        const float k = drive;
+        const float norm = 1.0f / std::tanh(k);
+        oversampler.process(output, frames, [k, norm](float x) { return std::tanh(k * x) * norm; });
+    }
+    const char* describe() const override { return "saturator"; }
+};
+
+// Engine event type enumeration
+enum class EngineEventType : unsigned char { NoteOn, NoteOff, Sustain, Sostenuto };
+
+// Engine event structure definition (message from the keyboard thread to the audio thread)
+struct EngineEvent {
+    EngineEventType type;   // What happened
+    unsigned char key;      // MIDI note number (60 = middle C) the event belongs to
+    bool down;              // Pedal events: true when the pedal is pressed
+    double frequency;       // Frequency of the note to start in hertz
+    int gateFrames;         // Note-on only: samples until an automatic note-off (0 = wait for NoteOff)
+    Instrument instrument;  // Timbre to play
+    float gain;             // Loudness (1.0 = normal)
+    unsigned char velocity; // Strike strength (1-127), shapes loudness and brightness
+    long long timestampNs;  // When the event really happened (steady clock, 0 = not stamped)
+};
+
+// String state structure definition (Karplus-Strong delay loop of one voice)
+// The loop is an integer delay, a two-point weighted average (the string losses) and a first-order
+// allpass that supplies the fractional part of the period, so the pitch is exact.
+struct StringState {
+    float* buffer = nullptr;  // Ring buffer from the string pool (power of two length)
+    int sizeClass = -1;       // Pool class the buffer came from (-1 = none)
+    int mask = 0;             // Buffer length - 1
+    int position = 0;         // Next write index
+    int delay = 0;            // Integer part of the loop delay in samples
+    float allpass = 0.0f;     // Allpass coefficient for the fractional delay
+    float loss = 1.0f;        // Extra loop gain per period (low notes, sets the decay time)
+    float stretch = 0.5f;     // Weight of the previous sample in the average (high notes decay slower)
+    float lastOut = 0.0f;     // Previous delay output (averaging filter memory)
+    float apIn = 0.0f;        // Allpass input memory
+    float apOut = 0.0f;       // Allpass output memory
+
+    // Function to produce the next sample and feed it back into the loop
+    float tick() {
+        float out = buffer[(position - delay) & mask];
+        float averaged = loss * ((1.0f - stretch) * out + stretch * lastOut);
+        lastOut = out;
+        float shifted = allpass * (averaged - apOut) + apIn; // y = c*x + x[n-1] - c*y[n-1]
+        apIn = averaged;
+        apOut = shifted;
+        buffer[position] = shifted;
+        position = (position + 1) & mask;
+        return out;
+    }
+};
+
+// Voice structure definition (one sounding note inside the software synth)
+struct Voice {
+    bool active = false;    // True while the voice is producing sound
+    double phase = 0.0;     // Current position inside one wave cycle (0..1)
+    double phaseStep = 0.0; // How much the phase advances per sample (frequency / sample rate)
+    unsigned char key = 0;  // MIDI note number that started the voice
+    int gateLeft = -1;      // Samples until the automatic note-off (-1 = none pending)
+    bool releasing = false; // True once the note is let go (key up and no pedal holding it)
+    int releaseLeft = 0;    // Samples left in the release fade
+    float level = 1.0f;     // Natural decay of the struck string (goes down while the note is held)
+    int framesPlayed = 0;   // Samples produced so far (used for the attack ramp)
+    Instrument instrument = Instrument::Square; // Timbre of the voice
+    float gain = 1.0f;      // Loudness of the voice (zone gain times velocity amplitude)
+    float brightness = 1.0f; // Low-pass coefficient from the velocity (1 = fully open)
+    float filtered = 0.0f;  // Low-pass filter memory
+    bool gateExpired = false; // Automatic note-off reached during the last block (handled after it)
+    bool finished = false;  // Faded out during the last block, retired after it
+    StringState string;     // Delay loop (string instrument only)
+};
+
+// Key set structure definition (one bit per MIDI note, 128 bits)
+// Pedal changes walk only the set bits, so their cost follows the number of affected keys.
+struct KeySet {
+    unsigned long long words[2] = {0, 0};
+
+    void set(int key) { words[key >> 6] |= 1ULL << (key & 63); }
+    void reset(int key) { words[key >> 6] &= ~(1ULL << (key & 63)); }
+    bool test(int key) const { return (words[key >> 6] >> (key & 63)) & 1; }
+    void clear() { words[0] = words[1] = 0; }
+
+    // Function to call fn(key) for every key in the set
+    template <typename Fn>
+    void forEach(Fn fn) const {
+        for (int w = 0; w < 2; w++) {
+            unsigned long long bits = words[w];
+            while (bits) {
+                fn(w * 64 + lowestBit(bits));
+                bits &= bits - 1;           // Drop the lowest set bit
+            }
+        }
+    }
+
+    // Function to find the index of the lowest set bit (bits must not be 0)
+    static int lowestBit(unsigned long long bits) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward64(&index, bits);
+        return static_cast<int>(index);
+#else
+        return __builtin_ctzll(bits);
+#endif
+    }
+};
+
+// Sine wavetable class (one cycle of a sine, read with linear interpolation)
+class SineTable {
+private:
+    static const int SIZE = 2048;       // Points per cycle (power of two)
+    float table[SIZE + 1];              // One extra point so interpolation never wraps
+
+public:
+    SineTable() {
+        for (int i = 0; i <= SIZE; i++) table[i] = static_cast<float>(std::sin(2.0 * 3.14159265358979323846 * i / SIZE));
+    }
+
+    // Function to read the sine at phase (0..1)
+    float lookup(double phase) const {
+        double position = phase * SIZE;
+        int index = static_cast<int>(position);
+        float fraction = static_cast<float>(position - index);
+        return table[index] + (table[index + 1] - table[index]) * fraction;
+    }
+
+    // Function to read the sine at any phase (FM modulation pushes the phase outside 0..1)
+    float lookupWrapped(float phase) const {
+        float position = (phase - std::floor(phase)) * SIZE;
+        int index = static_cast<int>(position) & (SIZE - 1); // Rounding can land exactly on SIZE
+        float fraction = position - static_cast<float>(index);
+        return table[index] + (table[index + 1] - table[index]) * fraction;
+    }
+
+#ifdef __AVX2__
+    // Function to read the sine at eight phases at once (two gathers from the table)
+    __m256 lookupWrapped8(__m256 phase) const {
+        __m256 position = _mm256_mul_ps(_mm256_sub_ps(phase, _mm256_floor_ps(phase)), _mm256_set1_ps(static_cast<float>(SIZE)));
+        __m256i index = _mm256_and_si256(_mm256_cvttps_epi32(position), _mm256_set1_epi32(SIZE - 1));
+        __m256 fraction = _mm256_sub_ps(position, _mm256_cvtepi32_ps(index));
+        __m256 a = _mm256_i32gather_ps(table, index, 4);
+        __m256 b = _mm256_i32gather_ps(table + 1, index, 4);
+        return _mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(b, a), fraction));
+    }
+#endif
+};
+
+const SineTable SINE_TABLE; // Shared by every voice, built once at startup
+
+// Velocity response class
+// Precomputed per-velocity amplitude and brightness, so starting a note is two table loads.
+// Soft notes are quieter and darker (lower low-pass cutoff), hard notes louder and brighter.
+class VelocityResponse {
+private:
+    float amplitude[128];   // Velocity -> gain (about 40 dB of range, like a real piano)
+    float brightness[128];  // Velocity -> one-pole low-pass coefficient
+
+public:
+    VelocityResponse() {
+        for (int v = 0; v < 128; v++) {
+            double x = v / 127.0;
+            amplitude[v] = static_cast<float>(std::pow(10.0, (x - 1.0) * 2.0)); // -40 dB .. 0 dB
+            double cutoff = 600.0 * std::pow(20.0, x);                           // 600 Hz .. 12 kHz
+            brightness[v] = static_cast<float>(1.0 - std::exp(-2.0 * 3.14159265358979323846 * cutoff / SAMPLE_RATE));
+        }
+        amplitude[0] = 0.0f;
+    }
+
+    float amplitudeFor(unsigned char velocity) const { return amplitude[velocity & 127]; }
+    float brightnessFor(unsigned char velocity) const { return brightness[velocity & 127]; }
+};
+
+const VelocityResponse VELOCITY_RESPONSE; // Built once at startup, read by the audio thread
+
+// Velocity curve enumeration (how the measured strike strength is reshaped)
+enum class VelocityCurveKind : unsigned char { Linear, Soft, Hard, Fixed };
+const int NUM_VELOCITY_CURVES = 4;
+const char* const VELOCITY_CURVE_NAMES[NUM_VELOCITY_CURVES] = {"linear", "soft", "hard", "fixed"};
+
+// Velocity curve class (128-entry remap tables, built once)
+class VelocityCurves {
+private:
+    unsigned char tables[NUM_VELOCITY_CURVES][128];
+
+public:
+    VelocityCurves() {
+        for (int v = 0; v < 128; v++) {
+            double x = v / 127.0;
+            tables[0][v] = static_cast<unsigned char>(v);                                   // Linear
+            tables[1][v] = static_cast<unsigned char>(std::lround(127.0 * std::pow(x, 0.5))); // Soft: light touch plays louder
+            tables[2][v] = static_cast<unsigned char>(std::lround(127.0 * std::pow(x, 2.0))); // Hard: needs a heavy touch
+            tables[3][v] = 100;                                                             // Fixed: ignore the touch
+            if (v > 0 && tables[2][v] == 0) tables[2][v] = 1; // Never silence a struck key
+        }
+        tables[0][0] = tables[1][0] = tables[2][0] = 0;
+    }
+
+    // Function to reshape a velocity with the given curve (single table load)
+    unsigned char apply(VelocityCurveKind kind, unsigned char velocity) const {
+        return tables[static_cast<int>(kind)][velocity & 127];
+    }
+};
+
+const VelocityCurves VELOCITY_CURVES;
+
+// Velocity estimator class
+// A computer keyboard has no pressure sensor and _getch() only reports key-downs, so the
+// strike strength is estimated from the time since the previous key-down: quick runs and
+// repeated strikes come out stronger, isolated notes softer. MIDI input brings real velocities.
+class KeyTimingVelocity {
+private:
+    static const int BUCKET_MS = 16;    // Width of one interval bucket
+    static const int NUM_BUCKETS = 64;  // Intervals above ~1 s all share the last bucket
+    unsigned char table[NUM_BUCKETS];   // Interval bucket -> velocity
+    long long lastKeyDown = -1;         // Time of the previous key-down in milliseconds
+
+public:
+    KeyTimingVelocity() {
+        for (int b = 0; b < NUM_BUCKETS; b++) {
+            double x = static_cast<double>(b) / (NUM_BUCKETS - 1); // 0 = instant, 1 = a second or more
+            table[b] = static_cast<unsigned char>(std::lround(120.0 - 70.0 * std::sqrt(x))); // 120 .. 50
+        }
+    }
+
+    // Function to estimate the velocity of a key-down happening at nowMs
+    unsigned char onKeyDown(long long nowMs) {
+        long long interval = lastKeyDown < 0 ? 1000000 : nowMs - lastKeyDown;
+        lastKeyDown = nowMs;
+        long long bucket = std::min<long long>(NUM_BUCKETS - 1, std::max<long long>(0, interval / BUCKET_MS));
+        return table[bucket];
+    }
+};
+
+// FM routing templates (which operator modulates which, fixed at compile time per algorithm)
+// Operators are numbered 1..4; operator 4 has self-feedback. MODn_m = operator m modulates n.
+template <FmAlgorithm A> struct FmRouting;
+template <> struct FmRouting<FmAlgorithm::Stack> {      // 4 -> 3 -> 2 -> 1
+    static constexpr bool MOD3_4 = true, MOD2_3 = true, MOD2_4 = false, MOD1_2 = true, MOD1_3 = false, MOD1_4 = false;
+    static constexpr bool OUT1 = true, OUT2 = false, OUT3 = false, OUT4 = false;
+};
+template <> struct FmRouting<FmAlgorithm::Pairs> {      // 2 -> 1, 4 -> 3
+    static constexpr bool MOD3_4 = true, MOD2_3 = false, MOD2_4 = false, MOD1_2 = true, MOD1_3 = false, MOD1_4 = false;
+    static constexpr bool OUT1 = true, OUT2 = false, OUT3 = true, OUT4 = false;
+};
+template <> struct FmRouting<FmAlgorithm::Branch> {     // 2 + 3 + 4 -> 1
+    static constexpr bool MOD3_4 = false, MOD2_3 = false, MOD2_4 = false, MOD1_2 = true, MOD1_3 = true, MOD1_4 = true;
+    static constexpr bool OUT1 = true, OUT2 = false, OUT3 = false, OUT4 = false;
+};
+template <> struct FmRouting<FmAlgorithm::Additive> {   // Four sines, no modulation (organ-like)
+    static constexpr bool MOD3_4 = false, MOD2_3 = false, MOD2_4 = false, MOD1_2 = false, MOD1_3 = false, MOD1_4 = false;
+    static constexpr bool OUT1 = true, OUT2 = true, OUT3 = true, OUT4 = true;
+};
+
+// FM bank structure definition (four-operator FM for every voice of the engine)
+// The state is structure-of-arrays with one lane per voice, and every operator is evaluated for
+// eight voices at once (AVX2 when available), reading the shared sine wavetable.
+// The algorithm is a template parameter, so the routing costs nothing inside the loops.
+const int FM_OPERATORS = 4;
+const int FM_LANES = 8;               // Voices evaluated together (one AVX2 register of floats)
+
+struct FmPatch {
+    float ratio[FM_OPERATORS] = {1.0f, 2.0f, 1.0f, 3.5f};  // Operator frequency / note frequency
+    float level[FM_OPERATORS] = {1.0f, 0.9f, 0.6f, 0.4f};  // Carrier loudness, or modulation index in cycles
+    float decay[FM_OPERATORS] = {3.0f, 0.8f, 2.0f, 0.5f};  // Seconds to -60 dB (modulators fade faster: tone mellows)
+    float feedback = 0.1f;                                 // Operator 4 modulating itself
+};
+
+struct alignas(32) FmBank {
+    float phase[FM_OPERATORS][MAX_VOICES];   // Operator phase (0..1)
+    float step[FM_OPERATORS][MAX_VOICES];    // Phase increment per sample
+    float env[FM_OPERATORS][MAX_VOICES];     // Operator level, decaying
+    float fall[FM_OPERATORS][MAX_VOICES];    // Level multiplier per sample
+    float fb1[MAX_VOICES];                   // Last two outputs of operator 4 (averaged feedback is stable)
+    float fb2[MAX_VOICES];
+    float feedback[MAX_VOICES];              // Operator 4 self-modulation, from the patch the note started with
+
+    FmBank() { std::memset(static_cast<void*>(this), 0, sizeof(*this)); }
+
+    // Function to start a note in a lane (hardness 0..1 scales the modulation indexes)
+    void start(int lane, double frequency, const FmPatch& patch, float hardness) {
+        for (int op = 0; op < FM_OPERATORS; op++) {
+            phase[op][lane] = 0.0f;
+            step[op][lane] = static_cast<float>(frequency * patch.ratio[op] / SAMPLE_RATE);
+            float level = patch.level[op];
+            if (op > 0) level *= 0.5f + 0.5f * hardness; // Harder strikes are brighter (only matters for modulators)
+            env[op][lane] = level;
+            fall[op][lane] = static_cast<float>(std::pow(0.001, 1.0 / (patch.decay[op] * SAMPLE_RATE)));
+        }
+        fb1[lane] = fb2[lane] = 0.0f;
+        feedback[lane] = patch.feedback;
+    }
+
+    // Function to render lanes [first, last) for a block; out[frame * MAX_VOICES + lane]
+    // Lanes go in groups of FM_LANES copied to locals; with -mavx2 one group is one register and
+    // the table reads are gathers, otherwise plain loops over the group. last - first is a
+    // multiple of FM_LANES.
+    template <FmAlgorithm A>
+    void render(int first, int last, float* out, int frames) {
+        typedef FmRouting<A> R;
+        const float carriers = 1.0f / (R::OUT1 + R::OUT2 + R::OUT3 + R::OUT4);
+        for (int g = first; g < last; g += FM_LANES) {
+            float ph[FM_OPERATORS][FM_LANES], st[FM_OPERATORS][FM_LANES], en[FM_OPERATORS][FM_LANES], fa[FM_OPERATORS][FM_LANES];
+            float f1[FM_LANES], f2[FM_LANES], fbAmount[FM_LANES];
+            for (int op = 0; op < FM_OPERATORS; op++) {
+                for (int j = 0; j < FM_LANES; j++) {
+                    ph[op][j] = phase[op][g + j];
+                    st[op][j] = step[op][g + j];
+                    en[op][j] = env[op][g + j];
+                    fa[op][j] = fall[op][g + j];
+                }
+            }
+            for (int j = 0; j < FM_LANES; j++) {
+                f1[j] = fb1[g + j];
+                f2[j] = fb2[g + j];
+                fbAmount[j] = feedback[g + j] * 0.5f;
+            }
+            for (int i = 0; i < frames; i++) {
+                float result[FM_LANES];
+#ifdef __AVX2__
+                const __m256 zero = _mm256_setzero_ps();
+                __m256 prev1 = _mm256_loadu_ps(f1);
+                __m256 o4 = _mm256_mul_ps(SINE_TABLE.lookupWrapped8(_mm256_add_ps(_mm256_loadu_ps(ph[3]),
+                                              _mm256_mul_ps(_mm256_loadu_ps(fbAmount), _mm256_add_ps(prev1, _mm256_loadu_ps(f2))))),
+                                          _mm256_loadu_ps(en[3]));
+                __m256 o3 = _mm256_mul_ps(SINE_TABLE.lookupWrapped8(_mm256_add_ps(_mm256_loadu_ps(ph[2]), R::MOD3_4 ? o4 : zero)),
+                                          _mm256_loadu_ps(en[2]));
+                __m256 o2 = _mm256_mul_ps(SINE_TABLE.lookupWrapped8(_mm256_add_ps(_mm256_loadu_ps(ph[1]),
+                                              _mm256_add_ps(R::MOD2_3 ? o3 : zero, R::MOD2_4 ? o4 : zero))),
+                                          _mm256_loadu_ps(en[1]));
+                __m256 o1 = _mm256_mul_ps(SINE_TABLE.lookupWrapped8(_mm256_add_ps(_mm256_loadu_ps(ph[0]),
+                                              _mm256_add_ps(R::MOD1_2 ? o2 : zero, _mm256_add_ps(R::MOD1_3 ? o3 : zero, R::MOD1_4 ? o4 : zero)))),
+                                          _mm256_loadu_ps(en[0]));
+                __m256 mix = _mm256_add_ps(_mm256_add_ps(R::OUT1 ? o1 : zero, R::OUT2 ? o2 : zero),
+                                           _mm256_add_ps(R::OUT3 ? o3 : zero, R::OUT4 ? o4 : zero));
+                _mm256_storeu_ps(result, _mm256_mul_ps(mix, _mm256_set1_ps(carriers)));
+                _mm256_storeu_ps(f2, prev1);
+                _mm256_storeu_ps(f1, o4);
+                for (int op = 0; op < FM_OPERATORS; op++) {
+                    __m256 p = _mm256_add_ps(_mm256_loadu_ps(ph[op]), _mm256_loadu_ps(st[op]));
+                    _mm256_storeu_ps(ph[op], _mm256_sub_ps(p, _mm256_floor_ps(p)));
+                    _mm256_storeu_ps(en[op], _mm256_mul_ps(_mm256_loadu_ps(en[op]), _mm256_loadu_ps(fa[op])));
+                }
+#else
+                for (int j = 0; j < FM_LANES; j++) {
+                    float o4 = SINE_TABLE.lookupWrapped(ph[3][j] + fbAmount[j] * (f1[j] + f2[j])) * en[3][j];
+                    float o3 = SINE_TABLE.lookupWrapped(ph[2][j] + (R::MOD3_4 ? o4 : 0.0f)) * en[2][j];
+                    float o2 = SINE_TABLE.lookupWrapped(ph[1][j] + (R::MOD2_3 ? o3 : 0.0f) + (R::MOD2_4 ? o4 : 0.0f)) * en[1][j];
+                    float o1 = SINE_TABLE.lookupWrapped(ph[0][j] + (R::MOD1_2 ? o2 : 0.0f) + (R::MOD1_3 ? o3 : 0.0f) +
+                                                        (R::MOD1_4 ? o4 : 0.0f)) * en[0][j];
+                    result[j] = carriers * ((R::OUT1 ? o1 : 0.0f) + (R::OUT2 ? o2 : 0.0f) + (R::OUT3 ? o3 : 0.0f) +
+                                            (R::OUT4 ? o4 : 0.0f));
+                    f2[j] = f1[j];
+                    f1[j] = o4;
+                }
+                for (int op = 0; op < FM_OPERATORS; op++) {
+                    for (int j = 0; j < FM_LANES; j++) {
+                        float p = ph[op][j] + st[op][j];
+                        ph[op][j] = p - std::floor(p);
+                        en[op][j] *= fa[op][j];
+                    }
+                }
+#endif
+                std::memcpy(out + static_cast<size_t>(i) * MAX_VOICES + g, result, sizeof(result));
+            }
+            for (int op = 0; op < FM_OPERATORS; op++) {
+                for (int j = 0; j < FM_LANES; j++) {
+                    phase[op][g + j] = ph[op][j];
+                    env[op][g + j] = en[op][j];
+                }
+            }
+            for (int j = 0; j < FM_LANES; j++) {
+                fb1[g + j] = f1[j];
+                fb2[g + j] = f2[j];
+            }
+        }
+    }
+
+    // Function to render with the algorithm picked at run time (one switch per block, not per sample)
+    void render(FmAlgorithm algorithm, int first, int last, float* out, int frames) {
+        switch (algorithm) {
+        case FmAlgorithm::Pairs: render<FmAlgorithm::Pairs>(first, last, out, frames); break;
+        case FmAlgorithm::Branch: render<FmAlgorithm::Branch>(first, last, out, frames); break;
+        case FmAlgorithm::Additive: render<FmAlgorithm::Additive>(first, last, out, frames); break;
+        default: render<FmAlgorithm::Stack>(first, last, out, frames); break;
+        }
+    }
+};
+
+// Engine settings structure definition (sound parameters that may change while playing)
+// Published as one immutable object and picked up by the audio thread at the start of a block.
+struct EngineSettings {
+    FmAlgorithm fmAlgorithm = FmAlgorithm::Stack; // Operator wiring of the fm instrument
+    int oversample = 2;                           // Square voices and saturator (1, 2, 4 or 8)
+    float drive = 0.0f;                           // Master saturation (0 = off)
+};
+
+// String buffer pool class (ring buffers for string voices, handed out at note-on)
+// One power-of-two size class per octave of delay length, each with a slot for every voice,
+// so starting a string never allocates and never runs out. Audio thread only.
+class StringBufferPool {
+public:
+    static const int MIN_SIZE = 64;     // Smallest buffer (periods up to 63 samples, ~700 Hz and above)
+    static const int CLASSES = 6;       // 64 .. 2048 samples, lowest pitch ~21.5 Hz (below A0)
+    static const int MAX_SIZE = MIN_SIZE << (CLASSES - 1);
+
+private:
+    std::vector<float> storage;         // Every buffer of every class, allocated once
+    std::vector<int> freeSlots[CLASSES]; // Free slot numbers per class (capacity reserved up front)
+    size_t classOffset[CLASSES];        // Start of each class inside storage
+
+public:
+    StringBufferPool() {
+        size_t total = 0;
+        for (int c = 0; c < CLASSES; c++) {
+            classOffset[c] = total;
+            total += static_cast<size_t>(MIN_SIZE << c) * MAX_VOICES;
+            freeSlots[c].reserve(MAX_VOICES);
+            for (int slot = MAX_VOICES - 1; slot >= 0; slot--) freeSlots[c].push_back(slot);
+        }
+        storage.assign(total, 0.0f);
+    }
+
+    // Function to get a cleared buffer of at least length samples, returns its size class
+    int acquire(int length, float*& buffer) {
+        int c = 0;
+        while (c < CLASSES - 1 && (MIN_SIZE << c) < length) c++;
+        if (freeSlots[c].empty()) return -1; // Cannot happen with one slot per voice
+        int slot = freeSlots[c].back();
+        freeSlots[c].pop_back();
+        buffer = storage.data() + classOffset[c] + static_cast<size_t>(slot) * (MIN_SIZE << c);
+        std::fill(buffer, buffer + (MIN_SIZE << c), 0.0f);
+        return c;
+    }
+
+    // Function to give a buffer back
+    void release(int sizeClass, float* buffer) {
+        size_t slot = (buffer - storage.data() - classOffset[sizeClass]) / (MIN_SIZE << sizeClass);
+        freeSlots[sizeClass].push_back(static_cast<int>(slot));
+    }
+};
+
+// Modal bank structure definition (one piano note as MODAL_PARTIALS damped resonators)
+// Each partial is a two-pole resonator y[n] = a1*y[n-1] - a2*y[n-2], excited once at note-on.
+// The state is kept as structure-of-arrays so eight partials are updated with one AVX2 instruction.
+// Partials follow the stiff string law f_n = n*f0*sqrt(1 + B*n^2), B growing towards the treble.
+const int MODAL_PARTIALS = 32;        // Multiple of 8 (one AVX2 register)
+
+struct alignas(32) ModalBank {
+    float a1[MODAL_PARTIALS];         // 2*r*cos(theta)
+    float a2[MODAL_PARTIALS];         // r*r
+    float y1[MODAL_PARTIALS];         // Previous output
+    float y2[MODAL_PARTIALS];         // Output before that
+    float amp[MODAL_PARTIALS];        // Mix gain of each partial
+
+    // Function to tune the partials for a note and strike them (brightness = velocity low-pass coefficient)
+    void excite(double frequency, int key, float brightness) {
+        const double pi = 3.14159265358979323846;
+        double inharmonicity = std::pow(10.0, -3.8 + (key - 21) * 0.025); // ~1.6e-4 at A0 .. ~2e-2 at C8
+        double decayFirst = 8.0 * std::pow(2.0, -(key - 21) / 22.0);        // T60 of the fundamental, seconds
+        double cutoff = -std::log(1.0 - std::min(brightness, 0.999f)) * SAMPLE_RATE / (2.0 * pi); // Hammer hardness
+        double total = 0.0;
+        for (int n = 1; n <= MODAL_PARTIALS; n++) {
+            int p = n - 1;
+            double fn = n * frequency * std::sqrt(1.0 + inharmonicity * n * n);
+            if (fn >= 0.45 * SAMPLE_RATE) {   // Above Nyquist: silent and inert
+                a1[p] = a2[p] = y1[p] = y2[p] = amp[p] = 0.0f;
+                continue;
+            }
+            double theta = 2.0 * pi * fn / SAMPLE_RATE;
+            double decay = decayFirst / (1.0 + 0.15 * p);                   // Upper partials die sooner
+            double r = std::pow(0.001, 1.0 / (decay * SAMPLE_RATE));
+            double strike = std::fabs(std::sin(pi * n / 8.0));             // Hammer at 1/8 of the string
+            double weight = strike * std::exp(-fn / cutoff) / n;
+            a1[p] = static_cast<float>(2.0 * r * std::cos(theta));
+            a2[p] = static_cast<float>(r * r);
+            y1[p] = 0.0f;                                                   // Starts at zero: no click
+            y2[p] = static_cast<float>(-std::sin(theta) / r);
+            amp[p] = static_cast<float>(weight);
+            total += weight;
+        }
+        float scale = total > 0.0 ? static_cast<float>(1.0 / total) : 0.0f;
+        for (float& a : amp) a *= scale;
+    }
+
+    // Function to render a block of the note (overwrites out), eight partials at a time
+    void render(float* out, int frames) {
+#ifdef __AVX2__
+        const int CHUNK = 64;             // Lane sums of 64 frames stay in L1
+        alignas(32) float lanes[CHUNK * 8];
+        for (int start = 0; start < frames; start += CHUNK) {
+            int count = std::min(CHUNK, frames - start);
+            std::fill(lanes, lanes + count * 8, 0.0f);
+            for (int g = 0; g < MODAL_PARTIALS; g += 8) {
+                __m256 c1 = _mm256_load_ps(a1 + g);
+                __m256 c2 = _mm256_load_ps(a2 + g);
+                __m256 gain = _mm256_load_ps(amp + g);
+                __m256 s1 = _mm256_load_ps(y1 + g);
+                __m256 s2 = _mm256_load_ps(y2 + g);
+                for (int i = 0; i < count; i++) {
+                    __m256 y = _mm256_sub_ps(_mm256_mul_ps(c1, s1), _mm256_mul_ps(c2, s2));
+                    s2 = s1;
+                    s1 = y;
+                    float* lane = lanes + i * 8;
+                    _mm256_store_ps(lane, _mm256_add_ps(_mm256_load_ps(lane), _mm256_mul_ps(y, gain)));
+                }
+                _mm256_store_ps(y1 + g, s1);
+                _mm256_store_ps(y2 + g, s2);
+            }
+            for (int i = 0; i < count; i++) { // Horizontal sum of the eight lanes
+                __m256 v = _mm256_load_ps(lanes + i * 8);
+                __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+                sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+                sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x55));
+                out[start + i] = _mm_cvtss_f32(sum);
+            }
+        }
+#else
+        renderScalar(out, frames);
+#endif
+    }
+
+    // Function to render a block one partial at a time (builds without AVX2, and the benchmark baseline)
+    void renderScalar(float* out, int frames) {
+        std::fill(out, out + frames, 0.0f);
+        for (int p = 0; p < MODAL_PARTIALS; p++) {
+            float c1 = a1[p], c2 = a2[p], gain = amp[p], s1 = y1[p], s2 = y2[p];
+            for (int i = 0; i < frames; i++) {
+                float y = c1 * s1 - c2 * s2;
+                s2 = s1;
+                s1 = y;
+                out[i] += y * gain;
+            }
+            y1[p] = s1;
+            y2[p] = s2;
+        }
+    }
+};
+
+// Audio engine class (software replacement for the blocking Beep() call)
+// Notes have real note-on / note-off. A released key keeps sounding while the sustain
+// pedal is down, or while the sostenuto pedal latched it (it was held when the pedal went down).
+class AudioEngine {
+private:
+    static const int RELEASE_FRAMES = SAMPLE_RATE / 20; // 50 ms fade after a note is let go
+    SpscQueue<EngineEvent, 256> events; // Note requests waiting to be picked up by the audio thread
+    SpscQueue<EngineEvent, 1024> midiEvents; // Events from the MIDI input thread (its own producer)
+    Voice voices[MAX_VOICES];           // Fixed pool of voices, no allocation on the audio thread
+    std::atomic<long long> framesRendered{0}; // Total samples produced since start (engine clock)
+    PianoMetrics& metrics;              // Counters updated by the mixer
+    unsigned long long keyVoices[128] = {}; // Per key: bit mask of the voices it is sounding
+    KeySet keysDown;                    // Keys currently held
+    KeySet sustainedKeys;               // Keys released while the sustain pedal was down
+    KeySet sostenutoKeys;               // Keys latched by the sostenuto pedal
+    int gatesOpen[128] = {};            // Per key: automatic note-offs still pending
+    bool sustainDown = false;           // Sustain pedal state
+    bool sostenutoDown = false;         // Sostenuto pedal state
+    float decayPerSample;               // Level multiplier per sample while a note is held
+    static const int VOICES_PER_BANK = 16; // Voices rendered by one graph node
+    StringBufferPool stringBuffers;     // Delay lines for string voices
+    unsigned noiseSeed = 22222;         // Excitation noise (fixed seed, renders are repeatable)
+    ModalBank modalBanks[MAX_VOICES];   // Resonators of modal voices, same index as the voice
+    float voiceBlock[MAX_VOICES / VOICES_PER_BANK][MAX_BLOCK_FRAMES]; // One voice rendered ahead (modal, oversampled square), per graph bank
+    float highRate[MAX_VOICES / VOICES_PER_BANK][OVERSAMPLE_CHUNK << MAX_OVERSAMPLE_STAGES]; // Square wave before decimation, per graph bank
+    Decimator squareDecimators[MAX_VOICES]; // Anti-alias filters of square voices
+    int squareStages = 0;               // Square oscillators run at 2^stages x the rate (0 = naive)
+    SaturatorNode* saturator = nullptr; // Master soft clipper (owned by the graph)
+    FmBank fm;                          // Operators of fm voices, lane = voice index
+    FmPatch fmPatch;                    // Sound of the fm instrument
+    std::vector<float> fmBlock;         // FM output of a block, frame-major (frame * MAX_VOICES + voice)
+    FmAlgorithm fmAlgorithm = FmAlgorithm::Stack; // Audio thread copy of the settings
+    std::atomic<EngineSettings*> pendingSettings{nullptr}; // Published, not yet picked up by the audio thread
+    SpscQueue<EngineSettings*, 16> retiredSettings; // Picked up settings, freed by the publisher, never the audio thread
+    std::mutex publishLock;             // Serializes applySettings callers
+    Clock* clock = &systemClock();      // Time the MIDI timestamps are compared against
+    EngineSettings published;           // Last settings passed to applySettings
+    AudioGraph graph;                   // Voice banks -> master mix, may run on several cores
+
+    // Function to switch a voice off (finished or stolen) and detach it from its key
+    void retireVoice(int index) {
+        Voice& v = voices[index];
+        keyVoices[v.key] &= ~(1ULL << index);
+        v.active = false;
+        if (v.string.sizeClass >= 0) {    // Hand the delay line back to the pool
+            stringBuffers.release(v.string.sizeClass, v.string.buffer);
+            v.string.sizeClass = -1;
+        }
+        if (v.gateLeft > 0) {             // Its automatic note-off will never fire now
+            v.gateLeft = -1;
+            if (--gatesOpen[v.key] == 0) keyUp(v.key); // Do not leave the key stuck down
+        }
+    }
+
+    // Function to start the release fade of every voice of a key
+    void releaseKey(int key) {
+        unsigned long long mask = keyVoices[key];
+        while (mask) {
+            int index = KeySet::lowestBit(mask);
+            mask &= mask - 1;
+            Voice& v = voices[index];
+            if (!v.releasing) {
+                v.releasing = true;
+                v.releaseLeft = RELEASE_FRAMES;
+            }
+        }
+        keyVoices[key] = 0;               // Released voices no longer belong to the key
+    }
+
+    // Function to handle a key going up: release it unless a pedal holds it
+    void keyUp(int key) {
+        keysDown.reset(key);
+        if (sostenutoKeys.test(key)) return;      // Latched, released when the sostenuto comes up
+        if (sustainDown) sustainedKeys.set(key);  // Held by the sustain pedal
+        else releaseKey(key);
+    }
+
+    // Function to start a voice for a note-on event (audio thread only)
+    void startVoice(const EngineEvent& e) {
+        int target = 0;
+        for (int i = 0; i < MAX_VOICES; i++) { // Prefer a free voice, otherwise steal the quietest one
+            if (!voices[i].active) { target = i; break; }
+            if (voices[i].level * voices[i].gain < voices[target].level * voices[target].gain) target = i;
+        }
+        if (voices[target].active) retireVoice(target);
+        Voice& v = voices[target];
+        v.active = true;
+        v.phase = 0.0;
+        v.phaseStep = e.frequency / SAMPLE_RATE;
+        v.key = e.key;
+        v.gateLeft = e.gateFrames > 0 ? e.gateFrames : -1;
+        v.releasing = false;
+        v.releaseLeft = 0;
+        v.level = 1.0f;
+        v.framesPlayed = 0;
+        v.instrument = e.instrument;
+        v.gain = e.gain * VELOCITY_RESPONSE.amplitudeFor(e.velocity);
+        v.brightness = VELOCITY_RESPONSE.brightnessFor(e.velocity);
+        v.filtered = 0.0f;
+        v.gateExpired = false;
+        v.finished = false;
+        if (v.instrument == Instrument::String) startString(v, e.frequency);
+        if (v.instrument == Instrument::Square) squareDecimators[target].reset();
+        if (v.instrument == Instrument::Modal) {
+            modalBanks[target].excite(e.frequency, e.key, v.brightness);
+            v.brightness = 1.0f;              // The hammer already shaped the partials
+        }
+        if (v.instrument == Instrument::Fm) {
+            fm.start(target, e.frequency, fmPatch, e.velocity / 127.0f);
+            v.brightness = 1.0f;              // Velocity already sets the modulation depth
+        }
+        keyVoices[e.key] |= 1ULL << target;
+        keysDown.set(e.key);
+        sustainedKeys.reset(e.key);       // Struck again: the key is down, not pedal-held
+        if (e.gateFrames > 0) gatesOpen[e.key]++;
+    }
+
+    // Function to tune a string voice and excite it with a burst of noise (audio thread only)
+    void startString(Voice& v, double frequency) {
+        double period = SAMPLE_RATE / std::max(frequency, 1.0);
+        period = std::max(4.0, std::min(period, StringBufferPool::MAX_SIZE - 2.0));
+        double w = 2.0 * 3.14159265358979323846 / period; // Fundamental in radians per sample
+        StringState& st = v.string;
+        st = StringState();
+        // Per-period gain for a -60 dB decay in ~4 s. Low notes use a plain average plus extra loss;
+        // high notes would die almost at once that way, so the average is skewed until it only
+        // loses the wanted amount at the fundamental (Jaffe-Smith decay stretching)
+        double target = std::pow(0.001, period / (4.0 * SAMPLE_RATE));
+        double k = (1.0 - target * target) / (4.0 * std::sin(w / 2) * std::sin(w / 2));
+        double stretch = 0.5;
+        if (k < 0.25) stretch = (1.0 - std::sqrt(1.0 - 4.0 * k)) / 2.0;
+        else st.loss = static_cast<float>(target / std::cos(w / 2));
+        st.stretch = static_cast<float>(stretch);
+        double averageDelay = std::atan2(stretch * std::sin(w), 1.0 - stretch + stretch * std::cos(w)) / w;
+        st.delay = static_cast<int>(period - averageDelay - 0.1); // Leaves 0.1 .. 1.1 samples for the allpass
+        double fraction = period - averageDelay - st.delay;
+        st.allpass = static_cast<float>(std::sin((1.0 - fraction) * w / 2) / std::sin((1.0 + fraction) * w / 2));
+        st.sizeClass = stringBuffers.acquire(st.delay + 1, st.buffer);
+        if (st.sizeClass < 0) {                          // Pool exhausted: play a plain tone instead
+            v.instrument = Instrument::Sine;
+            return;
+        }
+        st.mask = (StringBufferPool::MIN_SIZE << st.sizeClass) - 1;
+        float shaped = 0.0f;                             // Soft strikes get a darker excitation
+        float mean = 0.0f;
+        for (int i = 0; i < st.delay; i++) {
+            noiseSeed = noiseSeed * 1664525u + 1013904223u;
+            float noise = static_cast<float>(noiseSeed >> 8) / 8388608.0f - 1.0f;
+            shaped += v.brightness * (noise - shaped);
+            st.buffer[i] = shaped;
+            mean += shaped;
+        }
+        mean /= st.delay;                                // The loop keeps DC almost forever, remove it
+        for (int i = 0; i < st.delay; i++) st.buffer[i] -= mean;
+        st.position = st.delay;
+        v.brightness = 1.0f;                             // Already shaped, skip the output filter
+    }
+
+    // Function to apply one event (audio thread only)
+    void handleEvent(const EngineEvent& e) {
+        switch (e.type) {
+        case EngineEventType::NoteOn:
+            startVoice(e);
+            break;
+        case EngineEventType::NoteOff:
+            keyUp(e.key);
+            break;
+        case EngineEventType::Sustain:
+            if (e.down == sustainDown) break;
+            sustainDown = e.down;
+            if (!sustainDown) {               // Let go of every key the pedal was holding
+                sustainedKeys.forEach([this](int key) {
+                    if (!keysDown.test(key) && !sostenutoKeys.test(key)) releaseKey(key);
+                });
+                sustainedKeys.clear();
+            }
+            break;
+        case EngineEventType::Sostenuto:
+            if (e.down == sostenutoDown) break;
+            sostenutoDown = e.down;
+            if (sostenutoDown) {
+                sostenutoKeys = keysDown;     // Latch exactly the keys held right now
+            } else {
+                sostenutoKeys.forEach([this](int key) {
+                    if (keysDown.test(key)) return;   // Still held by the finger
+                    if (sustainDown) sustainedKeys.set(key);
+                    else releaseKey(key);
+                });
+                sostenutoKeys.clear();
+            }
+            break;
+        }
+    }
+
+    // Function to queue an event for the audio thread
+    bool post(const EngineEvent& e) {
+        if (events.push(e)) return true;
+        metrics.queueOverflows.add();
+        return false;
+    }
+
+public:
+    // Function to queue an event from the MIDI input thread
+    bool postMidi(const EngineEvent& e) {
+        if (midiEvents.push(e)) return true;
+        metrics.queueOverflows.add();
+        return false;
+    }
+
+    AudioEngine(PianoMetrics& m)
+        : metrics(m), decayPerSample(static_cast<float>(std::exp(-1.0 / (3.0 * SAMPLE_RATE)))), // ~3 s decay
+          fmBlock(static_cast<size_t>(MAX_VOICES) * MAX_BLOCK_FRAMES) {
+        int master = graph.addNode(std::unique_ptr<GraphNode>(new MixNode()));
+        saturator = new SaturatorNode();
+        int output = graph.addNode(std::unique_ptr<GraphNode>(saturator));
+        graph.connect(master, output);
+        for (int first = 0; first < MAX_VOICES; first += VOICES_PER_BANK) {
+            int bank = graph.addNode(std::unique_ptr<GraphNode>(new FunctionNode(
+                [this, first](float* out, int frames) { renderVoices(first, first + VOICES_PER_BANK, out, frames); },
+                "voices")));
+            graph.connect(bank, master);
+        }
+        std::string error;
+        graph.compile(output, error);     // Fixed layout, cannot fail
+        useSettings(EngineSettings());
+    }
+
+    // Function to start a note (keyboard/MIDI thread), returns false if the queue overflowed
+    // gateMs > 0 sends the note-off automatically after that time (the console has no key-up)
+    bool noteOn(int key, double frequency, int gateMs, Instrument instrument = Instrument::Square, float gain = 1.0f,
+                unsigned char velocity = 100) {
+        EngineEvent e = {};
+        e.type = EngineEventType::NoteOn;
+        e.key = static_cast<unsigned char>(std::max(0, std::min(127, key)));
+        e.frequency = frequency;
+        e.gateFrames = gateMs * SAMPLE_RATE / 1000;
+        e.instrument = instrument;
+        e.gain = gain;
+        e.velocity = velocity;
+        return post(e);
+    }
+
+    // Function to let go of a key
+    bool noteOff(int key) {
+        EngineEvent e = {};
+        e.type = EngineEventType::NoteOff;
+        e.key = static_cast<unsigned char>(std::max(0, std::min(127, key)));
+        return post(e);
+    }
+
+    // Function to press or release the sustain pedal
+    bool sustain(bool down) {
+        EngineEvent e = {};
+        e.type = EngineEventType::Sustain;
+        e.down = down;
+        return post(e);
+    }
+
+    // Function to press or release the sostenuto pedal
+    bool sostenuto(bool down) {
+        EngineEvent e = {};
+        e.type = EngineEventType::Sostenuto;
+        e.down = down;
+        return post(e);
+    }
+
+    ~AudioEngine() {
+        collectSettings();
+        delete pendingSettings.load();
+    }
+
+    // Function to fill one block of mono samples (audio thread)
+    void render(float* out, int frames) {
+        if (EngineSettings* next = pendingSettings.exchange(nullptr, std::memory_order_acq_rel)) { // Block boundary
+            useSettings(*next);
+            retiredSettings.push(next);       // Cannot fill: the publisher empties it before every publish
+        }
+        metrics.eventQueueDepth.set(static_cast<long long>(events.size() + midiEvents.size()));
+        EngineEvent e;
+        int consumed = 0;
+        while (events.pop(e)) {              // Pick up every event posted since the last block
+            handleEvent(e);
+            consumed++;
+        }
+        if (midiEvents.pop(e)) {
+            long long nowNs = clock->nowNs(); // One clock read per block is enough for the latency metric
+            do {
+                if (e.timestampNs > 0) metrics.midiLatencySeconds.observe((nowNs - e.timestampNs) / 1e9);
+                handleEvent(e);
+                consumed++;
+            } while (midiEvents.pop(e));
+        }
+        if (consumed > 0) metrics.engineEvents.add(consumed);
+
+        graph.process(out, frames);          // Voice banks in parallel, then the master mix
+
+        for (int index = 0; index < MAX_VOICES; index++) { // Key bookkeeping stays on the audio thread
+            Voice& v = voices[index];
+            if (!v.active) continue;
+            if (v.gateExpired) {                 // Automatic note-off of a console note
+                v.gateExpired = false;
+                if (--gatesOpen[v.key] == 0) keyUp(v.key);
+            }
+            if (v.finished) retireVoice(index);  // Faded out (-60 dB)
+        }
+        int sounding = 0;
+        for (const auto& v : voices) sounding += v.active ? 1 : 0;
+        metrics.activeVoices.set(sounding);
+        framesRendered.fetch_add(frames, std::memory_order_relaxed);
+    }
+
+    // Function to change the sound settings; they apply from the next block (any thread except the audio thread)
+    void applySettings(const EngineSettings& settings) {
+        std::lock_guard<std::mutex> lock(publishLock); // Publishers only, the audio thread never takes it
+        collectSettings();
+        published = settings;
+        EngineSettings* stale = pendingSettings.exchange(new EngineSettings(settings), std::memory_order_acq_rel);
+        delete stale;                     // Replaced before the audio thread ever saw it
+    }
+
+    // Function to get the settings last passed to applySettings (any thread except the audio thread)
+    EngineSettings currentSettings() {
+        std::lock_guard<std::mutex> lock(publishLock);
+        return published;
+    }
+
+    // Function to free settings the audio thread has finished with (publishing thread)
+    void collectSettings() {
+        EngineSettings* old;
+        while (retiredSettings.pop(old)) delete old;
+    }
+
+    // Function to change where time comes from (before audio starts; tests use a VirtualClock)
+    void setClock(Clock& c) {
+        clock = &c;
+    }
+
+    // Function to set how many worker threads help the audio thread render the graph
+    void setGraphWorkers(int count) {
+        graph.setWorkers(count);
+    }
+
+    // Function to read the engine clock (number of samples produced)
+    long long getFramesRendered() const {
+        return framesRendered.load(std::memory_order_relaxed);
+    }
+
+private:
+    // Function to switch to new settings between blocks (audio thread, no allocation)
+    void useSettings(const EngineSettings& settings) {
+        fmAlgorithm = settings.fmAlgorithm;
+        int stages = 0;
+        while (stages < MAX_OVERSAMPLE_STAGES && (1 << stages) < settings.oversample) stages++;
+        if (stages != squareStages) {
+            squareStages = stages;
+            for (auto& d : squareDecimators) d.reset();
+        }
+        saturator->configure(settings.drive, 1 << stages);
+    }
+
+    // Function to render a square voice at 2^squareStages x the rate and filter it back down (graph thread)
+    // A naive square has harmonics far above Nyquist that fold back as inharmonic tones on high notes.
+    // Works on a copy of the phase: render() advances the voice phase the usual way.
+    void renderSquare(const Voice& v, int index, float* out, float* high, int frames) {
+        double phase = v.phase;
+        double step = v.phaseStep / (1 << squareStages);
+        for (int start = 0; start < frames; start += OVERSAMPLE_CHUNK) {
+            int count = std::min(OVERSAMPLE_CHUNK, frames - start);
+            int samples = count << squareStages;
+            for (int i = 0; i < samples; i++) {
+                high[i] = phase < 0.5 ? 1.0f : -1.0f;
+                phase += step;
+                if (phase >= 1.0) phase -= 1.0;
+            }
+            squareDecimators[index].down(high, count, squareStages);
+            std::copy(high, high + count, out + start);
+        }
+    }
+
+    // Function to render a bank of voices into a block (graph thread)
+    // Only touches the voices of the bank; key state changes are left to render() afterwards
+    void renderVoices(int first, int last, float* out, int frames) {
+        const int ramp = SAMPLE_RATE / 200;  // 5 ms fade in so notes do not click
+        std::fill(out, out + frames, 0.0f);
+        bool anyFm = false;
+        for (int index = first; index < last; index++) anyFm |= voices[index].active && voices[index].instrument == Instrument::Fm;
+        if (anyFm) fm.render(fmAlgorithm, first, last, fmBlock.data(), frames);
+        for (int index = first; index < last; index++) {
+            Voice& v = voices[index];
+            if (!v.active || v.finished) continue;
+            float* ahead = voiceBlock[first / VOICES_PER_BANK];
+            if (v.instrument == Instrument::Modal) modalBanks[index].render(ahead, frames);
+            if (v.instrument == Instrument::Square && squareStages > 0) {
+                renderSquare(v, index, ahead, highRate[first / VOICES_PER_BANK], frames);
+            }
+            bool fadeIn = v.instrument != Instrument::String && v.instrument != Instrument::Modal; // Struck models start at zero
+            for (int i = 0; i < frames; i++) {
+                if (v.gateLeft > 0 && --v.gateLeft == 0) { // Gate ran out, the note-off is sent after the block
+                    v.gateLeft = -1;
+                    v.gateExpired = true;
+                }
+                float gain = 0.2f * v.gain * v.level; // Square waves are loud, keep headroom for chords
+                if (fadeIn && v.framesPlayed < ramp) gain *= static_cast<float>(v.framesPlayed) / ramp;
+                if (v.releasing) {
+                    if (v.releaseLeft <= 0) break;
+                    gain *= static_cast<float>(v.releaseLeft) / RELEASE_FRAMES;
+                    v.releaseLeft--;
+                }
+                float sample;
+                switch (v.instrument) {
+                case Instrument::Sine: sample = SINE_TABLE.lookup(v.phase) * 1.5f; break; // Sine sounds quieter, boost it
+                case Instrument::Triangle: sample = static_cast<float>(4.0 * std::fabs(v.phase - 0.5) - 1.0) * 1.5f; break;
+                case Instrument::String: sample = v.string.tick() * 2.0f; break; // Noise burst is quieter than a square
+                case Instrument::Modal: sample = ahead[i] * 4.0f; break;
+                case Instrument::Fm: sample = fmBlock[static_cast<size_t>(i) * MAX_VOICES + index] * 1.5f; break;
+                default: sample = squareStages > 0 ? ahead[i] : (v.phase < 0.5 ? 1.0f : -1.0f); break; // Square wave, same timbre as Beep()
+                }
+                v.filtered += v.brightness * (sample - v.filtered); // Velocity-controlled brightness
+                out[i] += v.filtered * gain;
+                v.phase += v.phaseStep;
+                if (v.phase >= 1.0) v.phase -= 1.0;
+                v.level *= decayPerSample;
+                v.framesPlayed++;
+            }
+            if ((v.releasing && v.releaseLeft <= 0) || v.level < 0.001f) v.finished = true;
+        }
+    }
+};
+
+// Load node class (fixed amount of DSP per sample, stands in for a voice bank or effect in the benchmark)
+class LoadNode : public GraphNode {
+private:
+    float state[16] = {};             // One-pole filter chain
+    double phase = 0.0;
+
+public:
+    void process(const float* const*, int, float* output, int frames) override {
+        for (int i = 0; i < frames; i++) {
+            float x = SINE_TABLE.lookup(phase);
+            phase += 0.01;
+            if (phase >= 1.0) phase -= 1.0;
+            for (float& s : state) x = s += 0.3f * (x - s);
+            output[i] = x;
+        }
+    }
+    const char* describe() const override { return "load"; }
+};
+
+// Function to measure how the per-block time of a graph scales with its width (--bench-graph)
+// Each graph is `width` load nodes feeding one mix node, timed with no workers and with one per core
+void runGraphBenchmark(std::ostream& out) {
+    const int frames = 256;           // ~5.8 ms at 44.1 kHz
+    const int blocks = 2000;
+    int cores = static_cast<int>(std::thread::hardware_concurrency());
+    int parallelWorkers = std::max(1, cores - 1); // The audio thread is the last core
+    std::vector<float> buffer(frames);
+    out << "Graph benchmark: " << frames << " frames per block, " << blocks << " blocks, "
+        << parallelWorkers << " workers + audio thread\n";
+    out << "width   serial mean us   parallel mean us   parallel p99 us   speedup\n";
+    for (int width = 1; width <= 128; width *= 2) {
+        AudioGraph graph;
+        int mix = graph.addNode(std::unique_ptr<GraphNode>(new MixNode(1.0f / width)));
+        for (int i = 0; i < width; i++) graph.connect(graph.addNode(std::unique_ptr<GraphNode>(new LoadNode())), mix);
+        std::string error;
+        graph.compile(mix, error);
+        double mean[2] = {};
+        double p99 = 0.0;
+        for (int pass = 0; pass < 2; pass++) {
+            graph.setWorkers(pass == 0 ? 0 : parallelWorkers);
+            for (int i = 0; i < 50; i++) graph.process(buffer.data(), frames); // Warm up caches and threads
+            std::vector<double> times(blocks);
+            for (int i = 0; i < blocks; i++) {
+                long long start = steadyNanos();
+                graph.process(buffer.data(), frames);
+                times[i] = (steadyNanos() - start) / 1000.0;
+                mean[pass] += times[i];
+            }
+            mean[pass] /= blocks;
+            std::sort(times.begin(), times.end());
+            if (pass == 1) p99 = times[blocks * 99 / 100];
+        }
+        graph.setWorkers(0);
+        char line[128];
+        std::snprintf(line, sizeof(line), "%5d   %14.1f   %16.1f   %15.1f   %6.2fx\n", width, mean[0], mean[1], p99,
+                      mean[1] > 0 ? mean[0] / mean[1] : 0.0);
+        out << line;
+    }
+}
+
+// Work-stealing thread pool (offline rendering, batch conversion, analysis, anything not real-time)
+// Each worker owns a deque: it pushes and pops its own tasks at the bottom (newest first, warm
+// caches), idle workers steal from the top of someone else's deque (oldest, usually the biggest
+// piece of work). Tasks submitted from outside the pool go through one shared injection queue.
+class TaskGroup;
+
+// Pool task structure definition
+struct PoolTask {
+    std::function<void()> fn;       // The work
+    TaskGroup* group;               // Group that waits for it
+};
+
+// Work deque class (Chase-Lev: lock-free for the owner, stealers race on one CAS)
+class WorkDeque {
+private:
+    static const long long CAPACITY = 4096; // Power of two; the owner runs a task inline when full
+    alignas(64) std::atomic<long long> top{0};    // Next task to steal
+    alignas(64) std::atomic<long long> bottom{0}; // Next free slot of the owner
+    std::atomic<PoolTask*> slots[CAPACITY];
+
+public:
+    // Function to add a task (owner only), returns false if the deque is full
+    bool push(PoolTask* task) {
+        long long b = bottom.load(std::memory_order_relaxed);
+        if (b - top.load(std::memory_order_acquire) >= CAPACITY) return false;
+        slots[b & (CAPACITY - 1)].store(task, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Function to take the newest task (owner only)
+    PoolTask* pop() {
+        long long b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long t = top.load(std::memory_order_relaxed);
+        if (t > b) {                          // Empty
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        PoolTask* task = slots[b & (CAPACITY - 1)].load(std::memory_order_relaxed);
+        if (t == b) {                         // Last task: race the stealers for it
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) task = nullptr;
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    // Function to take the oldest task (any thread)
+    PoolTask* steal() {
+        long long t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long b = bottom.load(std::memory_order_acquire);
+        if (t >= b) return nullptr;
+        PoolTask* task = slots[t & (CAPACITY - 1)].load(std::memory_order_relaxed);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) return nullptr;
+        return task;
+    }
+};
+
+class WorkStealingPool {
+private:
+    friend class TaskGroup;
+    std::vector<std::unique_ptr<WorkDeque>> deques; // One per worker
+    std::vector<std::thread> threads;
+    std::mutex injectionMutex;
+    std::vector<PoolTask*> injection;     // Tasks from threads outside the pool (taken LIFO, order does not matter)
+    std::atomic<int> injected{0};         // Size of the injection queue, read without the lock
+    std::atomic<int> sleepers{0};         // Workers waiting on the condition variable
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<bool> stopping{false};
+    std::atomic<long long> steals{0};     // Tasks taken from another worker's deque
+
+    static thread_local WorkStealingPool* currentPool; // Pool the calling thread works for
+    static thread_local int currentWorker;             // Its deque index
+
+    // Function to get the deque index of the calling thread (-1 if it is not one of our workers)
+    int self() const { return currentPool == this ? currentWorker : -1; }
+
+    // Function to queue a task from any thread
+    void submit(PoolTask* task) {
+        int me = self();
+        if (me >= 0) {
+            if (!deques[me]->push(task)) {    // Deque full: running it now is the cheapest back pressure
+                execute(task);
+                return;
+            }
+        } else {
+            std::lock_guard<std::mutex> lock(injectionMutex);
+            injection.push_back(task);
+            injected.fetch_add(1, std::memory_order_release);
+        }
+        if (sleepers.load(std::memory_order_acquire) > 0) wake.notify_one();
+    }
+
+    // Function to find a task: own deque, then the injection queue, then steal from a random victim
+    PoolTask* find(int me) {
+        if (me >= 0) {
+            if (PoolTask* task = deques[me]->pop()) return task;
+        }
+        if (injected.load(std::memory_order_acquire) > 0) {
+            std::lock_guard<std::mutex> lock(injectionMutex);
+            if (!injection.empty()) {
+                PoolTask* task = injection.back();
+                injection.pop_back();
+                injected.fetch_sub(1, std::memory_order_release);
+                return task;
+            }
+        }
+        static thread_local unsigned seed = 0x9e3779b9u ^ static_cast<unsigned>(std::hash<std::thread::id>()(std::this_thread::get_id()));
+        seed ^= seed << 13;                   // xorshift, so victims differ between thieves
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        size_t count = deques.size();
+        for (size_t i = 0; i < count; i++) {
+            size_t victim = (seed + i) % count;
+            if (static_cast<int>(victim) == me) continue;
+            if (PoolTask* task = deques[victim]->steal()) {
+                steals.fetch_add(1, std::memory_order_relaxed);
+                return task;
+            }
+        }
+        return nullptr;
+    }
+
+    // Function to run one task and report it to its group (cancelled groups skip the work)
+    void execute(PoolTask* task);
+
+    // Function to run one task if there is any, returns false when nothing was found
+    bool runOne(int me) {
+        PoolTask* task = find(me);
+        if (!task) return false;
+        execute(task);
+        return true;
+    }
+
+    // Function run by each worker thread
+    void workerLoop(int index) {
+        nameThread("pool-worker");
+        currentPool = this;
+        currentWorker = index;
+        int idle = 0;
+        while (!stopping.load(std::memory_order_acquire)) {
+            if (runOne(index)) {
+                idle = 0;
+                continue;
+            }
+            if (++idle < 64) {                // Spin a little, new work usually follows quickly
+                std::this_thread::yield();
+                continue;
+            }
+            sleepers.fetch_add(1, std::memory_order_acq_rel);
+            {
+                std::unique_lock<std::mutex> lock(sleepMutex);
+                wake.wait_for(lock, std::chrono::milliseconds(1)); // Timeout covers a missed notify
+            }
+            sleepers.fetch_sub(1, std::memory_order_acq_rel);
+        }
+        currentPool = nullptr;
+    }
+
+public:
+    explicit WorkStealingPool(int threadCount) {
+        threadCount = std::max(1, threadCount);
+        for (int i = 0; i < threadCount; i++) deques.emplace_back(new WorkDeque());
+        for (int i = 0; i < threadCount; i++) threads.emplace_back([this, i] { workerLoop(i); });
+    }
+
+    ~WorkStealingPool() {
+        stopping.store(true, std::memory_order_release);
+        wake.notify_all();
+        for (auto& t : threads) t.join();
+        for (PoolTask* task : injection) delete task; // Only left over if a group was never waited on
+    }
+
+    int size() const { return static_cast<int>(threads.size()); }
+    long long stealCount() const { return steals.load(std::memory_order_relaxed); }
+};
+
+thread_local WorkStealingPool* WorkStealingPool::currentPool = nullptr;
+thread_local int WorkStealingPool::currentWorker = -1;
+
+// Task group class (tasks that are waited for, or cancelled, together)
+// wait() does not block: the waiting thread runs pool tasks until the group is done,
+// so groups can be nested inside tasks without running out of threads.
+class TaskGroup {
+private:
+    friend class WorkStealingPool;
+    WorkStealingPool& pool;
+    std::atomic<int> pending{0};          // Tasks queued or running
+    std::atomic<bool> cancelFlag{false};
+
+public:
+    explicit TaskGroup(WorkStealingPool& p) : pool(p) {}
+    ~TaskGroup() { wait(); }
+
+    // Function to queue a task in the group
+    void run(std::function<void()> fn) {
+        pending.fetch_add(1, std::memory_order_relaxed);
+        pool.submit(new PoolTask{std::move(fn), this});
+    }
+
+    // Function to wait for every task of the group, helping with any pool work meanwhile
+    void wait() {
+        int me = pool.self();
+        while (pending.load(std::memory_order_acquire) > 0) {
+            if (!pool.runOne(me)) std::this_thread::yield();
+        }
+    }
+
+    // Function to cancel the group: queued tasks are dropped, running tasks can poll cancelled()
+    void cancel() { cancelFlag.store(true, std::memory_order_release); }
+    bool cancelled() const { return cancelFlag.load(std::memory_order_acquire); }
+};
+
+void WorkStealingPool::execute(PoolTask* task) {
+    TaskGroup* group = task->group;
+    if (!group->cancelled()) task->fn();
+    delete task;
+    group->pending.fetch_sub(1, std::memory_order_acq_rel); // Last: the group may be destroyed right after
+}
+
+// Function to get the pool shared by every offline job (created on first use, one worker per core)
+WorkStealingPool& sharedPool() {
+    static WorkStealingPool pool(static_cast<int>(std::max(1u, std::thread::hardware_concurrency())));
+    return pool;
+}
+
+// Mutex queue pool class (one locked queue for every thread, only kept as the benchmark baseline)
+class MutexQueuePool {
+private:
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::function<void()>> queue;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+
+public:
+    explicit MutexQueuePool(int threadCount) {
+        for (int i = 0; i < std::max(1, threadCount); i++) {
+            threads.emplace_back([this] {
+                for (;;) {
+                    std::function<void()> fn;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        ready.wait(lock, [this] { return stopping || !queue.empty(); });
+                        if (queue.empty()) return;
+                        fn = std::move(queue.front());
+                        queue.pop_front();
+                    }
+                    fn();
+                }
+            });
+        }
+    }
+
+    ~MutexQueuePool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto& t : threads) t.join();
+    }
+
+    void post(std::function<void()> fn) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(std::move(fn));
+        }
+        ready.notify_one();
+    }
+};
+
+// Function to do a small fixed amount of work (benchmark task body)
+float benchWork(int seed) {
+    float sum = 0.0f;
+    double phase = (seed % 1000) / 1000.0;
+    for (int i = 0; i < 200; i++) {
+        sum += SINE_TABLE.lookup(phase);
+        phase += 0.0123;
+        if (phase >= 1.0) phase -= 1.0;
+    }
+    return sum;
+}
+
+// Function to compare the work-stealing pool with the mutex queue pool (--bench-pool)
+// "flat": many small tasks queued from the main thread. "tree": every task splits in two
+// until the leaves, so new work appears on the workers themselves (the case stealing is for).
+void runPoolBenchmark(std::ostream& out) {
+    const int flatTasks = 100000;
+    const int treeDepth = 16;             // 65536 leaves
+    int cores = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    out << "Pool benchmark: " << flatTasks << " flat tasks, tree of depth " << treeDepth << ", " << cores << " cores\n";
+    out << "threads   flat ws ms   flat mutex ms   tree ws ms   tree mutex ms   steals\n";
+    std::atomic<float> sink{0.0f};        // Keeps the work from being optimised away
+    for (int threads = 1; threads <= std::max(2, cores); threads *= 2) {
+        double times[4];
+        long long stealCount;
+        {
+            WorkStealingPool pool(threads);
+            long long start = steadyNanos();
+            {
+                TaskGroup group(pool);
+                for (int i = 0; i < flatTasks; i++) group.run([i, &sink] { sink.store(benchWork(i), std::memory_order_relaxed); });
+            }
+            times[0] = (steadyNanos() - start) / 1e6;
+            start = steadyNanos();
+            {
+                TaskGroup group(pool);
+                std::function<void(int, int)> split = [&](int depth, int seed) {
+                    if (depth == 0) {
+                        sink.store(benchWork(seed), std::memory_order_relaxed);
+                        return;
+                    }
+                    group.run([&split, depth, seed] { split(depth - 1, seed * 2); });
+                    group.run([&split, depth, seed] { split(depth - 1, seed * 2 + 1); });
+                };
+                split(treeDepth, 1);
+                group.wait();                 // Before split goes out of scope
+            }
+            times[2] = (steadyNanos() - start) / 1e6;
+            stealCount = pool.stealCount();
+        }
+        {
+            MutexQueuePool pool(threads);
+            std::atomic<int> left{flatTasks};
+            long long start = steadyNanos();
+            for (int i = 0; i < flatTasks; i++) {
+                pool.post([i, &sink, &left] {
+                    sink.store(benchWork(i), std::memory_order_relaxed);
+                    left.fetch_sub(1, std::memory_order_release);
+                });
+            }
+            while (left.load(std::memory_order_acquire) > 0) std::this_thread::yield();
+            times[1] = (steadyNanos() - start) / 1e6;
+            left.store(1 << treeDepth);
+            start = steadyNanos();
+            std::function<void(int, int)> split = [&](int depth, int seed) {
+                if (depth == 0) {
+                    sink.store(benchWork(seed), std::memory_order_relaxed);
+                    left.fetch_sub(1, std::memory_order_release);
+                    return;
+                }
+                pool.post([&split, depth, seed] { split(depth - 1, seed * 2); });
+                pool.post([&split, depth, seed] { split(depth - 1, seed * 2 + 1); });
+            };
+            split(treeDepth, 1);
+            while (left.load(std::memory_order_acquire) > 0) std::this_thread::yield();
+            times[3] = (steadyNanos() - start) / 1e6;
+        }
+        char line[128];
+        std::snprintf(line, sizeof(line), "%7d   %10.1f   %13.1f   %10.1f   %13.1f   %6lld\n", threads, times[0], times[1],
+                      times[2], times[3], stealCount);
+        out << line;
+    }
+}
+
+// Function to measure the rendering cost of one voice of each instrument (--bench-voices)
+// There is no sample player to compare with, so the oscillators are the baseline for the string
+void runVoiceBenchmark(std::ostream& out) {
+    const int voicesPerRun = 32;
+    const int frames = 256;
+    const int blocks = SAMPLE_RATE * 2 / frames; // Two seconds of sound per instrument
+    std::vector<float> buffer(frames);
+    out << "Voice benchmark: " << voicesPerRun << " voices, " << blocks * frames / static_cast<double>(SAMPLE_RATE)
+        << " s per instrument\n";
+    out << "instrument   ns per voice sample   % of a core per voice\n";
+    for (int i = 0; i < NUM_INSTRUMENTS; i++) {
+        PianoMetrics metrics;
+        AudioEngine engine(metrics);
+        for (int v = 0; v < voicesPerRun; v++) {
+            int key = 36 + v;                 // C2 upwards, all held (no gate)
+            engine.noteOn(key, MIDI_FREQUENCIES[key], 0, static_cast<Instrument>(i));
+        }
+        long long start = steadyNanos();
+        for (int b = 0; b < blocks; b++) engine.render(buffer.data(), frames);
+        double ns = static_cast<double>(steadyNanos() - start);
+        double perSample = ns / (static_cast<double>(blocks) * frames * voicesPerRun);
+        char line[128];
+        std::snprintf(line, sizeof(line), "%-10s   %19.2f   %21.3f\n", INSTRUMENT_NAMES[i], perSample,
+                      perSample * SAMPLE_RATE / 1e7); // ns per sample * samples per second / 1e9 * 100
+        out << line;
+    }
+}
+
+// Function to check that 128 modal notes of MODAL_PARTIALS partials run in real time (--bench-modal)
+void runModalBenchmark(std::ostream& out) {
+    const int notes = 128;
+    const int frames = 256;
+    const int blocks = SAMPLE_RATE * 5 / frames; // Five seconds of sound
+    std::vector<ModalBank> banks(notes);
+    std::vector<float> block(frames), mix(frames);
+#ifdef __AVX2__
+    const char* paths[2] = {"avx2", "scalar"};
+#else
+    const char* paths[2] = {"scalar (built without -mavx2)", "scalar"};
+#endif
+    out << "Modal benchmark: " << notes << " notes x " << MODAL_PARTIALS << " partials, "
+        << blocks * frames / static_cast<double>(SAMPLE_RATE) << " s of sound\n";
+    for (int path = 0; path < 2; path++) {
+        for (int n = 0; n < notes; n++) banks[n].excite(MIDI_FREQUENCIES[n], n, VELOCITY_RESPONSE.brightnessFor(100));
+        long long start = steadyNanos();
+        for (int b = 0; b < blocks; b++) {
+            std::fill(mix.begin(), mix.end(), 0.0f);
+            for (auto& bank : banks) {
+                if (path == 0) bank.render(block.data(), frames);
+                else bank.renderScalar(block.data(), frames);
+                for (int i = 0; i < frames; i++) mix[i] += block[i];
+            }
+        }
+        double seconds = (steadyNanos() - start) / 1e9;
+        double audio = blocks * frames / static_cast<double>(SAMPLE_RATE);
+        char line[160];
+        std::snprintf(line, sizeof(line), "%-30s  %.3f s CPU, %.2fx real time, %.1f%% of one core (mix check %g)\n", paths[path],
+                      seconds, audio / seconds, 100.0 * seconds / audio, mix[0]);
+        out << line;
+    }
+}
+
+// Function to measure aliasing and cost of each oversampling factor (--bench-oversample)
+// Aliasing: a B8 square (7902 Hz) has no harmonic below Nyquist besides the fundamental,
+// so whatever is left after removing the fundamental is alias (decay is undone first).
+// Cost: 32 high square voices through the saturator.
+void runOversampleBenchmark(std::ostream& out) {
+    const int frames = 256;
+    out << "Oversampling benchmark (square voices + master saturator, drive 2)\n";
+    out << "factor   alias level dB   us per block   x real time\n";
+    for (int factor = 1; factor <= 8; factor *= 2) {
+        const int key = 119;
+        const double frequency = MIDI_FREQUENCIES[key];
+        const int skip = 4096, length = 16384;
+        std::vector<float> tone(skip + length);
+        {
+            PianoMetrics metrics;
+            std::unique_ptr<AudioEngine> engine(new AudioEngine(metrics));
+            EngineSettings settings;
+            settings.oversample = factor;
+            engine->applySettings(settings);
+            engine->noteOn(key, frequency, 0, Instrument::Square, 1.0f, 127);
+            engine->render(tone.data(), static_cast<int>(tone.size()));
+        }
+        double decay = std::exp(1.0 / (3.0 * SAMPLE_RATE)); // Undo the engine's level decay
+        double re = 0.0, im = 0.0, total = 0.0, undo = std::pow(decay, skip);
+        std::vector<double> flat(length);
+        for (int i = 0; i < length; i++) {
+            flat[i] = tone[skip + i] * undo;
+            undo *= decay;
+            double w = 2.0 * 3.14159265358979323846 * frequency * i / SAMPLE_RATE;
+            re += flat[i] * std::cos(w);
+            im += flat[i] * std::sin(w);
+        }
+        re *= 2.0 / length;
+        im *= 2.0 / length;
+        for (int i = 0; i < length; i++) {
+            double w = 2.0 * 3.14159265358979323846 * frequency * i / SAMPLE_RATE;
+            double residual = flat[i] - re * std::cos(w) - im * std::sin(w);
+            total += residual * residual;
+        }
+        double fundamental = (re * re + im * im) / 2.0;
+        double aliasDb = 10.0 * std::log10(std::max(total / length, 1e-30) / fundamental);
+
+        PianoMetrics metrics;
+        std::unique_ptr<AudioEngine> engine(new AudioEngine(metrics));
+        EngineSettings settings;
+        settings.oversample = factor;
+        settings.drive = 2.0f;
+        engine->applySettings(settings);
+        for (int v = 0; v < 32; v++) engine->noteOn(84 + v, MIDI_FREQUENCIES[84 + v], 0, Instrument::Square, 0.3f);
+        std::vector<float> block(frames);
+        const int blocks = SAMPLE_RATE * 2 / frames;
+        long long start = steadyNanos();
+        for (int b = 0; b < blocks; b++) engine->render(block.data(), frames);
+        double us = (steadyNanos() - start) / 1000.0 / blocks;
+        char line[128];
+        std::snprintf(line, sizeof(line), "%6d   %14.1f   %12.1f   %11.1f\n", factor, aliasDb, us,
+                      frames * 1e6 / SAMPLE_RATE / us);
+        out << line;
+    }
+}
+
+// WAV writer class (mono 32-bit float WAV, streamed to disk in large writes)
+// Samples collect in a buffer and go out in one write per megabyte; the RIFF sizes are
+// patched in close(), so the length does not have to be known up front.
+class WavWriter {
+private:
+    std::ofstream file;
+    std::vector<char> buffer;
+    unsigned long long dataBytes = 0;
+    static const size_t FLUSH_BYTES = 1 << 20;
+
+    void put32(std::ostream& out, uint32_t v) {
+        char b[4] = {char(v), char(v >> 8), char(v >> 16), char(v >> 24)};
+        out.write(b, 4);
+    }
+    void put16(std::ostream& out, uint16_t v) {
+        char b[2] = {char(v), char(v >> 8)};
+        out.write(b, 2);
+    }
+    void writeHeader() {
+        file.seekp(0);
+        file.write("RIFF", 4);
+        put32(file, static_cast<uint32_t>(36 + dataBytes));
+        file.write("WAVEfmt ", 8);
+        put32(file, 16);
+        put16(file, 3);                   // IEEE float
+        put16(file, 1);                   // Mono
+        put32(file, SAMPLE_RATE);
+        put32(file, SAMPLE_RATE * 4);     // Bytes per second
+        put16(file, 4);                   // Bytes per frame
+        put16(file, 32);                  // Bits per sample
+        file.write("data", 4);
+        put32(file, static_cast<uint32_t>(dataBytes));
+    }
+
+public:
+    ~WavWriter() { if (file.is_open()) close(); }
+
+    bool open(const std::string& path) {
+        file.open(path, std::ios::binary | std::ios::trunc);
+        if (!file) return false;
+        dataBytes = 0;
+        buffer.clear();
+        buffer.reserve(FLUSH_BYTES);
+        writeHeader();                    // Placeholder sizes until close()
+        return static_cast<bool>(file);
+    }
+
+    void write(const float* samples, size_t count) {
+        const char* bytes = reinterpret_cast<const char*>(samples); // WAV is little-endian, like the CPUs we run on
+        size_t length = count * sizeof(float);
+        buffer.insert(buffer.end(), bytes, bytes + length);
+        dataBytes += length;
+        if (buffer.size() >= FLUSH_BYTES) flush();
+    }
+
+    void flush() {
+        file.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        buffer.clear();
+    }
+
+    // Function to finish the file, returns false if anything failed to write
+    bool close() {
+        flush();
+        writeHeader();
+        bool ok = static_cast<bool>(file);
+        file.close();
+        return ok;
+    }
+};
+
+// Function to write a whole mono float buffer as a WAV file
+bool writeWav(const std::string& path, const std::vector<float>& samples) {
+    WavWriter wav;
+    if (!wav.open(path)) return false;
+    wav.write(samples.data(), samples.size());
+    return wav.close();
+}
+
+// Function to read a mono WAV file (32-bit float or 16-bit PCM) into samples
+bool readWav(const std::string& path, std::vector<float>& samples, std::string& error) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        error = "cannot open " + path;
+        return false;
+    }
+    std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    auto get32 = [&](size_t at) {
+        return static_cast<uint32_t>(static_cast<unsigned char>(bytes[at])) | static_cast<uint32_t>(static_cast<unsigned char>(bytes[at + 1])) << 8 |
+               static_cast<uint32_t>(static_cast<unsigned char>(bytes[at + 2])) << 16 | static_cast<uint32_t>(static_cast<unsigned char>(bytes[at + 3])) << 24;
+    };
+    if (bytes.size() < 12 || std::memcmp(bytes.data(), "RIFF", 4) != 0 || std::memcmp(bytes.data() + 8, "WAVE", 4) != 0) {
+        error = path + " is not a WAV file";
+        return false;
+    }
+    int format = 0, channels = 0, bits = 0;
+    for (size_t at = 12; at + 8 <= bytes.size();) {
+        uint32_t size = get32(at + 4);
+        size_t body = at + 8;
+        if (std::memcmp(bytes.data() + at, "fmt ", 4) == 0 && size >= 16 && body + 16 <= bytes.size()) {
+            format = static_cast<unsigned char>(bytes[body]) | static_cast<unsigned char>(bytes[body + 1]) << 8;
+            channels = static_cast<unsigned char>(bytes[body + 2]);
+            bits = static_cast<unsigned char>(bytes[body + 14]);
+        } else if (std::memcmp(bytes.data() + at, "data", 4) == 0) {
+            size = static_cast<uint32_t>(std::min<size_t>(size, bytes.size() - body));
+            if (channels != 1 || !((format == 3 && bits == 32) || (format == 1 && bits == 16))) {
+                error = path + ": only mono 32-bit float or 16-bit PCM is supported";
+                return false;
+            }
+            if (format == 3) {
+                samples.resize(size / 4);
+                std::memcpy(samples.data(), bytes.data() + body, samples.size() * 4);
+            } else {
+                samples.resize(size / 2);
+                for (size_t i = 0; i < samples.size(); i++) {
+                    int16_t v = static_cast<int16_t>(static_cast<unsigned char>(bytes[body + 2 * i]) | static_cast<unsigned char>(bytes[body + 2 * i + 1]) << 8);
+                    samples[i] = v / 32768.0f;
+                }
+            }
+            return true;
+        }
+        at = body + size + (size & 1);    // Chunks are padded to even sizes
+    }
+    error = path + " has no audio data";
+    return false;
+}
+
+// Function to transform a power-of-two block in place (iterative radix-2 FFT)
+void fft(std::vector<std::complex<double>>& a) {
+    size_t n = a.size();
+    for (size_t i = 1, j = 0; i < n; i++) {  // Bit-reversed order
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) std::swap(a[i], a[j]);
+    }
+    for (size_t length = 2; length <= n; length <<= 1) {
+        std::complex<double> step = std::polar(1.0, -2.0 * 3.14159265358979323846 / length);
+        for (size_t i = 0; i < n; i += length) {
+            std::complex<double> w(1.0);
+            for (size_t k = 0; k < length / 2; k++) {
+                std::complex<double> u = a[i + k], v = a[i + k + length / 2] * w;
+                a[i + k] = u + v;
+                a[i + k + length / 2] = u - v;
+                w *= step;
+            }
+        }
+    }
+}
+
+// Function to compare two signals by their spectra: mean absolute difference in dB of the
+// short-time power spectra (Hann, 2048 points, half overlap), counting only bins within 80 dB
+// of the loudest one in the reference, so noise-floor wiggles do not dominate
+double spectralDistanceDb(const std::vector<float>& reference, const std::vector<float>& actual) {
+    const size_t N = 2048, HOP = N / 2;
+    size_t length = std::min(reference.size(), actual.size());
+    if (length < N) return 0.0;
+    std::vector<double> window(N);
+    for (size_t i = 0; i < N; i++) window[i] = 0.5 - 0.5 * std::cos(2.0 * 3.14159265358979323846 * i / N);
+    std::vector<std::vector<double>> refPower, actPower;
+    double loudest = 1e-30;
+    std::vector<std::complex<double>> a(N), b(N);
+    for (size_t start = 0; start + N <= length; start += HOP) {
+        for (size_t i = 0; i < N; i++) {
+            a[i] = reference[start + i] * window[i];
+            b[i] = actual[start + i] * window[i];
+        }
+        fft(a);
+        fft(b);
+        refPower.emplace_back(N / 2);
+        actPower.emplace_back(N / 2);
+        for (size_t k = 0; k < N / 2; k++) {
+            refPower.back()[k] = std::norm(a[k]);
+            actPower.back()[k] = std::norm(b[k]);
+            loudest = std::max(loudest, refPower.back()[k]);
+        }
+    }
+    double floor = loudest * 1e-8, total = 0.0;
+    size_t counted = 0;
+    for (size_t f = 0; f < refPower.size(); f++) {
+        for (size_t k = 0; k < N / 2; k++) {
+            double r = refPower[f][k], p = actPower[f][k];
+            if (r < floor && p < floor) continue;
+            total += std::abs(10.0 * std::log10((r + floor) / (p + floor)));
+            counted++;
+        }
+    }
+    return counted ? total / counted : 0.0;
+}
+
+// Golden event structure definition (one thing that happens in a reference scene)
+struct GoldenEvent {
+    int atMs;
+    EngineEventType type;
+    int key;
+    Instrument instrument;
+    unsigned char velocity;
+    int gateMs;                       // Note-on: automatic note-off after this long (0 = NoteOff follows)
+    bool down;                        // Pedals
+};
+
+// Golden scene structure definition (a fixed performance rendered offline and compared to a stored golden)
+// Exact scenes only run scalar code: they match the stored checksum bit for bit when built with the
+// same flags, and otherwise (e.g. -mfma fusing multiply-adds) may only differ by rounding noise.
+// Approximate scenes go through paths that SIMD builds compute differently and only have to sound the same.
+struct GoldenScene {
+    std::string name;
+    bool exact;
+    EngineSettings settings;
+    int lengthMs;
+    std::vector<GoldenEvent> events;
+};
+
+const double GOLDEN_EXACT_MIN_SNR_DB = 120.0; // Exact scenes with a changed checksum pass above this (rounding only)
+const double GOLDEN_MIN_SNR_DB = 60.0;      // Approximate scenes pass above this signal-to-noise ratio...
+const double GOLDEN_MAX_SPECTRAL_DB = 0.5;  // ...or when their spectra stay this close (phase-only changes)
+
+// Function to build the reference scenes (one per instrument and sound path)
+std::vector<GoldenScene> goldenScenes() {
+    auto note = [](int atMs, int key, Instrument instrument, unsigned char velocity, int gateMs) {
+        return GoldenEvent{atMs, EngineEventType::NoteOn, key, instrument, velocity, gateMs, false};
+    };
+    auto pedal = [](int atMs, EngineEventType type, bool down) {
+        return GoldenEvent{atMs, type, 0, Instrument::Sine, 0, 0, down};
+    };
+    std::vector<GoldenScene> scenes;
+    const int SCALE[8] = {60, 62, 64, 65, 67, 69, 71, 72};
+    EngineSettings plain;
+    plain.oversample = 1;
+
+    GoldenScene s{"sine-scale", true, plain, 2000, {}};
+    for (int i = 0; i < 8; i++) s.events.push_back(note(i * 200, SCALE[i], Instrument::Sine, static_cast<unsigned char>(40 + i * 10), 180));
+    scenes.push_back(s);
+
+    s = GoldenScene{"triangle-sustain", true, plain, 2500, {}};
+    s.events.push_back(pedal(0, EngineEventType::Sustain, true));
+    for (int i = 0; i < 4; i++) s.events.push_back(note(i * 150, 48 + i * 4, Instrument::Triangle, 90, 100));
+    s.events.push_back(pedal(1500, EngineEventType::Sustain, false));
+    scenes.push_back(s);
+
+    s = GoldenScene{"square-raw", true, plain, 1500, {}};
+    for (int i = 0; i < 3; i++) s.events.push_back(note(0, 57 + i * 7, Instrument::Square, 100, 800));
+    scenes.push_back(s);
+
+    s = GoldenScene{"string-arpeggio", true, plain, 3000, {}};
+    for (int i = 0; i < 8; i++) s.events.push_back(note(i * 120, SCALE[i] - 12 + (i % 2) * 12, Instrument::String, 110, 0));
+    scenes.push_back(s);
+
+    EngineSettings driven;
+    driven.oversample = 4;
+    driven.drive = 1.5f;
+    s = GoldenScene{"square-oversampled-drive", false, driven, 1500, {}};
+    for (int i = 0; i < 4; i++) s.events.push_back(note(i * 100, 84 + i * 5, Instrument::Square, 120, 900));
+    scenes.push_back(s);
+
+    s = GoldenScene{"modal-bells", false, plain, 3000, {}};
+    for (int i = 0; i < 6; i++) s.events.push_back(note(i * 250, 72 + i * 3, Instrument::Modal, 100, 0));
+    scenes.push_back(s);
+
+    for (int a = 0; a < NUM_FM_ALGORITHMS; a++) {
+        EngineSettings fm = plain;
+        fm.fmAlgorithm = static_cast<FmAlgorithm>(a);
+        s = GoldenScene{std::string("fm-") + FM_ALGORITHM_NAMES[a], false, fm, 1500, {}};
+        for (int i = 0; i < 3; i++) s.events.push_back(note(i * 300, 55 + i * 5, Instrument::Fm, 100, 600));
+        scenes.push_back(s);
+    }
+
+    s = GoldenScene{"full-mix", false, EngineSettings(), 3000, {}};
+    s.events.push_back(pedal(0, EngineEventType::Sostenuto, false));
+    for (int i = 0; i < 24; i++) {
+        Instrument instrument = static_cast<Instrument>(i % 6);
+        s.events.push_back(note(i * 60, 40 + (i * 7) % 48, instrument, static_cast<unsigned char>(50 + (i * 13) % 77), i % 3 ? 400 : 0));
+        if (i == 6) s.events.push_back(pedal(i * 60 + 10, EngineEventType::Sostenuto, true));
+    }
+    s.events.push_back(pedal(2000, EngineEventType::Sostenuto, false));
+    for (int i = 0; i < 24; i += 3) s.events.push_back(GoldenEvent{2200, EngineEventType::NoteOff, 40 + (i * 7) % 48, Instrument::Sine, 0, 0, false});
+    scenes.push_back(s);
+    return scenes;
+}
+
+// Function to render a scene offline (events take effect at the start of the block they fall in)
+std::vector<float> renderGoldenScene(const GoldenScene& scene) {
+    const int BLOCK = 256;
+    PianoMetrics metrics;
+    std::unique_ptr<AudioEngine> engine(new AudioEngine(metrics));
+    engine->applySettings(scene.settings);
+    std::vector<GoldenEvent> events = scene.events;
+    std::stable_sort(events.begin(), events.end(), [](const GoldenEvent& a, const GoldenEvent& b) { return a.atMs < b.atMs; });
+    std::vector<float> out(static_cast<size_t>(scene.lengthMs) * SAMPLE_RATE / 1000);
+    size_t next = 0;
+    for (size_t at = 0; at < out.size(); at += BLOCK) {
+        int frames = static_cast<int>(std::min<size_t>(BLOCK, out.size() - at));
+        while (next < events.size() && static_cast<size_t>(events[next].atMs) * SAMPLE_RATE / 1000 < at + frames) {
+            const GoldenEvent& e = events[next++];
+            if (e.type == EngineEventType::NoteOn) engine->noteOn(e.key, MIDI_FREQUENCIES[e.key], e.gateMs, e.instrument, 1.0f, e.velocity);
+            else if (e.type == EngineEventType::NoteOff) engine->noteOff(e.key);
+            else if (e.type == EngineEventType::Sustain) engine->sustain(e.down);
+            else engine->sostenuto(e.down);
+        }
+        engine->render(out.data() + at, frames);
+    }
+    return out;
+}
+
+// Function to fingerprint rendered audio (FNV-1a over the raw sample bits)
+uint64_t audioChecksum(const std::vector<float>& samples) {
+    uint64_t hash = 1469598103934665603ULL;
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(samples.data());
+    for (size_t i = 0; i < samples.size() * sizeof(float); i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Function to render every scene and store it as the new golden (--golden-update <dir>, created if needed)
+// Writes <scene>.wav per scene and checksums.txt with one "<scene> <checksum>" line each.
+bool updateGoldens(const std::string& directory, std::ostream& out) {
+    if (!makeDirectory(directory)) {
+        out << "Cannot create directory " << directory << "\n";
+        return false;
+    }
+    std::ofstream manifest(directory + "/checksums.txt", std::ios::trunc);
+    if (!manifest) {
+        out << "Cannot write " << directory << "/checksums.txt\n";
+        return false;
+    }
+    for (const auto& scene : goldenScenes()) {
+        std::vector<float> audio = renderGoldenScene(scene);
+        if (!writeWav(directory + "/" + scene.name + ".wav", audio)) {
+            out << "Cannot write " << directory << "/" << scene.name << ".wav\n";
+            return false;
+        }
+        char line[64];
+        std::snprintf(line, sizeof(line), "%016llx", static_cast<unsigned long long>(audioChecksum(audio)));
+        manifest << scene.name << " " << line << "\n";
+        out << "  " << scene.name << ": " << line << "\n";
+    }
+    return true;
+}
+
+// Function to render every scene and compare it with its golden (--golden-check <dir>)
+// A failing scene leaves <scene>.actual.wav and <scene>.diff.wav (actual minus golden) next to the golden.
+bool checkGoldens(const std::string& directory, std::ostream& out) {
+    std::map<std::string, std::string> checksums;
+    std::ifstream manifest(directory + "/checksums.txt");
+    std::string name, sum;
+    while (manifest >> name >> sum) checksums[name] = sum;
+    if (checksums.empty()) {
+        out << "No goldens in " << directory << " (run --golden-update first)\n";
+        return false;
+    }
+    bool allPassed = true;
+    out << "scene                      mode     checksum   SNR dB   spectral dB   result\n";
+    for (const auto& scene : goldenScenes()) {
+        std::vector<float> actual = renderGoldenScene(scene), golden;
+        std::string error;
+        char checksum[32];
+        std::snprintf(checksum, sizeof(checksum), "%016llx", static_cast<unsigned long long>(audioChecksum(actual)));
+        bool sameBits = checksums.count(scene.name) && checksums[scene.name] == checksum;
+        double snrDb = 0.0, spectralDb = 0.0;
+        bool passed = sameBits;
+        if (!readWav(directory + "/" + scene.name + ".wav", golden, error) || golden.size() != actual.size()) {
+            if (error.empty()) error = "length changed";
+            passed = false;
+        } else {
+            double signal = 0.0, noise = 0.0;
+            for (size_t i = 0; i < golden.size(); i++) {
+                double d = static_cast<double>(actual[i]) - golden[i];
+                signal += static_cast<double>(golden[i]) * golden[i];
+                noise += d * d;
+            }
+            snrDb = noise > 0.0 ? 10.0 * std::log10(std::max(signal, 1e-30) / noise) : 999.0;
+            spectralDb = spectralDistanceDb(golden, actual);
+            if (scene.exact) passed = sameBits || snrDb >= GOLDEN_EXACT_MIN_SNR_DB;
+            else passed = snrDb >= GOLDEN_MIN_SNR_DB || spectralDb <= GOLDEN_MAX_SPECTRAL_DB;
+        }
+        char line[160];
+        std::snprintf(line, sizeof(line), "%-26s %-8s %-10s %6.1f   %11.3f   %s\n", scene.name.c_str(), scene.exact ? "exact" : "approx",
+                      sameBits ? "same" : "changed", snrDb, spectralDb, passed ? "ok" : "FAIL");
+        out << line;
+        if (!error.empty()) out << "  " << error << "\n";
+        if (passed) continue;
+        allPassed = false;
+        writeWav(directory + "/" + scene.name + ".actual.wav", actual);
+        if (golden.size() == actual.size()) {
+            std::vector<float> diff(actual.size());
+            for (size_t i = 0; i < diff.size(); i++) diff[i] = actual[i] - golden[i];
+            writeWav(directory + "/" + scene.name + ".diff.wav", diff);
+        }
+    }
+    out << (allPassed ? "All golden scenes passed\n" : "Golden check FAILED (see the .actual.wav and .diff.wav files)\n");
+    return allPassed;
+}
+
+// Buffer size settings structure definition (bounds and thresholds for the adaptive controller)
+struct BufferSizeConfig {
+    int minFrames = 128;          // Smallest period the controller may choose (lowest latency)
+    int maxFrames = 4096;         // Largest period the controller may choose (safest)
+    int initialFrames = 512;      // Period used when the audio device is opened
+    int windowCallbacks = 100;    // Number of callbacks collected before judging the CPU load
+    double growLoad = 0.80;       // Peak callback load above this makes the period bigger
+    double shrinkLoad = 0.30;     // Average callback load below this counts as a calm window
+    int calmWindowsToShrink = 10; // Calm windows in a row needed before the period gets smaller
+    int holdWindowsAfterGrow = 20; // Windows to wait after growing before a shrink is allowed
+};
+
+// Adaptive buffer size controller class
+// Watches deadline misses (xruns) and CPU headroom of each audio callback and
+// steps the period size up or down. Growing reacts immediately, shrinking needs a long
+// calm stretch, so the size does not flip back and forth (hysteresis).
+class AdaptiveBufferController {
+private:
+    BufferSizeConfig config;  // Bounds and thresholds
+    std::ostream& log;        // Where every size change is reported
+    int periodFrames;         // Period size currently in use
+    int callbacks = 0;        // Callbacks counted in the current window
+    int xruns = 0;            // Deadline misses in the current window
+    long long totalXruns = 0; // Deadline misses since start
+    double loadSum = 0.0;     // Sum of callback loads (cpu time / period time) in the window
+    double loadPeak = 0.0;    // Highest callback load in the window
+    int calmWindows = 0;      // Consecutive windows with low load and no xruns
+    int holdWindows = 0;      // Windows left before shrinking is allowed again
+
+    // Function to switch to a new period size and log the statistics that caused it
+    void changeTo(int frames, const char* reason) {
+        frames = std::max(config.minFrames, std::min(config.maxFrames, frames));
+        if (frames == periodFrames) return; // Already at the bound
+        double avg = callbacks > 0 ? loadSum / callbacks : 0.0;
+        log << "[buffer] " << periodFrames << " -> " << frames << " frames (" << reason
+            << ": xruns=" << xruns << " total_xruns=" << totalXruns
+            << " avg_load=" << static_cast<int>(avg * 100) << "%"
+            << " peak_load=" << static_cast<int>(loadPeak * 100) << "%"
+            << " callbacks=" << callbacks << ")" << std::endl;
+        periodFrames = frames;
+    }
+
+    // Function to start a fresh statistics window
+    void resetWindow() {
+        callbacks = 0;
+        xruns = 0;
+        loadSum = 0.0;
+        loadPeak = 0.0;
+    }
+
+public:
+    AdaptiveBufferController(const BufferSizeConfig& cfg, std::ostream& logStream)
+        : config(cfg), log(logStream),
+          periodFrames(std::max(cfg.minFrames, std::min(cfg.maxFrames, cfg.initialFrames))) {}
+
+    // Function to report one finished callback, returns the period size to use next
+    // cpuSeconds (time spent rendering), periodSeconds (audio time the block covers), xrun (deadline missed)
+    int onCallback(double cpuSeconds, double periodSeconds, bool xrun) {
+        double load = periodSeconds > 0.0 ? cpuSeconds / periodSeconds : 0.0;
+        callbacks++;
+        loadSum += load;
+        loadPeak = std::max(loadPeak, load);
+        if (xrun) {
+            xruns++;
+            totalXruns++;
+            changeTo(periodFrames * 2, "xrun");  // Dropouts are audible, grow right away
+            calmWindows = 0;
+            holdWindows = config.holdWindowsAfterGrow;
+            resetWindow();
+            return periodFrames;
+        }
+        if (callbacks < config.windowCallbacks) return periodFrames; // Keep collecting
+
+        double avg = loadSum / callbacks;
+        if (loadPeak > config.growLoad) {        // Too little headroom, next spike would drop out
+            changeTo(periodFrames * 2, "low headroom");
+            calmWindows = 0;
+            holdWindows = config.holdWindowsAfterGrow;
+        } else if (holdWindows > 0) {           // Recently grown, do not shrink yet
+            holdWindows--;
+            calmWindows = 0;
+        } else if (avg < config.shrinkLoad) {   // Plenty of headroom
+            if (++calmWindows >= config.calmWindowsToShrink) {
+                changeTo(periodFrames / 2, "headroom");
+                calmWindows = 0;
+            }
+        } else {
+            calmWindows = 0;                    // In the comfortable band, stay put
+        }
+        resetWindow();
+        return periodFrames;
+    }
+
+    // Function to read the period size currently chosen
+    int getPeriodFrames() const { return periodFrames; }
+};
+
+// Audio backend interface class (something that pulls audio from the engine and plays it)
+class AudioBackend {
+public:
+    virtual ~AudioBackend() {}
+    virtual bool start() = 0;          // Returns false if the device could not be opened
+    virtual void stop() = 0;
+    virtual std::string describe() const = 0; // Shown in the interface
+};
+
+// Transport sync interface class (an external clock that recording playback follows)
+class TransportSync {
+public:
+    virtual ~TransportSync() {}
+    virtual bool rolling() const = 0;      // True while the transport is playing
+    virtual long long positionMs() const = 0; // Current transport position
+    virtual void startFromZero() = 0;      // Locate to the start and roll
+    virtual void stop() = 0;
+};
+
+// Function to convert float samples (-1..1) to 16-bit integers with clipping
+void floatToPcm16(const float* in, short* out, int frames) {
+    for (int i = 0; i < frames; i++) {
+        float s = std::max(-1.0f, std::min(1.0f, in[i]));
+        out[i] = static_cast<short>(s * 32767.0f);
+    }
+}
+
+#ifdef _WIN32
+// waveOut audio output class (feeds the engine to the Windows sound card)
+class WaveOutBackend : public AudioBackend {
+private:
+    static const int NUM_BUFFERS = 3;  // Buffers queued at the device (one playing, others waiting)
+    AudioEngine& engine;               // Source of the audio
+    AdaptiveBufferController& controller; // Decides the period size
+    PianoMetrics& metrics;             // Callback timing and xrun counters
+    HWAVEOUT device = nullptr;         // Handle to the opened sound device
+    HANDLE doneEvent = nullptr;        // Signalled by Windows whenever a buffer finished playing
+    WAVEHDR headers[NUM_BUFFERS];      // One header per queued buffer
+    std::vector<short> buffers[NUM_BUFFERS]; // 16-bit sample memory, sized for the largest period
+    std::vector<float> mix;            // Float block the engine renders into
+    std::thread worker;                // Audio thread
+    std::atomic<bool> running{false};  // Cleared to stop the audio thread
+
+    // Function to render one period into a buffer and hand it to the device
+    // Returns the time spent rendering in seconds
+    double submit(int index, int frames) {
+        WAVEHDR& h = headers[index];
+        if (h.dwFlags & WHDR_PREPARED) waveOutUnprepareHeader(device, &h, sizeof(WAVEHDR));
+
+        auto begin = std::chrono::steady_clock::now();
+        engine.render(mix.data(), frames);
+        floatToPcm16(mix.data(), buffers[index].data(), frames);
+        auto end = std::chrono::steady_clock::now();
+
+        h.lpData = reinterpret_cast<LPSTR>(buffers[index].data());
+        h.dwBufferLength = static_cast<DWORD>(frames * sizeof(short));
+        h.dwFlags = 0;
+        waveOutPrepareHeader(device, &h, sizeof(WAVEHDR));
+        waveOutWrite(device, &h, sizeof(WAVEHDR));
+        return std::chrono::duration<double>(end - begin).count();
+    }
+
+    // Function run by the audio thread: refill buffers as soon as the device returns them
+    void audioLoop() {
+        raiseThreadPriority();
+        nameThread("piano-audio");
+        int next = 0;                      // Buffers come back in the order they were queued
+        int frames = controller.getPeriodFrames();
+        for (int i = 0; i < NUM_BUFFERS; i++) submit(i, frames); // Prime the queue
+
+        while (running) {
+            WaitForSingleObject(doneEvent, 100);
+            int done = 0;
+            for (int i = 0; i < NUM_BUFFERS; i++) {
+                if (headers[i].dwFlags & WHDR_DONE) done++;
+            }
+            bool starved = done == NUM_BUFFERS; // Every queued buffer played out: the device ran dry
+            while (running && (headers[next].dwFlags & WHDR_DONE)) {
+                double cpu = submit(next, frames);
+                double period = static_cast<double>(frames) / SAMPLE_RATE;
+                bool xrun = starved || cpu > period; // Missed the deadline of this callback
+                metrics.callbackSeconds.observe(cpu);
+                if (xrun) metrics.xruns.add();
+                frames = controller.onCallback(cpu, period, xrun);
+                metrics.periodFrames.set(frames);
+                starved = false;               // Count one xrun per starvation, not per buffer
+                next = (next + 1) % NUM_BUFFERS;
+            }
+        }
+    }
+
+public:
+    WaveOutBackend(AudioEngine& eng, AdaptiveBufferController& ctrl, PianoMetrics& m, int maxFrames)
+        : engine(eng), controller(ctrl), metrics(m), mix(maxFrames) {
+        for (int i = 0; i < NUM_BUFFERS; i++) {
+            buffers[i].assign(maxFrames, 0);
+            headers[i] = WAVEHDR();
+        }
+    }
+
+    ~WaveOutBackend() { stop(); }
+
+    // Function to open the sound device and start the audio thread, returns false on failure
+    bool start() override {
+        WAVEFORMATEX format = {};
+        format.wFormatTag = WAVE_FORMAT_PCM;
+        format.nChannels = 1;                 // Mono output
+        format.nSamplesPerSec = SAMPLE_RATE;
+        format.wBitsPerSample = 16;
+        format.nBlockAlign = format.nChannels * format.wBitsPerSample / 8;
+        format.nAvgBytesPerSec = format.nSamplesPerSec * format.nBlockAlign;
+
+        doneEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (waveOutOpen(&device, WAVE_MAPPER, &format, reinterpret_cast<DWORD_PTR>(doneEvent), 0,
+                        CALLBACK_EVENT) != MMSYSERR_NOERROR) {
+            CloseHandle(doneEvent);
+            doneEvent = nullptr;
+            device = nullptr;
+            return false;
+        }
+        running = true;
+        metrics.periodFrames.set(controller.getPeriodFrames());
+        worker = std::thread(&WaveOutBackend::audioLoop, this);
+        return true;
+    }
+
+    // Function to stop the audio thread and close the device
+    void stop() override {
+        if (!device) return;
+        running = false;
+        if (worker.joinable()) worker.join();
+        waveOutReset(device);                 // Return every queued buffer
+        for (auto& h : headers) {
+            if (h.dwFlags & WHDR_PREPARED) waveOutUnprepareHeader(device, &h, sizeof(WAVEHDR));
+        }
+        waveOutClose(device);
+        CloseHandle(doneEvent);
+        device = nullptr;
+    }
+
+    std::string describe() const override { return "waveOut"; }
+};
+#endif
+
+#ifdef PIANO_WITH_ALSA
+// ALSA PCM audio output class (feeds the engine to a Linux sound card, build with -DPIANO_WITH_ALSA -lasound)
+// Blocking writes from our own audio thread: the device buffer holds three of the largest periods,
+// and each write is the period the adaptive controller currently picks.
+class AlsaPcmBackend : public AudioBackend {
+private:
+    AudioEngine& engine;               // Source of the audio
+    AdaptiveBufferController& controller; // Decides the period size
+    PianoMetrics& metrics;             // Callback timing and xrun counters
+    int maxFrames;                     // Largest period the controller may pick
+    snd_pcm_t* pcm = nullptr;          // Opened playback device
+    std::vector<float> mix;            // Float block the engine renders into
+    std::vector<short> samples;        // 16-bit copy handed to ALSA
+    std::thread worker;                // Audio thread
+    std::atomic<bool> running{false};  // Cleared to stop the audio thread
+
+    // Function run by the audio thread: render a period, write it (blocks while the device is full)
+    void audioLoop() {
+        raiseThreadPriority();
+        nameThread("piano-audio");
+        int frames = controller.getPeriodFrames();
+        while (running) {
+            auto begin = std::chrono::steady_clock::now();
+            engine.render(mix.data(), frames);
+            floatToPcm16(mix.data(), samples.data(), frames);
+            double cpu = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            snd_pcm_sframes_t written = snd_pcm_writei(pcm, samples.data(), frames);
+            bool xrun = false;
+            if (written < 0) {                 // Underrun (or suspend): recover and carry on
+                xrun = written == -EPIPE;
+                snd_pcm_recover(pcm, static_cast<int>(written), 1);
+            }
+            double period = static_cast<double>(frames) / SAMPLE_RATE;
+            xrun = xrun || cpu > period;
+            metrics.callbackSeconds.observe(cpu);
+            if (xrun) metrics.xruns.add();
+            frames = controller.onCallback(cpu, period, xrun);
+            metrics.periodFrames.set(frames);
+        }
+    }
+
+public:
+    AlsaPcmBackend(AudioEngine& eng, AdaptiveBufferController& ctrl, PianoMetrics& m, int largest)
+        : engine(eng), controller(ctrl), metrics(m), maxFrames(largest), mix(largest), samples(largest) {}
+
+    ~AlsaPcmBackend() { stop(); }
+
+    // Function to open the default sound device and start the audio thread, returns false on failure
+    bool start() override {
+        if (snd_pcm_open(&pcm, "default", SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+            pcm = nullptr;
+            return false;
+        }
+        unsigned int latencyUs = static_cast<unsigned int>(3.0 * maxFrames * 1e6 / SAMPLE_RATE);
+        if (snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED, 1, SAMPLE_RATE, 1, latencyUs) < 0) {
+            snd_pcm_close(pcm);
+            pcm = nullptr;
+            return false;
+        }
+        running = true;
+        metrics.periodFrames.set(controller.getPeriodFrames());
+        worker = std::thread(&AlsaPcmBackend::audioLoop, this);
+        return true;
+    }
+
+    // Function to stop the audio thread and close the device
+    void stop() override {
+        if (!pcm) return;
+        running = false;
+        if (worker.joinable()) worker.join();
+        snd_pcm_drop(pcm);
+        snd_pcm_close(pcm);
+        pcm = nullptr;
+    }
+
+    std::string describe() const override { return "ALSA PCM"; }
+};
+#endif
+
+#ifdef PIANO_WITH_JACK
+// JACK audio output class (build with -DPIANO_WITH_JACK and -ljack)
+// The piano becomes a JACK client; JACK calls process() from its realtime thread and the
+// engine renders straight into the port buffer JACK hands us, with no intermediate copy.
+// The JACK server owns the period size, so the adaptive controller is not used here.
+class JackBackend : public AudioBackend {
+private:
+    AudioEngine& engine;
+    PianoMetrics& metrics;
+    jack_client_t* client = nullptr;
+    jack_port_t* port = nullptr;       // Mono output port "out"
+
+    // JACK realtime callback: render one period into the port buffer
+    static int process(jack_nframes_t frames, void* arg) {
+        JackBackend* self = static_cast<JackBackend*>(arg);
+        float* buffer = static_cast<float*>(jack_port_get_buffer(self->port, frames));
+        auto begin = std::chrono::steady_clock::now();
+        self->engine.render(buffer, static_cast<int>(frames)); // Zero-copy: JACK's own memory
+        auto end = std::chrono::steady_clock::now();
+        self->metrics.callbackSeconds.observe(std::chrono::duration<double>(end - begin).count());
+        return 0;
+    }
+
+    // JACK callback: the server reported a dropout
+    static int xrun(void* arg) {
+        static_cast<JackBackend*>(arg)->metrics.xruns.add();
+        return 0;
+    }
+
+    // JACK callback: the server changed the period size
+    static int bufferSize(jack_nframes_t frames, void* arg) {
+        static_cast<JackBackend*>(arg)->metrics.periodFrames.set(frames);
+        return 0;
+    }
+
+public:
+    JackBackend(AudioEngine& eng, PianoMetrics& m) : engine(eng), metrics(m) {}
+    ~JackBackend() { stop(); }
+
+    bool start() override {
+        jack_status_t status;
+        client = jack_client_open("Console Piano", JackNoStartServer, &status);
+        if (!client) return false;
+        if (jack_get_sample_rate(client) != SAMPLE_RATE) { // The engine is built for one rate
+            jack_client_close(client);
+            client = nullptr;
+            return false;
+        }
+        port = jack_port_register(client, "out", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+        jack_set_process_callback(client, &JackBackend::process, this);
+        jack_set_xrun_callback(client, &JackBackend::xrun, this);
+        jack_set_buffer_size_callback(client, &JackBackend::bufferSize, this);
+        if (!port || jack_activate(client) != 0) {
+            jack_client_close(client);
+            client = nullptr;
+            return false;
+        }
+        // Connect to the first two playback ports (left and right get the same mono signal)
+        const char** playback = jack_get_ports(client, nullptr, JACK_DEFAULT_AUDIO_TYPE, JackPortIsPhysical | JackPortIsInput);
+        if (playback) {
+            for (int i = 0; i < 2 && playback[i]; i++) jack_connect(client, jack_port_name(port), playback[i]);
+            jack_free(playback);
+        }
+        return true;
+    }
+
+    void stop() override {
+        if (!client) return;
+        jack_deactivate(client);
+        jack_client_close(client);
+        client = nullptr;
+    }
+
+    std::string describe() const override { return "JACK"; }
+
+    jack_client_t* handle() const { return client; }
+};
+
+// JACK transport class
+// Lets recording playback follow the JACK transport, so it starts, stops and relocates
+// together with a DAW or any other transport master.
+class JackTransport : public TransportSync {
+private:
+    jack_client_t* client;
+
+public:
+    JackTransport(jack_client_t* c) : client(c) {}
+
+    bool rolling() const override {
+        jack_position_t position;
+        return jack_transport_query(client, &position) == JackTransportRolling;
+    }
+
+    long long positionMs() const override {
+        jack_position_t position;
+        jack_transport_query(client, &position);
+        return static_cast<long long>(position.frame) * 1000 / position.frame_rate;
+    }
+
+    void startFromZero() override {
+        jack_transport_locate(client, 0);
+        jack_transport_start(client);
+    }
+
+    void stop() override { jack_transport_stop(client); }
+};
+#endif
+
+// Metrics HTTP server class
+// Serves GET /metrics on a local port from its own thread (one short request at a time)
+class MetricsHttpServer {
+private:
+    const MetricsRegistry& registry; // Metrics to publish
+    SOCKET listener = INVALID_SOCKET; // Listening socket (closed to stop the thread, reset only after the join)
+    std::thread worker;              // Accept loop
+    std::atomic<bool> running{false};
+
+    // Function to answer one connection
+    void serve(SOCKET client) {
+        char request[1024];
+        setReceiveTimeout(client, METRICS_RECV_TIMEOUT_MS); // A client that sends nothing must not stall later scrapes
+        int got = recv(client, request, sizeof(request) - 1, 0);
+        if (got <= 0) return;
+        request[got] = '\0';
+        std::string body;
+        std::string status;
+        if (std::strncmp(request, "GET /metrics", 12) == 0) {
+            status = "200 OK";
+            body = registry.exposition();
+        } else {
+            status = "404 Not Found";
+            body = "only /metrics is served\n";
+        }
+        std::ostringstream response;
+        response << "HTTP/1.0 " << status << "\r\n"
+                 << "Content-Type: text/plain; version=0.0.4\r\n"
+                 << "Content-Length: " << body.size() << "\r\n"
+                 << "Connection: close\r\n\r\n" << body;
+        std::string text = response.str();
+        send(client, text.data(), static_cast<int>(text.size()), MSG_NOSIGNAL); // A scraper hanging up must not kill us
+    }
+
+    // Function run by the server thread
+    void acceptLoop() {
+        while (running) {
+            SOCKET client = accept(listener, nullptr, nullptr);
+            if (client == INVALID_SOCKET) break;  // Listener closed by stop()
+            serve(client);
+            closeSocket(client);
+        }
+    }
+
+public:
+    MetricsHttpServer(const MetricsRegistry& reg) : registry(reg) {}
+    ~MetricsHttpServer() { stop(); }
+
+    // Function to start listening on 127.0.0.1:port, returns false if the port is unavailable
+    bool start(int port) {
+        if (!socketsStartup()) return false;
+        listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listener == INVALID_SOCKET) return false;
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<u_short>(port));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Local scrapes only
+        if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listener, 8) != 0) {
+            closeSocket(listener);
+            listener = INVALID_SOCKET;
+            return false;
+        }
+        running = true;
+        worker = std::thread(&MetricsHttpServer::acceptLoop, this);
+        return true;
+    }
+
+    // Function to stop the server thread
+    void stop() {
+        if (listener == INVALID_SOCKET) return;
+        running = false;
+        closeSocket(listener);                 // Wakes accept() up with an error
+        if (worker.joinable()) worker.join();
+        listener = INVALID_SOCKET;             // Only now: the accept loop reads it until it has exited
+        socketsCleanup();
+    }
+};
+
+// MIDI input event structure definition (copy of an incoming MIDI event for the interface thread)
+struct MidiInputEvent {
+    EngineEventType type;   // NoteOn, NoteOff, Sustain or Sostenuto
+    unsigned char key;      // MIDI note number
+    unsigned char velocity; // Note-on velocity
+    bool down;              // Pedal state
+    long long timeMs;       // When the event happened (system clock, milliseconds since epoch)
+};
+
+// MIDI dispatcher class
+// Turns MIDI messages into engine events. Called from the MIDI input thread only: events go
+// straight into the engine's MIDI queue (no detour through the interface), and a copy goes to
+// a second queue so the interface can show and record them.
+class MidiDispatcher {
+private:
+    AudioEngine& engine;               // Receives the sound events
+    std::atomic<Instrument> instrument; // Timbre for MIDI notes (changed by config reloads)
+    const TuningSet& tunings;          // Note -> frequency (read per note, may be switched while playing)
+    SpscQueue<MidiInputEvent, 1024> toInterface; // Copies for display and recording
+    unsigned char runningStatus = 0;   // Raw MIDI: status byte reused by data-only messages
+    unsigned char data[2];             // Raw MIDI: data bytes collected so far
+    int dataCount = 0;
+    bool inSysex = false;              // Raw MIDI: skipping a system exclusive message
+
+    // Function to forward one event to the engine and the interface
+    void emit(EngineEventType type, int key, int velocity, bool down, long long timestampNs, long long timeMs) {
+        EngineEvent e = {};
+        e.type = type;
+        e.key = static_cast<unsigned char>(key & 127);
+        e.down = down;
+        e.frequency = tunings.current().hz[key & 127];
+        if (type == EngineEventType::NoteOn && e.frequency <= 0.0) return; // The keyboard map leaves this key silent
+        e.gateFrames = 0;                  // Real keyboards send their own note-off
+        e.instrument = instrument.load(std::memory_order_relaxed);
+        e.gain = 1.0f;
+        e.velocity = static_cast<unsigned char>(velocity & 127);
+        e.timestampNs = timestampNs;
+        engine.postMidi(e);
+        MidiInputEvent copy = {type, e.key, e.velocity, down, timeMs};
+        toInterface.push(copy);            // If the interface falls behind it only misses the display
+    }
+
+public:
+    MidiDispatcher(AudioEngine& eng, Instrument inst, const TuningSet& tuning) : engine(eng), instrument(inst), tunings(tuning) {}
+
+    // Function to change the MIDI timbre (config reloads, any thread)
+    void setInstrument(Instrument inst) {
+        instrument.store(inst, std::memory_order_relaxed);
+    }
+
+    // Function to handle one complete channel message
+    // timestampNs is on the steady clock (same clock the audio thread reads), timeMs on the system clock
+    void message(unsigned char status, unsigned char data1, unsigned char data2, long long timestampNs, long long timeMs) {
+        switch (status & 0xF0) {
+        case 0x90:                         // Note on (velocity 0 means note off)
+            if (data2 > 0) emit(EngineEventType::NoteOn, data1, data2, true, timestampNs, timeMs);
+            else emit(EngineEventType::NoteOff, data1, 0, false, timestampNs, timeMs);
+            break;
+        case 0x80:                         // Note off
+            emit(EngineEventType::NoteOff, data1, 0, false, timestampNs, timeMs);
+            break;
+        case 0xB0:                         // Control change: only the pedals are used
+            if (data1 == 64) emit(EngineEventType::Sustain, 0, 0, data2 >= 64, timestampNs, timeMs);
+            else if (data1 == 66) emit(EngineEventType::Sostenuto, 0, 0, data2 >= 64, timestampNs, timeMs);
+            break;
+        default:
+            break;                         // Program change, pitch bend, aftertouch: not supported yet
+        }
+    }
+
+    // Function to feed raw MIDI bytes (running status, real-time bytes and sysex handled)
+    void bytes(const unsigned char* buffer, size_t length, long long timestampNs, long long timeMs) {
+        for (size_t i = 0; i < length; i++) {
+            unsigned char b = buffer[i];
+            if (b >= 0xF8) continue;          // Real-time bytes can appear anywhere, ignore them
+            if (b == 0xF0) { inSysex = true; continue; }
+            if (b == 0xF7) { inSysex = false; continue; }
+            if (inSysex) continue;
+            if (b & 0x80) {                   // New status byte
+                runningStatus = b < 0xF0 ? b : 0; // System common messages cancel running status
+                dataCount = 0;
+                continue;
+            }
+            if (!runningStatus) continue;     // Data byte without a status, skip it
+            data[dataCount++] = b;
+            int needed = (runningStatus & 0xE0) == 0xC0 ? 1 : 2; // Program change and channel pressure have one
+            if (dataCount == needed) {
+                message(runningStatus, data[0], needed == 2 ? data[1] : 0, timestampNs, timeMs);
+                dataCount = 0;
+            }
+        }
+    }
+
+    // Function to take the next event for the interface (interface thread)
+    bool poll(MidiInputEvent& e) { return toInterface.pop(e); }
+};
+
+// MIDI input interface class (a source of MIDI running on its own thread)
+class MidiInput {
+public:
+    virtual ~MidiInput() {}
+    virtual bool start() = 0;          // Returns false if the port could not be opened
+    virtual void stop() = 0;
+    virtual std::string describe() const = 0; // Shown in the interface
+};
+
+// Raw MIDI byte stream input class
+// Reads a raw MIDI device node (e.g. /dev/snd/midiC1D0 of a snd-virmidi card), a FIFO or a
+// captured file. There are no kernel timestamps on this path, so bytes are stamped when read.
+class RawMidiInput : public MidiInput {
+private:
+    std::string path;                  // Device, FIFO or file to read
+    MidiDispatcher& dispatcher;        // Parses and forwards the bytes
+    std::FILE* file = nullptr;
+    std::thread worker;
+    std::atomic<bool> running{false};
+
+    // Function run by the reader thread: wait for bytes with poll() so stop() is noticed quickly
+    void readLoop() {
+        unsigned char buffer[256];
+        while (running) {
+#ifdef _WIN32
+            size_t got = std::fread(buffer, 1, sizeof(buffer), file); // Files and pipes: ends at end of stream
+            if (got == 0) break;
+#else
+            pollfd p = {fileno(file), POLLIN, 0};
+            if (poll(&p, 1, 100) <= 0) continue;   // Timeout: check running again
+            ssize_t got = read(p.fd, buffer, sizeof(buffer));
+            if (got <= 0) break;           // End of file or device closed
+#endif
+            dispatcher.bytes(buffer, static_cast<size_t>(got), steadyNanos(), systemMillis());
+        }
+    }
+
+public:
+    RawMidiInput(const std::string& p, MidiDispatcher& d) : path(p), dispatcher(d) {}
+    ~RawMidiInput() { stop(); }
+
+    bool start() override {
+        file = std::fopen(path.c_str(), "rb");
+        if (!file) return false;
+        std::setvbuf(file, nullptr, _IONBF, 0); // Hand bytes over as soon as they arrive
+        running = true;
+        worker = std::thread(&RawMidiInput::readLoop, this);
+        return true;
+    }
+
+    void stop() override {
+        if (!file) return;
+        running = false;
+        if (worker.joinable()) worker.join(); // The reader wakes within one poll timeout
+        std::fclose(file);
+        file = nullptr;
+    }
+
+    std::string describe() const override { return "raw MIDI " + path; }
+};
+
+#ifdef PIANO_WITH_ALSA
+// ALSA sequencer input class (Linux, build with -DPIANO_WITH_ALSA and -lasound)
+// Creates a "Console Piano" sequencer client with one input port. The port is stamped with
+// real time from our own sequencer queue, so every event carries the kernel's arrival time
+// instead of the time our thread happened to wake up.
+class AlsaSeqMidiInput : public MidiInput {
+private:
+    std::string source;                // Optional "client:port" to connect from (e.g. "20:0")
+    MidiDispatcher& dispatcher;
+    snd_seq_t* seq = nullptr;          // Sequencer handle
+    int port = -1;                     // Our input port
+    int queue = -1;                    // Queue providing the timestamps
+    long long steadyBaseNs = 0;        // Steady clock when the queue started
+    long long systemBaseMs = 0;        // System clock when the queue started
+    std::thread worker;
+    std::atomic<bool> running{false};
+
+    // Function run by the MIDI thread: wait for events with poll() so stop() is noticed quickly
+    void readLoop() {
+        int count = snd_seq_poll_descriptors_count(seq, POLLIN);
+        std::vector<pollfd> fds(count);
+        snd_seq_poll_descriptors(seq, fds.data(), count, POLLIN);
+        while (running) {
+            if (poll(fds.data(), count, 100) <= 0) continue;
+            snd_seq_event_t* ev = nullptr;
+            while (snd_seq_event_input(seq, &ev) >= 0 && ev) {
+                // Kernel timestamp: real time since our queue started
+                long long queueNs = static_cast<long long>(ev->time.time.tv_sec) * 1000000000LL + ev->time.time.tv_nsec;
+                long long stampNs = steadyBaseNs + queueNs;
+                long long stampMs = systemBaseMs + queueNs / 1000000;
+                switch (ev->type) {
+                case SND_SEQ_EVENT_NOTEON:
+                    dispatcher.message(0x90, ev->data.note.note, ev->data.note.velocity, stampNs, stampMs);
+                    break;
+                case SND_SEQ_EVENT_NOTEOFF:
+                    dispatcher.message(0x80, ev->data.note.note, 0, stampNs, stampMs);
+                    break;
+                case SND_SEQ_EVENT_CONTROLLER:
+                    dispatcher.message(0xB0, static_cast<unsigned char>(ev->data.control.param),
+                                       static_cast<unsigned char>(ev->data.control.value), stampNs, stampMs);
+                    break;
+                default:
+                    break;
+                }
+            }
+        }
+    }
+
+public:
+    AlsaSeqMidiInput(const std::string& src, MidiDispatcher& d) : source(src), dispatcher(d) {}
+    ~AlsaSeqMidiInput() { stop(); }
+
+    bool start() override {
+        if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK) < 0) return false;
+        snd_seq_set_client_name(seq, "Console Piano");
+        queue = snd_seq_alloc_named_queue(seq, "Console Piano input");
+
+        snd_seq_port_info_t* info;
+        snd_seq_port_info_alloca(&info);
+        snd_seq_port_info_set_name(info, "Piano In");
+        snd_seq_port_info_set_capability(info, SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE);
+        snd_seq_port_info_set_type(info, SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+        snd_seq_port_info_set_timestamping(info, 1);     // Ask the kernel to stamp incoming events
+        snd_seq_port_info_set_timestamp_real(info, 1);   // ... in real time, not ticks
+        snd_seq_port_info_set_timestamp_queue(info, queue);
+        if (snd_seq_create_port(seq, info) < 0) {
+            snd_seq_close(seq);
+            seq = nullptr;
+            return false;
+        }
+        port = snd_seq_port_info_get_port(info);
+
+        if (!source.empty()) {             // Connect a keyboard (otherwise use aconnect later)
+            snd_seq_addr_t addr;
+            if (snd_seq_parse_address(seq, &addr, source.c_str()) < 0 ||
+                snd_seq_connect_from(seq, port, addr.client, addr.port) < 0) {
+                snd_seq_close(seq);
+                seq = nullptr;
+                return false;
+            }
+        }
+
+        snd_seq_start_queue(seq, queue, nullptr);
+        snd_seq_drain_output(seq);
+        steadyBaseNs = steadyNanos();      // Queue time 0 is now
+        systemBaseMs = systemMillis();
+        running = true;
+        worker = std::thread(&AlsaSeqMidiInput::readLoop, this);
+        return true;
+    }
+
+    void stop() override {
+        if (!seq) return;
+        running = false;
+        if (worker.joinable()) worker.join();
+        snd_seq_free_queue(seq, queue);
+        snd_seq_close(seq);
+        seq = nullptr;
+    }
+
+    std::string describe() const override {
+        return "ALSA sequencer " + std::to_string(snd_seq_client_id(seq)) + ":" + std::to_string(port);
+    }
+};
+#endif
+
+// Scheduled MIDI message structure definition (one outgoing message and when to send it)
+struct ScheduledMidi {
+    long long atNs;          // Time after the start of playback, in nanoseconds
+    unsigned char bytes[3];  // Raw MIDI message
+    int length;              // Bytes used
+};
+
+// Function to turn a recording into time-ordered MIDI messages (channel 1)
+// Console notes carry their own length, so their note-off is generated here.
+std::vector<ScheduledMidi> buildMidiSchedule(const std::vector<Note>& notes) {
+    std::vector<ScheduledMidi> schedule;
+    for (const auto& note : notes) {
+        ScheduledMidi m = {};
+        m.atNs = note.timestamp * 1000000LL;
+        m.length = 3;
+        if (note.kind == NoteKind::Note) {
+            m.bytes[0] = 0x90;
+            m.bytes[1] = note.key & 127;
+            m.bytes[2] = std::max<unsigned char>(1, note.velocity & 127); // Velocity 0 would mean note-off
+            schedule.push_back(m);
+            if (note.duration > 0) {       // Matching note-off at the end of the gate
+                m.atNs += note.duration * 1000000LL;
+                m.bytes[0] = 0x80;
+                m.bytes[2] = 0;
+                schedule.push_back(m);
+            }
+        } else if (note.kind == NoteKind::NoteOff) {
+            m.bytes[0] = 0x80;
+            m.bytes[1] = note.key & 127;
+            m.bytes[2] = 0;
+            schedule.push_back(m);
+        } else {
+            m.bytes[0] = 0xB0;
+            m.bytes[1] = note.kind == NoteKind::Sustain ? 64 : 66;
+            m.bytes[2] = note.pedalDown ? 127 : 0;
+            schedule.push_back(m);
+        }
+    }
+    std::stable_sort(schedule.begin(), schedule.end(),
+                     [](const ScheduledMidi& a, const ScheduledMidi& b) { return a.atNs < b.atNs; });
+    return schedule;
+}
+
+// Jitter report structure definition (how far deliveries were from their scheduled time)
+struct JitterReport {
+    int events = 0;          // Messages measured
+    double meanUs = 0.0;     // Average lateness in microseconds
+    double maxUs = 0.0;      // Worst lateness
+    double stddevUs = 0.0;   // Spread of the lateness
+
+    // Function to compute the report from a list of lateness values in nanoseconds
+    static JitterReport from(const std::vector<long long>& latenessNs) {
+        JitterReport r;
+        r.events = static_cast<int>(latenessNs.size());
+        if (latenessNs.empty()) return r;
+        double sum = 0.0;
+        double sumSquares = 0.0;
+        for (long long ns : latenessNs) {
+            double us = std::fabs(ns / 1000.0);
+            sum += us;
+            sumSquares += us * us;
+            r.maxUs = std::max(r.maxUs, us);
+        }
+        r.meanUs = sum / r.events;
+        r.stddevUs = std::sqrt(std::max(0.0, sumSquares / r.events - r.meanUs * r.meanUs));
+        return r;
+    }
+};
+
+// MIDI output interface class (where playback sends its MIDI)
+class MidiOutput {
+public:
+    virtual ~MidiOutput() {}
+    virtual bool open() = 0;                                   // Returns false if the port is unavailable
+    virtual void start(const std::vector<ScheduledMidi>& schedule) = 0; // Begin sending, returns immediately
+    virtual JitterReport finish() = 0;                         // Wait until everything was sent
+    virtual std::string describe() const = 0;
+};
+
+// Timed MIDI output class (base for the stand-ins)
+// A sender thread sleeps until each deadline, so precision is whatever the OS gives our
+// thread; the jitter report shows exactly how much that is.
+class TimedMidiOutput : public MidiOutput {
+private:
+    std::vector<ScheduledMidi> pending;
+    std::vector<long long> lateness;   // Actual minus scheduled send time, per message
+    std::thread worker;
+
+    // Function run by the sender thread
+    void sendLoop() {
+        auto base = std::chrono::steady_clock::now();
+        for (const auto& m : pending) {
+            auto due = base + std::chrono::nanoseconds(m.atNs);
+            std::this_thread::sleep_until(due);
+            deliver(m);
+            lateness.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - due).count());
+        }
+    }
+
+protected:
+    virtual void deliver(const ScheduledMidi& m) = 0;          // Write one message out
+
+public:
+    ~TimedMidiOutput() { if (worker.joinable()) worker.join(); }
+
+    void start(const std::vector<ScheduledMidi>& schedule) override {
+        if (worker.joinable()) finish();   // Started again without finish(): the previous schedule runs out first
+        pending = schedule;
+        lateness.clear();
+        lateness.reserve(pending.size());
+        worker = std::thread(&TimedMidiOutput::sendLoop, this);
+    }
+
+    JitterReport finish() override {
+        if (worker.joinable()) worker.join();
+        return JitterReport::from(lateness);
+    }
+};
+
+// MIDI file stand-in class: writes "<scheduled ns> <actual ns> <hex bytes>" lines to a file
+class FileMidiOutput : public TimedMidiOutput {
+private:
+    std::string path;
+    std::ofstream file;
+    long long baseNs = 0;
+
+protected:
+    void deliver(const ScheduledMidi& m) override {
+        if (baseNs == 0) baseNs = steadyNanos() - m.atNs;      // First message defines time zero
+        static const char* hex = "0123456789abcdef";
+        file << m.atNs << " " << steadyNanos() - baseNs;
+        for (int i = 0; i < m.length; i++) file << " " << hex[m.bytes[i] >> 4] << hex[m.bytes[i] & 15];
+        file << "\n";
+    }
+
+public:
+    FileMidiOutput(const std::string& p) : path(p) {}
+
+    bool open() override {
+        file.open(path, std::ios::trunc);
+        return static_cast<bool>(file);
+    }
+
+    JitterReport finish() override {
+        JitterReport r = TimedMidiOutput::finish();
+        file.flush();
+        baseNs = 0;
+        return r;
+    }
+
+    std::string describe() const override { return "file " + path; }
+};
+
+// MIDI socket stand-in class: sends each raw MIDI message as one UDP datagram
+class UdpMidiOutput : public TimedMidiOutput {
+private:
+    std::string host;
+    int port;
+    SOCKET sock = INVALID_SOCKET;
+    sockaddr_in target = {};
+
+protected:
+    void deliver(const ScheduledMidi& m) override {
+        sendto(sock, reinterpret_cast<const char*>(m.bytes), m.length, 0,
+               reinterpret_cast<const sockaddr*>(&target), sizeof(target));
+    }
+
+public:
+    UdpMidiOutput(const std::string& h, int p) : host(h), port(p) {}
+    ~UdpMidiOutput() {
+        finish();
+        if (sock != INVALID_SOCKET) {
+            closeSocket(sock);
+            socketsCleanup();
+        }
+    }
+
+    bool open() override {
+        if (!socketsStartup()) return false;
+        sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (sock == INVALID_SOCKET) return false;
+        target.sin_family = AF_INET;
+        target.sin_port = htons(static_cast<u_short>(port));
+        target.sin_addr.s_addr = inet_addr(host.c_str());
+        return true;
+    }
+
+    std::string describe() const override { return "udp " + host + ":" + std::to_string(port); }
+};
+
+#ifdef PIANO_WITH_ALSA
+// ALSA sequencer output class
+// Every message is handed to the kernel up front with a real-time stamp on our own queue,
+// and the sequencer dispatches it at that time, so our thread's wakeups do not matter.
+// To measure jitter each message is also sent to a private echo port; that port is stamped by
+// the kernel on delivery, and delivery time minus scheduled time is the jitter.
+class AlsaSeqMidiOutput : public MidiOutput {
+private:
+    static const long long LEAD_NS = 100000000LL; // Start 100 ms after submitting (room to fill the queue)
+    std::string destination;           // Optional "client:port" of the synth
+    snd_seq_t* seq = nullptr;
+    int client = -1;
+    int outPort = -1;                  // Port external synths subscribe to
+    int echoPort = -1;                 // Private port receiving the copies
+    int queue = -1;
+    std::vector<ScheduledMidi> pending;
+    std::vector<long long> lateness;
+    std::thread submitter;             // Feeds events (blocks while the kernel pool is full)
+    std::thread echoReader;            // Collects delivery stamps
+
+    // Function to fill an event with a MIDI message
+    static void setMessage(snd_seq_event_t& ev, const ScheduledMidi& m) {
+        int channel = m.bytes[0] & 15;
+        switch (m.bytes[0] & 0xF0) {
+        case 0x90: snd_seq_ev_set_noteon(&ev, channel, m.bytes[1], m.bytes[2]); break;
+        case 0x80: snd_seq_ev_set_noteoff(&ev, channel, m.bytes[1], m.bytes[2]); break;
+        default: snd_seq_ev_set_controller(&ev, channel, m.bytes[1], m.bytes[2]); break;
+        }
+    }
+
+    // Function run by the submitter thread
+    void submitLoop() {
+        for (const auto& m : pending) {
+            snd_seq_real_time_t when;
+            long long at = m.atNs + LEAD_NS;
+            when.tv_sec = static_cast<unsigned int>(at / 1000000000LL);
+            when.tv_nsec = static_cast<unsigned int>(at % 1000000000LL);
+            for (int copy = 0; copy < 2; copy++) {
+                snd_seq_event_t ev;
+                snd_seq_ev_clear(&ev);
+                setMessage(ev, m);
+                snd_seq_ev_set_source(&ev, outPort);
+                if (copy == 0) snd_seq_ev_set_subs(&ev);              // To the synth(s)
+                else snd_seq_ev_set_dest(&ev, client, echoPort);      // To ourselves for the measurement
+                snd_seq_ev_schedule_real(&ev, queue, 0, &when);
+                snd_seq_event_output(seq, &ev);                       // Blocks while the pool is full
+            }
+            snd_seq_drain_output(seq);
+        }
+    }
+
+    // Function run by the echo reader thread
+    void echoLoop() {
+        int count = snd_seq_poll_descriptors_count(seq, POLLIN);
+        std::vector<pollfd> fds(count);
+        snd_seq_poll_descriptors(seq, fds.data(), count, POLLIN);
+        long long lastDue = pending.empty() ? 0 : pending.back().atNs + LEAD_NS;
+        long long deadline = steadyNanos() + lastDue + 2000000000LL; // Give up 2 s after the last event
+        while (lateness.size() < pending.size() && steadyNanos() < deadline) {
+            if (poll(fds.data(), count, 100) <= 0) continue;
+            snd_seq_event_t* ev = nullptr;
+            while (snd_seq_event_input(seq, &ev) >= 0 && ev) {
+                if (ev->dest.port != echoPort) continue;
+                long long delivered = static_cast<long long>(ev->time.time.tv_sec) * 1000000000LL + ev->time.time.tv_nsec;
+                long long due = pending[lateness.size()].atNs + LEAD_NS; // Echoes arrive in schedule order
+                lateness.push_back(delivered - due);
+                if (lateness.size() == pending.size()) break;
+            }
+        }
+    }
+
+public:
+    AlsaSeqMidiOutput(const std::string& dest) : destination(dest) {}
+    ~AlsaSeqMidiOutput() {
+        finish();
+        if (seq) snd_seq_close(seq);
+    }
+
+    bool open() override {
+        if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK) < 0) return false;
+        snd_seq_set_client_name(seq, "Console Piano Playback");
+        client = snd_seq_client_id(seq);
+        queue = snd_seq_alloc_named_queue(seq, "Console Piano playback");
+        outPort = snd_seq_create_simple_port(seq, "Piano Out", SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+                                             SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+
+        snd_seq_port_info_t* info;
+        snd_seq_port_info_alloca(&info);
+        snd_seq_port_info_set_name(info, "Piano Echo");
+        snd_seq_port_info_set_capability(info, SND_SEQ_PORT_CAP_WRITE);
+        snd_seq_port_info_set_type(info, SND_SEQ_PORT_TYPE_APPLICATION);
+        snd_seq_port_info_set_timestamping(info, 1);   // Kernel stamps the delivery time
+        snd_seq_port_info_set_timestamp_real(info, 1);
+        snd_seq_port_info_set_timestamp_queue(info, queue);
+        if (outPort < 0 || snd_seq_create_port(seq, info) < 0) return false;
+        echoPort = snd_seq_port_info_get_port(info);
+
+        if (!destination.empty()) {
+            snd_seq_addr_t addr;
+            if (snd_seq_parse_address(seq, &addr, destination.c_str()) < 0 ||
+                snd_seq_connect_to(seq, outPort, addr.client, addr.port) < 0) return false;
+        }
+        return true;
+    }
+
+    void start(const std::vector<ScheduledMidi>& schedule) override {
+        if (submitter.joinable() || echoReader.joinable()) finish(); // As TimedMidiOutput::start
+        pending = schedule;
+        lateness.clear();
+        lateness.reserve(pending.size());
+        snd_seq_nonblock(seq, 0);          // Submitting should wait for pool space, not fail
+        snd_seq_start_queue(seq, queue, nullptr);
+        snd_seq_drain_output(seq);
+        echoReader = std::thread(&AlsaSeqMidiOutput::echoLoop, this);
+        submitter = std::thread(&AlsaSeqMidiOutput::submitLoop, this);
+    }
+
+    JitterReport finish() override {
+        if (submitter.joinable()) submitter.join();
+        if (echoReader.joinable()) echoReader.join();
+        if (seq && queue >= 0) {
+            snd_seq_stop_queue(seq, queue, nullptr);
+            snd_seq_drain_output(seq);
+        }
+        return JitterReport::from(lateness);
+    }
+
+    std::string describe() const override {
+        return "ALSA sequencer " + std::to_string(client) + ":" + std::to_string(outPort);
+    }
+};
+#endif
+
+
+// Reloaded config structure definition (everything one config file produces, built off the audio thread)
+struct ReloadedConfig {
+    PianoConfig config;
+    bool hasTuning = false;           // The file names a Scala scale
+    TuningTable tuning;               // Compiled scale (valid if hasTuning)
+};
+
+// Function to load a config file and the tuning it names (startup and reloads)
+bool loadReloadedConfig(const std::string& path, ReloadedConfig& loaded, std::string& error) {
+    if (!loadPianoConfig(path, loaded.config, error)) return false;
+    if (loaded.config.tuningFile.empty()) return true;
+    if (!loadTuning(loaded.config.tuningFile, loaded.config.keyboardMapFile, loaded.tuning, error)) return false;
+    loaded.hasTuning = true;
+    return true;
+}
+
+// Function to combine the command line settings with the ones a config file sets
+EngineSettings settingsFor(const PianoConfig& config, EngineSettings base) {
+    base.fmAlgorithm = config.fmAlgorithm;
+    if (config.oversample > 0) base.oversample = config.oversample;
+    if (config.drive >= 0.0f) base.drive = config.drive;
+    return base;
+}
+
+// Config watcher class (reloads the config file when it changes, while playing)
+// Linux: inotify on the file's directory, since editors usually save by renaming a new file over
+// the old one and a watch on the file itself would be lost. Elsewhere: polls the modification time.
+// The new file is parsed and validated on the watcher thread; an invalid file keeps the old config.
+// Engine settings go to the engine, which swaps them in at the next block boundary. The keyboard
+// side (layouts, zones, tuning) is handed to the console thread through take().
+class ConfigWatcher {
+private:
+    std::string path;
+    AudioEngine& engine;
+    EngineSettings base;              // Command line settings the file may override
+    std::ostream& log;
+    std::atomic<ReloadedConfig*> ready{nullptr}; // Waiting for the console thread
+    std::atomic<bool> stopping{false};
+    std::thread thread;
+
+    // Function to load the file and publish it (watcher thread)
+    void reload() {
+        std::unique_ptr<ReloadedConfig> loaded(new ReloadedConfig());
+        std::string error;
+        if (!loadReloadedConfig(path, *loaded, error)) {
+            log << "[config] reload failed, keeping the old config: " << error << std::endl;
+            return;
+        }
+        engine.applySettings(settingsFor(loaded->config, base));
+        delete ready.exchange(loaded.release(), std::memory_order_acq_rel); // Drop one the console never took
+        log << "[config] reloaded " << path << std::endl;
+    }
+
+    // Function to wait for changes until stop() (watcher thread)
+    void run() {
+#ifdef __linux__
+        size_t slash = path.find_last_of('/');
+        std::string directory = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+        std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+        int fd = inotify_init1(IN_NONBLOCK);
+        if (fd >= 0 && inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) >= 0) {
+            alignas(struct inotify_event) char buffer[4096];
+            while (!stopping.load(std::memory_order_acquire)) {
+                pollfd p = {fd, POLLIN, 0};
+                if (poll(&p, 1, 200) <= 0) continue;   // Timeout: check stopping again
+                bool changed = false;
+                for (;;) {                              // Saves come as bursts of events; collect them all
+                    ssize_t length = read(fd, buffer, sizeof(buffer));
+                    if (length <= 0) {
+                        if (!changed) break;
+                        // Reload only after a settle window with no events: an editor's close or
+                        // rename may follow the first write much later than one window
+                        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                        length = read(fd, buffer, sizeof(buffer));
+                        if (length <= 0) {
+                            reload();
+                            break;
+                        }
+                    }
+                    for (ssize_t at = 0; at < length;) {
+                        const inotify_event* e = reinterpret_cast<const inotify_event*>(buffer + at);
+                        if (e->len > 0 && name == e->name) changed = true;
+                        at += sizeof(inotify_event) + e->len;
+                    }
+                }
+            }
+            close(fd);
+            return;
+        }
+        if (fd >= 0) close(fd);
+        log << "[config] inotify unavailable, polling " << path << std::endl;
+#endif
+        struct stat last = {};
+        stat(path.c_str(), &last);
+        while (!stopping.load(std::memory_order_acquire)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+            struct stat now = {};
+            if (stat(path.c_str(), &now) != 0) continue; // Mid-save: the file may briefly not exist
+            if (now.st_mtime == last.st_mtime && now.st_size == last.st_size) continue;
+            last = now;
+            reload();
+        }
+    }
+
+public:
+    ConfigWatcher(const std::string& file, AudioEngine& eng, const EngineSettings& commandLine, std::ostream& logStream)
+        : path(file), engine(eng), base(commandLine), log(logStream) {}
+
+    ~ConfigWatcher() {
+        stop();
+        delete ready.exchange(nullptr);
+    }
+
+    void start() {
+        thread = std::thread([this] { run(); });
+    }
+
+    void stop() {
+        stopping.store(true, std::memory_order_release);
+        if (thread.joinable()) thread.join();
+    }
+
+    // Function to take the newest reloaded config, if any (console thread, the caller owns it)
+    ReloadedConfig* take() {
+        return ready.exchange(nullptr, std::memory_order_acq_rel);
+    }
+};
+
+// Mapped file class (read-only view of a whole file; pages are read in when first touched)
+class MappedFile {
+private:
+    const unsigned char* bytes = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+
+public:
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    // Function to map a file; returns false with an empty error if the file does not exist
+    bool open(const std::string& path, std::string& error) {
+        close();
+        error.clear();
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            if (GetLastError() != ERROR_FILE_NOT_FOUND) error = "cannot open " + path;
+            return false;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+            error = path + " is empty";
+            close();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        const void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        if (!view) {
+            error = "cannot map " + path;
+            close();
+            return false;
+        }
+        bytes = static_cast<const unsigned char*>(view);
+        length = static_cast<size_t>(size.QuadPart);
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            if (errno != ENOENT) error = "cannot open " + path;
+            return false;
+        }
+        struct stat st = {};
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            error = path + " is empty";
+            ::close(fd);
+            return false;
+        }
+        void* view = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);                      // The mapping keeps the file alive
+        if (view == MAP_FAILED) {
+            error = "cannot map " + path;
+            return false;
+        }
+        bytes = static_cast<const unsigned char*>(view);
+        length = static_cast<size_t>(st.st_size);
+#endif
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (bytes) UnmapViewOfFile(bytes);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (bytes) munmap(const_cast<unsigned char*>(bytes), length);
+#endif
+        bytes = nullptr;
+        length = 0;
+    }
+
+    const unsigned char* data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+// Packed note structure definition (one recording entry as stored in files: fixed size, no pointers)
+// The display name is not stored; it follows from kind and key.
+struct PackedNote {
+    uint32_t timeMs;        // Offset from the start of the recording
+    float frequency;        // Hz (0 for pedal and key-release entries)
+    float gain;             // Zone loudness
+    uint16_t durationMs;    // Time until the automatic note-off (0 = wait for a NoteOff entry)
+    uint8_t key;            // MIDI note number
+    uint8_t velocity;       // 1-127
+    uint8_t kind;           // NoteKind
+    uint8_t instrument;     // Instrument
+    uint8_t pedalDown;      // Pedal entries: 1 when the pedal went down
+    uint8_t reserved;
+};
+static_assert(sizeof(PackedNote) == 20, "PackedNote is a file format");
+
+// Function to pack a recording entry for a file
+PackedNote packNote(const Note& note) {
+    PackedNote p = {};
+    p.timeMs = static_cast<uint32_t>(std::max(0LL, std::min(note.timestamp, 0xFFFFFFFFLL)));
+    p.frequency = static_cast<float>(note.frequency);
+    p.gain = note.gain;
+    p.durationMs = static_cast<uint16_t>(std::max(0, std::min(note.duration, 0xFFFF)));
+    p.key = note.key;
+    p.velocity = note.velocity;
+    p.kind = static_cast<uint8_t>(note.kind);
+    p.instrument = note.instrument;
+    p.pedalDown = note.pedalDown ? 1 : 0;
+    return p;
+}
+
+// Function to turn a packed entry back into a recording entry
+Note unpackNote(const PackedNote& p) {
+    Note n;
+    n.kind = static_cast<NoteKind>(p.kind);
+    n.name = n.kind == NoteKind::Note ? NOTE_NAMES[p.key % 12] : n.kind == NoteKind::NoteOff ? "Off"
+           : n.kind == NoteKind::Sustain ? "Ped" : "Sost";
+    n.frequency = p.frequency;
+    n.timestamp = p.timeMs;
+    n.instrument = p.instrument;
+    n.gain = p.gain;
+    n.velocity = p.velocity;
+    n.key = p.key;
+    n.duration = p.durationMs;
+    n.pedalDown = p.pedalDown != 0;
+    return n;
+}
+
+const int PITCH_CLASSES = 12;
+const int INTERVAL_BUCKETS = 25;   // Semitones between consecutive notes, 0..24 (wider leaps count as 24)
+const int IOI_BUCKET_MS = 10;      // Resolution of the inter-onset interval histogram
+const int IOI_BUCKETS = 200;       // Onsets up to 2 s apart (longer gaps are pauses, not tempo)
+const int CHORD_WINDOW_MS = 30;    // Notes this close to the last onset belong to the same chord
+
+// Recording statistics structure definition (what was played; plain sums, so a library merges by adding)
+struct RecordingStats {
+    unsigned long long recordings = 0;
+    unsigned long long notes = 0;
+    unsigned long long pitchClass[PITCH_CLASSES] = {};
+    unsigned long long interval[INTERVAL_BUCKETS] = {};
+    unsigned long long ioi[IOI_BUCKETS] = {}; // Time between onsets, IOI_BUCKET_MS per bucket
+    unsigned long long ioiMs[IOI_BUCKETS] = {}; // Sum of the times in each bucket (exact mean around the peak)
+    unsigned long long velocitySum = 0;
+    unsigned long long playedMs = 0;     // Sum of the recordings' playing time (at least 1 s each)
+    int busiestSecond = 0;               // Most notes started within one second of any recording
+
+    void merge(const RecordingStats& other) {
+        recordings += other.recordings;
+        notes += other.notes;
+        for (int i = 0; i < PITCH_CLASSES; i++) pitchClass[i] += other.pitchClass[i];
+        for (int i = 0; i < INTERVAL_BUCKETS; i++) interval[i] += other.interval[i];
+        for (int i = 0; i < IOI_BUCKETS; i++) ioi[i] += other.ioi[i];
+        for (int i = 0; i < IOI_BUCKETS; i++) ioiMs[i] += other.ioiMs[i];
+        velocitySum += other.velocitySum;
+        playedMs += other.playedMs;
+        busiestSecond = std::max(busiestSecond, other.busiestSecond);
+    }
+
+    double notesPerSecond() const { return playedMs > 0 ? notes * 1000.0 / playedMs : 0.0; }
+    double meanVelocity() const { return notes > 0 ? static_cast<double>(velocitySum) / notes : 0.0; }
+
+    // Function to estimate the tempo from the most common time between onsets (0 = too few notes)
+    // The peak is averaged with its neighbours, then folded into 60-180 BPM (eighths and halves count as beats).
+    double tempoBpm() const {
+        int peak = -1;
+        unsigned long long peakWeight = 0;
+        for (int b = 1; b + 1 < IOI_BUCKETS; b++) {   // Bucket 0 is faster than any beat
+            unsigned long long weight = ioi[b - 1] + 2 * ioi[b] + ioi[b + 1];
+            if (weight > peakWeight) {
+                peakWeight = weight;
+                peak = b;
+            }
+        }
+        if (peak < 0 || ioi[peak] < 2) return 0.0;
+        double onsets = static_cast<double>(ioi[peak - 1] + ioi[peak] + ioi[peak + 1]);
+        double totalMs = static_cast<double>(ioiMs[peak - 1] + ioiMs[peak] + ioiMs[peak + 1]);
+        double bpm = 60000.0 * onsets / totalMs;
+        while (bpm < 60.0) bpm *= 2.0;
+        while (bpm >= 180.0) bpm /= 2.0;
+        return bpm;
+    }
+
+    // Function to get the most played pitch class (-1 = no notes)
+    int topPitchClass() const {
+        int top = -1;
+        for (int i = 0; i < PITCH_CLASSES; i++) if (pitchClass[i] > 0 && (top < 0 || pitchClass[i] > pitchClass[top])) top = i;
+        return top;
+    }
+};
+
+// Recording analyzer class (statistics of one recording, built one entry at a time)
+// Fed live by the Recorder while a take is played, or in one pass over a stored recording;
+// either way nothing but the counters is kept, however long the recording is.
+class RecordingAnalyzer {
+private:
+    RecordingStats stats;
+    long long firstMs = -1, lastMs = -1; // First and last note
+    long long lastOnsetMs = -1;           // Start of the last chord or single note
+    int lastKey = -1;
+    long long second = -1;                // Second of the recording being counted for busiestSecond
+    int secondNotes = 0;
+
+    // Function to update everything that depends on the previous note (order matters, so scalar)
+    void sequence(long long timeMs, int key, int velocity) {
+        stats.notes++;
+        stats.velocitySum += velocity;
+        if (firstMs < 0) firstMs = timeMs;
+        lastMs = timeMs;
+        if (lastKey >= 0) stats.interval[std::min(INTERVAL_BUCKETS - 1, std::abs(key - lastKey))]++;
+        lastKey = key;
+        if (lastOnsetMs < 0 || timeMs - lastOnsetMs >= CHORD_WINDOW_MS) {
+            long long bucket = lastOnsetMs < 0 ? IOI_BUCKETS : (timeMs - lastOnsetMs) / IOI_BUCKET_MS;
+            if (bucket < IOI_BUCKETS) {
+                stats.ioi[bucket]++;
+                stats.ioiMs[bucket] += timeMs - lastOnsetMs;
+            }
+            lastOnsetMs = timeMs;
+        }
+        if (timeMs / 1000 != second) {
+            second = timeMs / 1000;
+            secondNotes = 0;
+        }
+        stats.busiestSecond = std::max(stats.busiestSecond, ++secondNotes);
+    }
+
+public:
+    void reset() { *this = RecordingAnalyzer(); }
+
+    // Function to add one entry (pedals and key releases do not count)
+    void add(long long timeMs, NoteKind kind, int key, int velocity) {
+        if (kind != NoteKind::Note) return;
+        stats.pitchClass[key % PITCH_CLASSES]++;
+        sequence(timeMs, key, velocity);
+    }
+
+    // Function to add a stored recording in one pass over its packed entries (defined below)
+    void addPacked(const PackedNote* notes, size_t count);
+
+    // Function to get the statistics so far (counted as one recording)
+    RecordingStats result() const {
+        RecordingStats r = stats;
+        r.recordings = 1;
+        r.playedMs = std::max(1000LL, lastMs - firstMs); // A single chord still took a moment to play
+        return r;
+    }
+};
+
+// Function to add a stored recording in one pass (entries are read in place, e.g. from a mapped file)
+void RecordingAnalyzer::addPacked(const PackedNote* notes, size_t count) {
+    size_t i = 0;
+#ifdef __AVX2__
+    // Pitch classes eight entries at a time: one gather reads key, velocity and kind of each entry,
+    // and each class is counted with a compare and a subtract instead of scattered increments.
+    // The order-dependent statistics follow for the same eight entries while they are in cache.
+    const __m256i offsets = _mm256_setr_epi32(0, 20, 40, 60, 80, 100, 120, 140);
+    const __m256i byteMask = _mm256_set1_epi32(0xFF);
+    __m256i counts[PITCH_CLASSES];
+    for (auto& c : counts) c = _mm256_setzero_si256();
+    for (; i + 8 <= count; i += 8) {
+        const int* base = reinterpret_cast<const int*>(reinterpret_cast<const char*>(notes + i) + offsetof(PackedNote, key));
+        __m256i raw = _mm256_i32gather_epi32(base, offsets, 1); // key, velocity, kind, instrument
+        __m256i key = _mm256_and_si256(raw, byteMask);
+        __m256i isNote = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_srli_epi32(raw, 16), byteMask),
+                                            _mm256_set1_epi32(static_cast<int>(NoteKind::Note)));
+        __m256i octave = _mm256_srli_epi32(_mm256_mullo_epi32(key, _mm256_set1_epi32(171)), 11); // key / 12 (keys < 256)
+        __m256i pitchClass = _mm256_sub_epi32(key, _mm256_mullo_epi32(octave, _mm256_set1_epi32(PITCH_CLASSES)));
+        pitchClass = _mm256_or_si256(pitchClass, _mm256_andnot_si256(isNote, _mm256_set1_epi32(PITCH_CLASSES))); // Not a note: >= 12
+        for (int c = 0; c < PITCH_CLASSES; c++) {
+            counts[c] = _mm256_sub_epi32(counts[c], _mm256_cmpeq_epi32(pitchClass, _mm256_set1_epi32(c)));
+        }
+        for (size_t j = i; j < i + 8; j++) {
+            if (notes[j].kind == static_cast<uint8_t>(NoteKind::Note)) sequence(notes[j].timeMs, notes[j].key, notes[j].velocity);
+        }
+    }
+    for (int c = 0; c < PITCH_CLASSES; c++) {
+        alignas(32) uint32_t lanes[8];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), counts[c]);
+        for (uint32_t lane : lanes) stats.pitchClass[c] += lane;
+    }
+#endif
+    for (; i < count; i++) add(notes[i].timeMs, static_cast<NoteKind>(notes[i].kind), notes[i].key, notes[i].velocity);
+}
+
+const char SESSION_MAGIC[4] = {'P', 'S', 'E', 'S'};
+const uint32_t SESSION_VERSION = 1;
+
+// Session header structure definition (start of a session file, the recording's PackedNotes follow)
+// Plain fixed-size fields in machine byte order, so a mapped file is used without parsing.
+struct SessionHeader {
+    char magic[4];          // "PSES"
+    uint32_t version;       // SESSION_VERSION
+    uint32_t headerBytes;   // sizeof(SessionHeader), rejects files from a different layout
+    uint32_t noteBytes;     // sizeof(PackedNote)
+    uint64_t noteCount;     // Entries in the recording
+    int32_t octave;
+    uint8_t velocityCurve;  // VelocityCurveKind
+    uint8_t fmAlgorithm;    // FmAlgorithm
+    uint8_t reserved[2];
+    int32_t oversample;     // Square voices and saturator
+    float drive;            // Master saturation
+    char layout[64];        // Active key layout (name, zero-terminated)
+    char tuningName[64];    // Active tuning (name, zero-terminated)
+    double tuningHz[128];   // Active tuning table, so a scale loaded from a file comes back without it
+};
+static_assert(sizeof(SessionHeader) % 8 == 0, "notes after the header stay aligned");
+
+// Session snapshot structure definition (playing state kept across restarts)
+struct SessionSnapshot {
+    int octave = 4;
+    VelocityCurveKind velocityCurve = VelocityCurveKind::Linear;
+    std::string layout;
+    TuningTable tuning;
+    EngineSettings settings;
+    std::vector<Note> recording;
+};
+
+// Session file class (validated read-only view of a session file; the notes are used in place)
+class SessionFile {
+private:
+    MappedFile file;
+    const SessionHeader* head = nullptr;
+
+public:
+    // Function to map and check a session file; returns false with an empty error if it does not exist
+    bool open(const std::string& path, std::string& error) {
+        head = nullptr;
+        if (!file.open(path, error)) return false;
+        const SessionHeader* h = reinterpret_cast<const SessionHeader*>(file.data());
+        if (file.size() < sizeof(SessionHeader) || std::memcmp(h->magic, SESSION_MAGIC, 4) != 0) {
+            error = path + " is not a session file";
+        } else if (h->version != SESSION_VERSION || h->headerBytes != sizeof(SessionHeader) || h->noteBytes != sizeof(PackedNote)) {
+            error = path + " was written by a different version";
+        } else if (h->noteCount > (file.size() - sizeof(SessionHeader)) / sizeof(PackedNote)) {
+            error = path + " is truncated";
+        } else {
+            head = h;
+            return true;
+        }
+        file.close();
+        return false;
+    }
+
+    const SessionHeader& header() const { return *head; }
+    const PackedNote* notes() const { return reinterpret_cast<const PackedNote*>(file.data() + sizeof(SessionHeader)); }
+    size_t noteCount() const { return static_cast<size_t>(head->noteCount); }
+};
+
+// Function to copy a name into a fixed-size, zero-terminated header field
+template <size_t N>
+void copyName(char (&field)[N], const std::string& name) {
+    size_t length = std::min(name.size(), N - 1);
+    std::memcpy(field, name.data(), length);
+    std::memset(field + length, 0, N - length);
+}
+
+// Function to write a session file (written next to the old one and renamed over it,
+// so a crash while saving never leaves a half-written session behind)
+bool writeSession(const std::string& path, const SessionSnapshot& session, std::string& error) {
+    SessionHeader h = {};
+    std::memcpy(h.magic, SESSION_MAGIC, 4);
+    h.version = SESSION_VERSION;
+    h.headerBytes = sizeof(SessionHeader);
+    h.noteBytes = sizeof(PackedNote);
+    h.noteCount = session.recording.size();
+    h.octave = session.octave;
+    h.velocityCurve = static_cast<uint8_t>(session.velocityCurve);
+    h.fmAlgorithm = static_cast<uint8_t>(session.settings.fmAlgorithm);
+    h.oversample = session.settings.oversample;
+    h.drive = session.settings.drive;
+    copyName(h.layout, session.layout);
+    copyName(h.tuningName, session.tuning.name);
+    std::memcpy(h.tuningHz, session.tuning.hz.data(), sizeof(h.tuningHz));
+    std::vector<PackedNote> packed;
+    packed.reserve(session.recording.size());
+    for (const auto& note : session.recording) packed.push_back(packNote(note));
+
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        out.write(reinterpret_cast<const char*>(packed.data()), static_cast<std::streamsize>(packed.size() * sizeof(PackedNote)));
+        if (!out.flush()) {
+            error = "cannot write " + temporary;
+            return false;
+        }
+    }
+#ifdef _WIN32
+    std::remove(path.c_str());            // Windows rename does not replace an existing file
+#endif
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        error = "cannot replace " + path;
+        return false;
+    }
+    return true;
+}
 
-// Note structure definition
-struct Note {
-    std::string name;       // String to store the display name of the note
-    double frequency;       // Double precision float for the note's frequency in hertz
-    long long timestamp;    // Long long integer for the time offset from start of recording
+// Function to read the sound settings saved in a session header
+EngineSettings sessionSettings(const SessionHeader& h) {
+    EngineSettings settings;
+    settings.fmAlgorithm = static_cast<FmAlgorithm>(h.fmAlgorithm % NUM_FM_ALGORITHMS);
+    settings.oversample = std::max(1, std::min(8, static_cast<int>(h.oversample)));
+    settings.drive = std::max(0.0f, h.drive);
+    return settings;
+}
+
+// Function to read a session file; returns false with an empty error if there is none yet
+// withRecording = false reads only the header (the recording can follow in the background)
+bool readSession(const std::string& path, SessionSnapshot& session, std::string& error, bool withRecording = true) {
+    SessionFile file;
+    if (!file.open(path, error)) return false;
+    const SessionHeader& h = file.header();
+    session.octave = std::max(1, std::min(8, static_cast<int>(h.octave)));
+    session.velocityCurve = static_cast<VelocityCurveKind>(h.velocityCurve % NUM_VELOCITY_CURVES);
+    session.layout.assign(h.layout, strnlen(h.layout, sizeof(h.layout)));
+    session.tuning.name.assign(h.tuningName, strnlen(h.tuningName, sizeof(h.tuningName)));
+    std::memcpy(session.tuning.hz.data(), h.tuningHz, sizeof(h.tuningHz));
+    session.settings = sessionSettings(h);
+    session.recording.clear();
+    if (!withRecording) return true;
+    session.recording.reserve(file.noteCount());
+    const PackedNote* notes = file.notes();
+    for (size_t i = 0; i < file.noteCount(); i++) session.recording.push_back(unpackNote(notes[i]));
+    return true;
+}
+
+const int RENDER_CHUNK_FRAMES = 64 * 1024; // Frames rendered between writes in batch rendering (per job)
+const int RENDER_MAX_TAIL_MS = 10000;      // Longest release after the last entry (a held pedal never ends)
+
+// Function to render one recording file to a WAV file, streaming (memory does not grow with its length)
+// Entries take effect at the start of the block they fall in, like the golden scenes.
+bool renderRecording(const std::string& input, const std::string& output, double& audioSeconds, std::string& error) {
+    const int BLOCK = 256;
+    SessionFile session;
+    if (!session.open(input, error)) {
+        if (error.empty()) error = input + " not found";
+        return false;
+    }
+    PianoMetrics metrics;                 // Per job: activeVoices tells when the tail has faded out
+    std::unique_ptr<AudioEngine> engine(new AudioEngine(metrics));
+    engine->applySettings(sessionSettings(session.header()));
+    WavWriter wav;
+    if (!wav.open(output)) {
+        error = "cannot write " + output;
+        return false;
+    }
+    const PackedNote* notes = session.notes(); // Read in place from the mapped file
+    size_t count = session.noteCount(), next = 0;
+    unsigned long long endFrame = 0;      // Last entry plus the longest tail (set once every entry is in)
+    unsigned long long at = 0;
+    std::vector<float> chunk(RENDER_CHUNK_FRAMES);
+    auto finished = [&] {                 // Every entry played and the tail faded out (or cut off)
+        return next == count && (at >= endFrame || metrics.activeVoices.value.load(std::memory_order_relaxed) == 0);
+    };
+    for (;;) {
+        int filled = 0;
+        while (filled < RENDER_CHUNK_FRAMES) {
+            int frames = std::min(BLOCK, RENDER_CHUNK_FRAMES - filled);
+            while (next < count && static_cast<unsigned long long>(notes[next].timeMs) * SAMPLE_RATE / 1000 < at + frames) {
+                const PackedNote& n = notes[next];
+                bool posted;
+                if (n.kind == static_cast<uint8_t>(NoteKind::Note)) {
+                    posted = engine->noteOn(n.key, n.frequency, n.durationMs, static_cast<Instrument>(n.instrument % NUM_INSTRUMENTS),
+                                            n.gain, n.velocity);
+                } else if (n.kind == static_cast<uint8_t>(NoteKind::NoteOff)) {
+                    posted = engine->noteOff(n.key);
+                } else if (n.kind == static_cast<uint8_t>(NoteKind::Sustain)) {
+                    posted = engine->sustain(n.pedalDown != 0);
+                } else {
+                    posted = engine->sostenuto(n.pedalDown != 0);
+                }
+                if (!posted) break;       // Event queue full: the rest starts one block later
+                next++;
+            }
+            if (next == count && endFrame == 0) endFrame = at + static_cast<unsigned long long>(RENDER_MAX_TAIL_MS) * SAMPLE_RATE / 1000;
+            engine->render(chunk.data() + filled, frames);
+            filled += frames;
+            at += frames;
+            if (finished()) break;
+        }
+        wav.write(chunk.data(), filled);  // WavWriter turns these into megabyte-sized writes
+        if (finished()) break;
+    }
+    audioSeconds = static_cast<double>(at) / SAMPLE_RATE;
+    if (!wav.close()) {
+        error = "cannot write " + output;
+        return false;
+    }
+    return true;
+}
+
+// Function to collect the recordings to render: every .snap file in a directory, or the paths
+// listed in a text file (one per line, blank lines and lines starting with # are skipped)
+bool collectRecordings(const std::string& source, std::vector<std::string>& paths, std::string& error) {
+    if (listDirectory(source, ".snap", paths)) return true;
+    std::ifstream list(source);
+    if (!list) {
+        error = "cannot read " + source;
+        return false;
+    }
+    std::string line;
+    while (std::getline(list, line)) {
+        while (!line.empty() && std::isspace(static_cast<unsigned char>(line.back()))) line.pop_back();
+        if (!line.empty() && line[0] != '#') paths.push_back(line);
+    }
+    return true;
+}
+
+// Function to render many recordings to WAV files on the shared pool (--render-batch <dir or list>)
+// At most `jobs` recordings are open at once, so memory stays bounded however many files there are;
+// each job holds one engine, one render chunk and one write buffer.
+bool runRenderBatch(const std::string& source, const std::string& outDirectory, int jobs, std::ostream& out) {
+    std::vector<std::string> inputs;
+    std::string error;
+    if (!collectRecordings(source, inputs, error)) {
+        out << error << "\n";
+        return false;
+    }
+    if (!makeDirectory(outDirectory)) {   // One clear error instead of a write failure per recording
+        out << "Cannot create output directory " << outDirectory << "\n";
+        return false;
+    }
+    WorkStealingPool& pool = sharedPool();
+    jobs = std::max(1, std::min(jobs > 0 ? jobs : pool.size(), static_cast<int>(inputs.size())));
+    std::vector<std::string> errors(inputs.size());
+    std::vector<double> seconds(inputs.size(), 0.0);
+    std::atomic<size_t> nextInput{0};
+    auto start = std::chrono::steady_clock::now();
+    {
+        TaskGroup group(pool);
+        for (int j = 0; j < jobs; j++) {
+            group.run([&] {
+                for (size_t i; (i = nextInput.fetch_add(1, std::memory_order_relaxed)) < inputs.size();) {
+                    std::string name = inputs[i].substr(inputs[i].find_last_of("/\\") + 1);
+                    if (name.size() > 5 && name.compare(name.size() - 5, 5, ".snap") == 0) name.resize(name.size() - 5);
+                    renderRecording(inputs[i], outDirectory + "/" + name + ".wav", seconds[i], errors[i]);
+                }
+            });
+        }
+        group.wait();
+    }
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    int failed = 0;
+    double audioSeconds = 0.0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        audioSeconds += seconds[i];
+        if (errors[i].empty()) continue;
+        out << "FAIL " << inputs[i] << ": " << errors[i] << "\n";
+        failed++;
+    }
+    char line[200];
+    std::snprintf(line, sizeof(line), "Rendered %d of %zu recordings (%.1f s of audio) in %.2f s with %d jobs: %.1fx realtime, %.1f files/s\n",
+                  static_cast<int>(inputs.size()) - failed, inputs.size(), audioSeconds, wallSeconds, jobs,
+                  wallSeconds > 0.0 ? audioSeconds / wallSeconds : 0.0, wallSeconds > 0.0 ? inputs.size() / wallSeconds : 0.0);
+    out << line;
+    return failed == 0;
+}
+
+// Function to print recording statistics (--analyze)
+void printStats(const RecordingStats& stats, std::ostream& out) {
+    char line[160];
+    std::snprintf(line, sizeof(line), "Recordings: %llu, notes: %llu, mean velocity %.1f\n", stats.recordings, stats.notes, stats.meanVelocity());
+    out << line;
+    out << "Pitch classes:";
+    for (int i = 0; i < PITCH_CLASSES; i++) {
+        std::snprintf(line, sizeof(line), " %s %.1f%%", NOTE_NAMES[i], stats.notes ? 100.0 * stats.pitchClass[i] / stats.notes : 0.0);
+        out << line;
+    }
+    unsigned long long intervals = 0;
+    for (int i = 0; i < INTERVAL_BUCKETS; i++) intervals += stats.interval[i];
+    out << "\nIntervals (semitones):";
+    for (int i = 0; i < INTERVAL_BUCKETS; i++) {
+        if (stats.interval[i] == 0) continue;
+        std::snprintf(line, sizeof(line), " %d%s %.1f%%", i, i == INTERVAL_BUCKETS - 1 ? "+" : "", 100.0 * stats.interval[i] / intervals);
+        out << line;
+    }
+    std::snprintf(line, sizeof(line), "\nDensity: %.2f notes/s (busiest second: %d notes)\n", stats.notesPerSecond(), stats.busiestSecond);
+    out << line;
+    double bpm = stats.tempoBpm();
+    if (bpm > 0.0) std::snprintf(line, sizeof(line), "Tempo estimate: %.0f BPM\n", bpm);
+    else std::snprintf(line, sizeof(line), "Tempo estimate: not enough notes\n");
+    out << line;
+}
+
+// Function to collect statistics over a library of recordings (--analyze <dir or list>)
+// Each pool job keeps one running total and maps one recording at a time, so memory does not
+// depend on the size of the library; the totals are merged at the end.
+bool runAnalyze(const std::string& source, std::ostream& out) {
+    std::vector<std::string> inputs;
+    std::string error;
+    if (!collectRecordings(source, inputs, error)) {
+        out << error << "\n";
+        return false;
+    }
+    WorkStealingPool& pool = sharedPool();
+    int jobs = std::max(1, std::min(pool.size(), static_cast<int>(inputs.size())));
+    std::vector<RecordingStats> totals(jobs);
+    std::vector<std::string> errors(inputs.size());
+    std::atomic<size_t> nextInput{0};
+    std::atomic<unsigned long long> entries{0};
+    auto start = std::chrono::steady_clock::now();
+    {
+        TaskGroup group(pool);
+        for (int j = 0; j < jobs; j++) {
+            group.run([&, j] {
+                for (size_t i; (i = nextInput.fetch_add(1, std::memory_order_relaxed)) < inputs.size();) {
+                    SessionFile file;
+                    if (!file.open(inputs[i], errors[i])) {
+                        if (errors[i].empty()) errors[i] = inputs[i] + " not found";
+                        continue;
+                    }
+                    RecordingAnalyzer analyzer;
+                    analyzer.addPacked(file.notes(), file.noteCount());
+                    totals[j].merge(analyzer.result());
+                    entries.fetch_add(file.noteCount(), std::memory_order_relaxed);
+                }
+            });
+        }
+        group.wait();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    RecordingStats library;
+    for (const auto& total : totals) library.merge(total);
+    int failed = 0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (errors[i].empty()) continue;
+        out << "FAIL " << inputs[i] << ": " << errors[i] << "\n";
+        failed++;
+    }
+    printStats(library, out);
+    char line[160];
+    std::snprintf(line, sizeof(line), "Scanned %llu entries in %.1f ms (%.1f M entries/s, %.1f files/s)\n", entries.load(), seconds * 1000.0,
+                  seconds > 0.0 ? entries.load() / seconds / 1e6 : 0.0, seconds > 0.0 ? inputs.size() / seconds : 0.0);
+    out << line;
+    return failed == 0;
+}
+
+// JSON line builder (one structured log record or control reply)
+class JsonLine {
+private:
+    std::string body;
+
+    void key(const char* name) {
+        if (!body.empty()) body += ',';
+        body += '"';
+        body += name;
+        body += "\":";
+    }
+
+public:
+    JsonLine& text(const char* name, const std::string& value) {
+        key(name);
+        body += '"';
+        for (char c : value) {
+            if (c == '"' || c == '\\') body += '\\';
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                body += escaped;
+            } else {
+                body += c;
+            }
+        }
+        body += '"';
+        return *this;
+    }
+    JsonLine& integer(const char* name, long long value) {
+        key(name);
+        body += std::to_string(value);
+        return *this;
+    }
+    JsonLine& number(const char* name, double value) {
+        key(name);
+        char formatted[32];
+        std::snprintf(formatted, sizeof(formatted), "%.6g", std::isfinite(value) ? value : 0.0);
+        body += formatted;
+        return *this;
+    }
+    JsonLine& counts(const char* name, const unsigned long long* values, int count) {
+        key(name);
+        body += '[';
+        for (int i = 0; i < count; i++) {
+            if (i > 0) body += ',';
+            body += std::to_string(values[i]);
+        }
+        body += ']';
+        return *this;
+    }
+    JsonLine& flag(const char* name, bool value) {
+        key(name);
+        body += value ? "true" : "false";
+        return *this;
+    }
+    std::string done() const { return "{" + body + "}"; }
 };
 
-// Recording structure definition
-struct Recording {
-    std::string name;       // String to store the name of the recording
-    std::vector<Note> notes; // Vector (dynamic list) to store the sequence of Note objects
+// Structured log class (one JSON object per line; the only output in headless mode)
+class StructuredLog {
+private:
+    std::ostream& out;
+    std::mutex lock;                      // Written from the piano thread and background loaders
+
+public:
+    explicit StructuredLog(std::ostream& stream) : out(stream) {}
+
+    // Function to start a record: every record has a timestamp and an event name
+    JsonLine event(const char* name) {
+        return JsonLine().integer("ts", systemMillis()).text("event", name);
+    }
+
+    void write(const JsonLine& line) {
+        std::string text = line.done();
+        std::lock_guard<std::mutex> guard(lock);
+        out << text << '\n' << std::flush;  // One line per record, so a collector never sees half of one
+    }
+};
+
+// Startup timeline class (when each startup step ran, printed with --verbose)
+// Steps on the main thread are marked as they finish; background steps record their own span.
+class StartupTimeline {
+private:
+    struct Step {
+        std::string name;
+        double startMs, endMs;
+        bool background;
+    };
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    double lastMs = 0.0;                  // End of the previous main-thread step
+    std::vector<Step> steps;
+    std::mutex lock;                      // Background loaders add steps from their own threads
+
+public:
+    // Function to read the time since the process started its startup
+    double elapsedMs() const {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    // Function to record that a main-thread step just finished
+    void mark(const std::string& name) {
+        double now = elapsedMs();
+        std::lock_guard<std::mutex> guard(lock);
+        steps.push_back({name, lastMs, now, false});
+        lastMs = now;
+    }
+
+    // Function to record a step that ran on another thread
+    void record(const std::string& name, double startMs, double endMs) {
+        std::lock_guard<std::mutex> guard(lock);
+        steps.push_back({name, startMs, endMs, true});
+    }
+
+    void print(std::ostream& out) {
+        std::lock_guard<std::mutex> guard(lock);
+        out << "Startup timeline (ms)\n";
+        for (const auto& s : steps) {
+            char line[128];
+            std::snprintf(line, sizeof(line), "  %8.2f %8.2f  %6.2f  %s%s\n", s.startMs, s.endMs, s.endMs - s.startMs,
+                          s.name.c_str(), s.background ? " (background)" : "");
+            out << line;
+        }
+    }
+
+    // Function to write the timeline as log records (headless mode)
+    void log(StructuredLog& out) {
+        std::lock_guard<std::mutex> guard(lock);
+        for (const auto& s : steps) {
+            out.write(out.event("startup_step").text("step", s.name).number("start_ms", s.startMs)
+                         .number("end_ms", s.endMs).flag("background", s.background));
+        }
+    }
+};
+
+// Background load class (a startup step running on its own thread, picked up when it is done)
+template <typename T>
+class BackgroundLoad {
+private:
+    std::future<T> result;
+
+public:
+    // Function to start the step; its span goes into the timeline
+    template <typename Work>
+    void start(StartupTimeline& timeline, const std::string& name, Work work) {
+        result = std::async(std::launch::async, [&timeline, name, work]() mutable {
+            double startMs = timeline.elapsedMs();
+            T value = work();
+            timeline.record(name, startMs, timeline.elapsedMs());
+            return value;
+        });
+    }
+
+    bool pending() const { return result.valid(); }
+    bool ready() const { return result.valid() && result.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }
+    T take() { return result.get(); }     // Waits if the step is still running
+};
+
+// Recorder class (the take being recorded: entries with times relative to its start)
+class Recorder {
+private:
+    Clock* clock;
+    std::vector<Note> entries;
+    long long startMs = 0;
+    bool active = false;
+    RecordingAnalyzer analyzer;           // Statistics of the take, kept up to date as it is played
+
+public:
+    explicit Recorder(Clock& c) : clock(&c) {}
+    void setClock(Clock& c) { clock = &c; }
+
+    // Function to start a new take (the previous one is dropped)
+    void start() {
+        entries.clear();
+        analyzer.reset();
+        startMs = clock->nowMs();
+        active = true;
+    }
+    void stop() { active = false; }
+    bool recording() const { return active; }
+
+    // Function to get the time since the take started
+    long long elapsedMs() const { return clock->nowMs() - startMs; }
+
+    // Function to turn a time read earlier from the same clock (e.g. a MIDI timestamp) into take time
+    long long offsetOf(long long timeMs) const { return timeMs - startMs; }
+
+    // Function to add an entry to the take (ignored when not recording)
+    bool add(const Note& note) {
+        if (!active) return false;
+        entries.push_back(note);
+        analyzer.add(note.timestamp, note.kind, note.key, note.velocity);
+        return true;
+    }
+
+    // Function to recount the statistics after the take was replaced (e.g. restored from a session)
+    void reanalyze() {
+        analyzer.reset();
+        for (const auto& note : entries) analyzer.add(note.timestamp, note.kind, note.key, note.velocity);
+    }
+
+    RecordingStats stats() const { return analyzer.result(); }
+    std::vector<Note>& notes() { return entries; }
+    const std::vector<Note>& notes() const { return entries; }
+};
+
+// Playback scheduler class (plays recorded entries at their timestamps)
+// Waits are measured from the start of playback, not from the previous entry, so the time
+// spent playing each entry never adds up into drift.
+class PlaybackScheduler {
+private:
+    Clock& clock;
+
+public:
+    explicit PlaybackScheduler(Clock& c) : clock(c) {}
+
+    // Function to play entries in order, calling play(entry) when each one is due
+    template <typename Play>
+    void run(const std::vector<Note>& entries, Play play) {
+        long long startMs = clock.nowMs();
+        for (const auto& note : entries) {
+            long long delay = startMs + note.timestamp - clock.nowMs();
+            if (delay > 0) clock.sleepMs(delay);
+            play(note);
+        }
+    }
+};
+
+
+// Function to check recorder, playback and engine timing against a virtual clock (--self-test-clock)
+// Plays an hour of simulated notes and pedal moves; every timestamp is known in advance, so any
+// difference is a bug, not jitter. Returns true if everything matched.
+bool runClockSelfTest(std::ostream& out) {
+    auto begin = std::chrono::steady_clock::now();
+    const long long HOUR_MS = 3600LL * 1000;
+    VirtualClock clock(1700000000000LL);  // Any fixed start works
+    bool ok = true;
+
+    // Recording: entries spaced by a fixed irregular pattern, stamped by the recorder
+    Recorder recorder(clock);
+    recorder.start();
+    std::vector<long long> expected;
+    long long at = 0;
+    for (int i = 0; at < HOUR_MS; i++) {
+        long long gap = 40 + (i * 37) % 450;  // 40..489 ms
+        clock.sleepMs(gap);
+        at += gap;
+        Note n;
+        n.kind = i % 16 == 15 ? NoteKind::Sustain : NoteKind::Note;
+        n.key = static_cast<unsigned char>(36 + i % 48);
+        n.timestamp = recorder.elapsedMs();
+        n.pedalDown = i % 32 == 15;
+        recorder.add(n);
+        expected.push_back(at);
+    }
+    recorder.stop();
+    size_t wrongStamps = 0;
+    for (size_t i = 0; i < expected.size(); i++) wrongStamps += recorder.notes()[i].timestamp != expected[i] ? 1 : 0;
+    out << "  recording: " << recorder.notes().size() << " entries over " << at / 1000 << " s, "
+        << wrongStamps << " wrong timestamps\n";
+    ok = ok && wrongStamps == 0;
+
+    // Playback: each entry takes 1 ms to play, which must not accumulate into drift
+    long long playStart = clock.nowMs();
+    size_t late = 0;
+    long long worstMs = 0;
+    PlaybackScheduler(clock).run(recorder.notes(), [&](const Note& note) {
+        long long offBy = clock.nowMs() - playStart - note.timestamp;
+        if (offBy != 0) late++;
+        worstMs = std::max(worstMs, std::abs(offBy));
+        clock.sleepMs(1);
+    });
+    out << "  playback: " << late << " entries off schedule (worst " << worstMs << " ms), took "
+        << (clock.nowMs() - playStart) / 1000.0 << " simulated s\n";
+    ok = ok && late == 0;
+
+    // Engine: MIDI latency is measured on the engine's clock
+    PianoMetrics metrics;
+    AudioEngine engine(metrics);
+    engine.setClock(clock);
+    std::vector<float> block(256);
+    EngineEvent e = {};
+    e.type = EngineEventType::NoteOn;
+    e.key = 60;
+    e.frequency = MIDI_FREQUENCIES[60];
+    e.instrument = Instrument::Sine;
+    e.gain = 1.0f;
+    e.velocity = 100;
+    e.timestampNs = clock.nowNs();
+    engine.postMidi(e);
+    clock.sleepMs(3);                     // The audio thread picks the event up 3 ms later
+    engine.render(block.data(), static_cast<int>(block.size()));
+    unsigned long long latencyNs = metrics.midiLatencySeconds.sumNanos.load();
+    out << "  engine: MIDI latency " << latencyNs / 1e6 << " ms (expected 3 ms)\n";
+    ok = ok && latencyNs == 3000000ULL;
+
+    double realMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    out << "Clock self-test " << (ok ? "passed" : "FAILED") << " in " << realMs << " ms of real time\n";
+    return ok;
+}
+// Control request structure definition (one command line from a control client)
+struct ControlRequest {
+    std::string line;                     // The command as typed, without the newline
+    std::promise<std::string> reply;      // Answer (one JSON line) set by the piano thread
+};
+
+// Control server class (line-based TCP control API on 127.0.0.1; the only input in headless mode)
+// The socket thread only splits lines; every command runs on the piano thread, which owns all
+// piano state, so commands never race each other or the keyboard side.
+// Protocol: one command per line, one JSON object per reply line (see ConsolePiano::execute).
+class ControlServer {
+private:
+    SOCKET listener = INVALID_SOCKET;
+    std::atomic<SOCKET> client{INVALID_SOCKET}; // Connection being served (closed by stop())
+    std::thread worker;
+    std::atomic<bool> running{false};
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<ControlRequest*> queue;    // Commands waiting for the piano thread
+    std::mutex replying;                  // Held while a command is out; stop() waits for its reply to be sent
+
+    // Function to hand one command to the piano thread and wait for its answer
+    std::string forward(const std::string& line) {
+        ControlRequest* request = new ControlRequest();
+        request->line = line;
+        std::future<std::string> answer = request->reply.get_future();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!running) {               // stop() already answered the queue: nobody would take it
+                delete request;
+                return JsonLine().flag("ok", false).text("error", "shutting down").done();
+            }
+            queue.push_back(request);
+        }
+        wake.notify_one();
+        return answer.get();
+    }
+
+    // Function to serve one connection until the client hangs up
+    void serve(SOCKET connection) {
+        std::string pending;
+        char buffer[1024];
+        while (running) {
+            int got = recv(connection, buffer, sizeof(buffer), 0);
+            if (got <= 0) return;
+            pending.append(buffer, got);
+            size_t end;
+            while ((end = pending.find('\n')) != std::string::npos) {
+                std::string line = pending.substr(0, end);
+                pending.erase(0, end + 1);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                if (line.empty()) continue;
+                std::lock_guard<std::mutex> busy(replying);
+                std::string reply = forward(line) + "\n";
+                send(connection, reply.data(), static_cast<int>(reply.size()), MSG_NOSIGNAL);
+            }
+        }
+    }
+
+    void acceptLoop() {
+        while (running) {
+            SOCKET connection = accept(listener, nullptr, nullptr);
+            if (connection == INVALID_SOCKET) break; // Listener closed by stop()
+            client = connection;
+            serve(connection);
+            if (client.exchange(INVALID_SOCKET) != INVALID_SOCKET) closeSocket(connection);
+        }
+    }
+
+public:
+    ~ControlServer() { stop(); }
+
+    // Function to start listening on 127.0.0.1:port, returns false if the port is unavailable
+    bool start(int port) {
+        if (!socketsStartup()) return false;
+        listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listener == INVALID_SOCKET) return false;
+#ifndef _WIN32
+        int reuse = 1;                    // A restarted service gets its port back while old connections linger
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#endif
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<u_short>(port));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Local control only
+        if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listener, 4) != 0) {
+            closeSocket(listener);
+            listener = INVALID_SOCKET;
+            return false;
+        }
+        running = true;
+        worker = std::thread(&ControlServer::acceptLoop, this);
+        return true;
+    }
+
+    // Function to wait for the next command (piano thread), nullptr if none came within timeoutMs
+    ControlRequest* next(int timeoutMs) {
+        std::unique_lock<std::mutex> guard(lock);
+        if (!wake.wait_for(guard, std::chrono::milliseconds(timeoutMs), [this] { return !queue.empty(); })) return nullptr;
+        ControlRequest* request = queue.front();
+        queue.pop_front();
+        return request;
+    }
+
+    // Function to stop serving (after the piano thread stopped taking commands)
+    // Queued commands are answered with an error; a reply already given is still sent.
+    void stop() {
+        if (listener == INVALID_SOCKET) return;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            running = false;
+            for (ControlRequest* request : queue) {
+                request->reply.set_value(JsonLine().flag("ok", false).text("error", "shutting down").done());
+                delete request;
+            }
+            queue.clear();
+        }
+        closeSocket(listener);
+        listener = INVALID_SOCKET;
+        {
+            std::lock_guard<std::mutex> busy(replying);
+            SOCKET connection = client.exchange(INVALID_SOCKET);
+            if (connection != INVALID_SOCKET) closeSocket(connection);
+        }
+        if (worker.joinable()) worker.join();
+        socketsCleanup();
+    }
 };
 
 // piano class
 class ConsolePiano {        // Define the main class for the Piano logic
 private:                    // Private access modifier
-    std::map<char, std::pair<std::string, double>> keyMap; // Map linking a keyboard 'char' to a pair: Note name and frequency
-    std::vector<Note> currentRecording; // Vector to store notes currently being recorded
-    bool isRecording;       // flag to track if we are currently recording 
-    long long recordingStartTime; // Variable to store the exact system time when recording started
+    std::vector<KeyLayout> layouts; // Available key layouts (built-in ones plus any loaded from file)
+    size_t activeLayout;    // Index of the layout in use
+    std::vector<KeyZone> zones; // Keyboard zones and layers from the config file
+    FanoutTable fanout;     // Active layout + zones resolved per key (rebuilt when the layout changes)
+    Clock* clock = &systemClock(); // Time source for timestamps, velocity timing and playback
+    Recorder recorder{systemClock()}; // Take being recorded (entries stamped from the clock)
     int octave;             // Integer to store the current octave shift (default is 4 cuz its base octave)
+    AudioEngine* engine;    // Software synth (nullptr if no sound device could be opened)
+    PianoMetrics& metrics;  // Counters for notes played and recording size
+    KeyTimingVelocity keyVelocity; // Estimates strike strength from key-down timing
+    VelocityCurveKind velocityCurve = VelocityCurveKind::Linear; // Touch response selected by the user
+    int lastVelocity = 0;   // Velocity of the last note (shown on the status line)
+    bool sustainDown = false;   // Sustain pedal (toggled with Space, the console has no key-up)
+    bool sostenutoDown = false; // Sostenuto pedal (toggled with Enter)
+    MidiDispatcher* midi;   // MIDI keyboard events to show and record (nullptr without MIDI input)
+    std::string midiName;   // Description of the MIDI port for the interface
+    Instrument midiInstrument; // Timbre MIDI notes are played with (recorded with the note)
+    MidiOutput* midiOut = nullptr; // External synth that plays recordings (nullptr = built-in sound)
+    TransportSync* transport = nullptr; // External transport playback follows (nullptr = own timing)
+    TuningSet& tunings;     // Tuning systems (Shift+T switches)
+    ConfigWatcher* configWatcher = nullptr; // Source of reloaded configs (nullptr = no hot reload)
+    std::string sessionPath;  // Session file written on quit and after each recording (empty = none)
+    AudioEngine* sessionEngine = nullptr; // Sound settings saved with the session
+    std::string startupReport; // Startup time shown on the main screen
+    BackgroundLoad<std::vector<Note>>* restoring = nullptr; // Session recording still being read (nullptr = none)
+    BackgroundLoad<bool>* audioOpening = nullptr; // Sound device still being opened (nullptr = none)
+    StructuredLog* log = nullptr; // Headless: records instead of screen output (nullptr = console)
+
+    // Function to make a note audible without blocking (falls back to Beep without a sound device)
+    // gateMs is the time until the automatic note-off (0 = a NoteOff follows later)
+    void soundNote(int key, double frequency, int gateMs, Instrument instrument, float gain, unsigned char velocity) {
+        if (engine) engine->noteOn(key, frequency, gateMs, instrument, gain, velocity);
+        else beep(frequency, gateMs > 0 ? gateMs : BASE_DURATION);
+    }
+
+    // Function to send a pedal change to the engine
+    void soundPedal(NoteKind pedal, bool down) {
+        if (!engine) return;              // Beep() cannot sustain anything
+        if (pedal == NoteKind::Sustain) engine->sustain(down);
+        else engine->sostenuto(down);
+    }
 
 public:                     // Public access modifier (functions accessible from main)
-    ConsolePiano() : isRecording(false), octave(4), recordingStartTime(0) { // Constructor initializes variables (recording off, octave 4)
-        // Initialize Key Mappings (Keyboard key -> {Note Name, Frequency})
-        // Mapping 'z' key to C note (261.63 Hz)
-        keyMap['z'] = {"C",  261.63};
-        // Mapping 's' key to C# note
-        keyMap['s'] = {"C#", 277.18};
-        // Mapping 'x' key to D note
-        keyMap['x'] = {"D",  293.66};
-        // Mapping 'd' key to D# note
-        keyMap['d'] = {"D#", 311.13};
-        // Mapping 'c' key to E note
-        keyMap['c'] = {"E",  329.63};
-        // Mapping 'v' key to F note
-        keyMap['v'] = {"F",  349.23};
-        // Mapping 'g' key to F# note
-        keyMap['g'] = {"F#", 369.99};
-        // Mapping 'b' key to G note
-        keyMap['b'] = {"G",  392.00};
-        // Mapping 'h' key to G# note
-        keyMap['h'] = {"G#", 415.30};
-        // Mapping 'n' key to A note
-        keyMap['n'] = {"A",  440.00};
-        // Mapping 'j' key to A# note
-        keyMap['j'] = {"A#", 466.16};
-        // Mapping 'm' key to B note
-        keyMap['m'] = {"B",  493.88};
+    ConsolePiano(AudioEngine* audio, PianoMetrics& m, const PianoConfig& config, TuningSet& tuning, size_t startLayout,
+                 MidiDispatcher* midiInput = nullptr, const std::string& midiPort = "")
+        : layouts(config.layouts), activeLayout(startLayout), zones(config.zones), octave(4), engine(audio), metrics(m),
+          midi(midiInput), midiName(midiPort), midiInstrument(config.midiInstrument), tunings(tuning) { // Constructor initializes variables (recording off, octave 4)
+        if (layouts.empty()) layouts = builtInLayouts(); // Always have something to play with
+        if (activeLayout >= layouts.size()) activeLayout = 0;
+        fanout = compileZones(layouts[activeLayout], zones);
     }
 
     // Function to draw the interface in the console
     void drawInterface() {
-        system("cls"); // command to clear the console screen
+        if (log) return; // Headless: there is no screen
+        clearScreen(); // clear the console screen
         std::cout << "==================================================\n"; 
         std::cout << "   C++ CONSOLE PIANO (ENGINEERING PROJECT)   \n";      
         std::cout << "==================================================\n"; 
         std::cout << " Controls:                                        \n"; 
-        std::cout << "  [Keys z-m]: Play Notes                          \n"; 
+        std::cout << "  [Note keys]: Play Notes (see layout below)      \n";
+        std::cout << "  [Tab]: Next Key Layout                          \n";
         std::cout << "  [R]: Start/Stop Recording                       \n"; 
         std::cout << "  [P]: Play Last Recording                        \n"; 
-        std::cout << "  [+/-]: Change Octave (Current: " << octave << ")\n"; 
+        std::cout << "  [+/-]: Change Octave                            \n";
+        std::cout << "  [Shift+V]: Change Velocity Curve                \n";
+        std::cout << "  [Shift+T]: Change Tuning                        \n";
+        std::cout << "  [Space]: Sustain Pedal  [Enter]: Sostenuto Pedal\n";
+        if (midi) std::cout << "  MIDI input: " << midiName << "\n";
         std::cout << "  [Q]: Quit                                       \n"; 
         std::cout << "==================================================\n"; 
+        if (!startupReport.empty()) std::cout << "  " << startupReport << "\n";
         
-        // Draw visual Keyboard representation
-        std::cout << "\n";                                               
-        std::cout << "   | |S| |D| | |G| |H| |J| | |\n";                 
-        std::cout << "   | | | | | | | | | | | | | |\n";                 
-        std::cout << "   |_| |_| |_| |_| |_| |_| |_|\n";                 
-        std::cout << "    Z   X   C   V   B   N   M \n";                 
-        std::cout << "\n";                                               
+        // Draw the keys of the active layout, one line per octave
+        const KeyLayout& layout = layouts[activeLayout];
+        std::cout << "\n";
+        std::cout << "  Layout: " << layout.name << "\n";
+        for (int row = 0; row * 12 < MAX_LAYOUT_SEMITONES; row++) {
+            std::string line;
+            for (int semitone = row * 12; semitone < row * 12 + 12; semitone++) {
+                for (int c = 0; c < 256; c++) {
+                    if (layout.table[c] != semitone) continue;
+                    line += "  ";
+                    line += static_cast<char>(c);
+                    line += "=";
+                    line += NOTE_NAMES[semitone % 12];
+                }
+            }
+            if (!line.empty()) std::cout << "   +" << row << ":" << line << "\n";
+        }
+        for (const auto& zone : zones) {           // List the zones that apply to this layout
+            if (!zone.layout.empty() && zone.layout != layout.name) continue;
+            std::cout << "  Zone " << zone.name << ": keys " << zone.lowSemitone << "-" << zone.highSemitone
+                      << ", octave " << (zone.octaveShift >= 0 ? "+" : "") << zone.octaveShift
+                      << ", " << INSTRUMENT_NAMES[static_cast<int>(zone.instrument)] << "\n";
+        }
+        std::cout << "\n";
         
         // Check if recording is active to show status
-        if (isRecording) {
+        if (restoring) {
+            std::cout << "  [ Restoring recording...] \n";               // Session recording still loading
+        } else if (recorder.recording()) {
             std::cout << "  [ RECORDING IN PROGRESS...] \n";             // Print red recording indicator
-        } else if (!currentRecording.empty()) {                           // Else if we have saved notes
-            std::cout << "  [ Recording Saved: " << currentRecording.size() << " notes] \n"; // Show count of saved notes
+        } else if (!recorder.notes().empty()) {                           // Else if we have saved notes
+            std::cout << "  [ Recording Saved: " << recorder.notes().size() << " notes] \n"; // Show count of saved notes
+            RecordingStats stats = recorder.stats();
+            if (stats.notes > 0) {
+                std::cout << "  " << stats.notes << " notes, " << static_cast<int>(stats.notesPerSecond() * 10.0 + 0.5) / 10.0
+                          << " notes/s, mostly " << NOTE_NAMES[stats.topPitchClass()];
+                if (stats.tempoBpm() > 0.0) std::cout << ", about " << static_cast<int>(stats.tempoBpm() + 0.5) << " BPM";
+                std::cout << "\n";
+            }
         }
+        drawStatusLine();
+    }
+
+    // Function to redraw only the status line (cheap, no screen clear)
+    void drawStatusLine() {
+        if (log) return;
+        std::cout << "\r  Octave: " << octave << "  Velocity: " << lastVelocity
+                  << " (" << VELOCITY_CURVE_NAMES[static_cast<int>(velocityCurve)] << ")"
+                  << "  Tuning: " << tunings.current().name
+                  << (sustainDown ? "  SUSTAIN" : "") << (sostenutoDown ? "  SOSTENUTO" : "") << "                    \r";
     }
 
-    // Function to calculate Frequency based on octave shift
-    // baseFreq (standard frequency at octave 4)
-    double getFrequency(double baseFreq) {
-        // base * 2^(octave - 4)
-        // pow from math
-        return baseFreq * std::pow(2.0, octave - 4);
+    // Function to get the frequency of a MIDI note in the active tuning (0 = not mapped)
+    // One table load: the tuning file was compiled into the table when it was loaded
+    double getFrequency(int midiKey) {
+        return tunings.current().hz[midiKey & 127];
     }
 
     // Function to play a single note based on key input
     void playTone(char key) {
-        // Check if the pressed key exists in our map
-        if (keyMap.find(key) != keyMap.end()) {
-            std::string noteName = keyMap[key].first; // Get the note name (e.g., "C")
-            double baseFreq = keyMap[key].second;     // Get the base frequency
-            double finalFreq = getFrequency(baseFreq); // Calculate actual frequency for current octave
+        // Look the key up in the precomputed fan-out table (layout and zones already resolved)
+        const KeyFanout& f = fanout[static_cast<unsigned char>(key)];
+        if (f.count == 0) return;
+        long long timeNow = clock->nowMs(); // Get current time in milliseconds
+        // Estimate how hard the key was struck, then apply the selected touch curve (two table loads)
+        unsigned char velocity = VELOCITY_CURVES.apply(velocityCurve, keyVelocity.onKeyDown(timeNow));
+        lastVelocity = velocity;
+        for (int layer = 0; layer < f.count; layer++) {
+            const ZoneTarget& t = f.targets[layer];
+            int midiKey = std::max(0, std::min(127, 12 * (octave + 1) + t.semitone)); // MIDI number (C4 = 60)
+            double finalFreq = strike(midiKey, velocity, t.instrument, t.gain, timeNow);
+            if (finalFreq <= 0.0) continue;  // The keyboard map leaves this key silent
+
+            // Visual feedback: Print playing note info (first layer only, keeps the line readable)
+            if (layer == 0 && !log) {
+                std::string noteName = NOTE_NAMES[(t.semitone % 12 + 12) % 12]; // Get the note name (e.g., "C")
+                int noteOctave = octave + (t.semitone >= 0 ? t.semitone / 12 : (t.semitone - 11) / 12);
+                std::cout << " -> Playing: " << noteName << noteOctave << " (" << finalFreq << "Hz, velocity " << static_cast<int>(velocity) << ")   \r";
+            }
+        }
+    }
+
+    // Function to sound one MIDI key and add it to the take, returns its frequency (0 = not mapped)
+    // Shared by the keyboard and the control API so both record exactly the same entries.
+    double strike(int midiKey, unsigned char velocity, Instrument instrument, float gain, long long timeNow) {
+        double finalFreq = getFrequency(midiKey); // Frequency in the active tuning
+        if (finalFreq <= 0.0) return 0.0;
+
+        // Check if we are currently recording
+        if (recorder.recording()) {
+            Note n;                         // Create a new Note object
+            n.name = NOTE_NAMES[midiKey % 12]; // Set note name
+            n.frequency = finalFreq;        // Set note frequency
+            n.timestamp = recorder.offsetOf(timeNow); // Calculate relative time since recording started
+            n.instrument = static_cast<unsigned char>(instrument); // Remember the zone's timbre
+            n.gain = gain;
+            n.velocity = velocity;          // Keep the dynamics for playback
+            n.key = static_cast<unsigned char>(midiKey);
+            n.duration = BASE_DURATION;     // Console notes release on their own
+            recorder.add(n);                // Add note to the recording
+            metrics.recordingBytes.add(sizeof(Note) + n.name.size()); // Track recording growth
+        }
+
+        // Generate sound (the engine mixes it on the audio thread, so fast playing can overlap)
+        soundNote(midiKey, finalFreq, BASE_DURATION, instrument, gain, velocity);
+        metrics.notesPlayed.add();
+        if (log) log->write(log->event("note").integer("key", midiKey).number("hz", finalFreq).integer("velocity", velocity)
+                                .text("instrument", INSTRUMENT_NAMES[static_cast<int>(instrument)]));
+        return finalFreq;
+    }
+
+    // Function to press or release a pedal (Space = sustain, Enter = sostenuto)
+    void togglePedal(NoteKind pedal) {
+        bool& down = pedal == NoteKind::Sustain ? sustainDown : sostenutoDown;
+        down = !down;
+        soundPedal(pedal, down);
+        if (recorder.recording()) {         // Pedal moves are part of the performance
+            Note n;
+            n.kind = pedal;
+            n.name = pedal == NoteKind::Sustain ? "Ped" : "Sost";
+            n.frequency = 0.0;
+            n.timestamp = recorder.elapsedMs();
+            n.pedalDown = down;
+            recorder.add(n);
+            metrics.recordingBytes.add(sizeof(Note) + n.name.size());
+        }
+        drawStatusLine();
+    }
+
+    // Function to change where time comes from (tests use a VirtualClock)
+    void setClock(Clock& c) {
+        clock = &c;
+        recorder.setClock(c);
+    }
+
+    // Function to send recordings to an external synth instead of the built-in sound
+    void setMidiOutput(MidiOutput* output) { midiOut = output; }
+
+    // Function to make playback follow an external transport (e.g. JACK)
+    void setTransport(TransportSync* sync) { transport = sync; }
+
+    // Function to keep the playing state in a session file across restarts
+    void setSessionFile(const std::string& path, AudioEngine& sound) {
+        sessionPath = path;
+        sessionEngine = &sound;
+    }
+
+    // Function to show how long startup took on the main screen
+    void setStartupReport(const std::string& report) { startupReport = report; }
 
-            // Visual feedback: Print playing note info
-            std::cout << " -> Playing: " << noteName << octave << " (" << finalFreq << "Hz)\r";
+    // Function to run without a terminal: no drawing, every message becomes a log record
+    void setLog(StructuredLog* structured) { log = structured; }
 
-            // Check if we are currently recording
-            if (isRecording) {
-                // Get current system time
-                auto now = std::chrono::system_clock::now().time_since_epoch();
-                // Convert time to milliseconds
-                long long timeNow = std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
-                
-                Note n;                         // Create a new Note object
-                n.name = noteName;              // Set note name
-                n.frequency = finalFreq;        // Set note frequency
-                n.timestamp = timeNow - recordingStartTime; // Calculate relative time since recording started
-                currentRecording.push_back(n);  // Add note to the recording vector
+    // Function to hand over startup steps that finish after the interface is up
+    void setBackgroundLoads(BackgroundLoad<std::vector<Note>>* recording, BackgroundLoad<bool>* audio) {
+        restoring = recording && recording->pending() ? recording : nullptr;
+        audioOpening = audio && audio->pending() ? audio : nullptr;
+    }
+
+    // Function to pick up background startup steps that finished (wait = block for the recording)
+    void adoptBackground(bool wait) {
+        if (restoring && (wait || restoring->ready())) {
+            std::vector<Note> restored = restoring->take();
+            restoring = nullptr;
+            if (recorder.notes().empty()) {
+                recorder.notes() = std::move(restored);
+                recorder.reanalyze();
+            }
+            if (log) log->write(log->event("session_recording").integer("entries", static_cast<long long>(recorder.notes().size())));
+            if (!wait) drawInterface();   // Show the restored take
+        }
+        if (audioOpening && audioOpening->ready()) {
+            bool opened = audioOpening->take();
+            audioOpening = nullptr;
+            if (!opened) {
+                engine = nullptr;         // Nothing would ever render the engine: beep instead
+                if (log) log->write(log->event("audio_failed").text("fallback", "beep"));
+                else std::cout << "\n  No sound device, using beeps\n";
+            }
+        }
+    }
+
+    // Function to continue where the last session stopped (layout and tuning are picked in main)
+    void restoreSession(SessionSnapshot& session) {
+        octave = session.octave;
+        velocityCurve = session.velocityCurve;
+        recorder.notes() = std::move(session.recording);
+        recorder.reanalyze();
+    }
+
+    // Function to write the playing state to the session file
+    void saveSession() {
+        if (sessionPath.empty()) return;
+        adoptBackground(true);            // Never overwrite a session that is still being read
+        SessionSnapshot session;
+        session.octave = octave;
+        session.velocityCurve = velocityCurve;
+        session.layout = layouts[activeLayout].name;
+        session.tuning = tunings.current();
+        session.settings = sessionEngine->currentSettings();
+        session.recording.swap(recorder.notes()); // Lend the recording instead of copying it
+        std::string error;
+        bool saved = writeSession(sessionPath, session, error);
+        session.recording.swap(recorder.notes());
+        if (!saved && log) log->write(log->event("session_save_failed").text("path", sessionPath).text("error", error));
+        else if (!saved) std::cout << "\n  Session not saved: " << error << "\n";
+    }
+
+    // Function to pick up config files reloaded while playing
+    void setConfigWatcher(ConfigWatcher* watcher) { configWatcher = watcher; }
+
+    // Function to switch to a reloaded config (keyboard thread, between key presses)
+    // The engine already has the new settings; this swaps the keyboard-side state.
+    void applyConfig(const ReloadedConfig& reloaded) {
+        std::string layoutName = layouts[activeLayout].name;
+        layouts = reloaded.config.layouts;
+        if (layouts.empty()) layouts = builtInLayouts();
+        activeLayout = 0;
+        for (size_t i = 0; i < layouts.size(); i++) {   // Stay on the same layout if it still exists
+            if (layouts[i].name == layoutName) activeLayout = i;
+        }
+        zones = reloaded.config.zones;
+        fanout = compileZones(layouts[activeLayout], zones);
+        midiInstrument = reloaded.config.midiInstrument;
+        if (midi) midi->setInstrument(midiInstrument);
+        if (reloaded.hasTuning) tunings.select(tunings.addUnique(reloaded.tuning));
+        if (log) {
+            log->write(log->event("config_reloaded").text("layout", layouts[activeLayout].name).text("tuning", tunings.current().name));
+            return;
+        }
+        drawInterface();
+        std::cout << "\n  Config reloaded\r";
+    }
+
+    // Function to play one recorded entry (note, key release or pedal move)
+    void playEntry(const Note& note) {
+        if (note.kind == NoteKind::Note) {
+            if (!log) std::cout << note.name << " "; // Print note name
+            // Play the note
+            if (!midiOut) soundNote(note.key, note.frequency, note.duration, static_cast<Instrument>(note.instrument), note.gain, note.velocity);
+            metrics.scheduledNotes.add();
+        } else if (note.kind == NoteKind::NoteOff) {
+            if (engine && !midiOut) engine->noteOff(note.key); // Key released during the recording
+        } else {
+            if (!log) std::cout << (note.pedalDown ? "[" : "]") << note.name << " "; // Show pedal moves
+            if (!midiOut) soundPedal(note.kind, note.pedalDown);
+        }
+    }
+
+    // Function to check for a key press that ends playback (headless playback has no keyboard)
+    bool stopKeyPressed() { return !log && keyAvailable(); }
+
+    // Function to play the recording locked to the external transport
+    // Stopping the transport pauses playback, relocating it jumps; any key press ends playback.
+    void playWithTransport() {
+        transport->startFromZero();
+        const std::vector<Note>& entries = recorder.notes();
+        size_t next = 0;                    // Next entry to play
+        long long lastPosition = 0;
+        while (next < entries.size() && !stopKeyPressed()) {
+            if (!transport->rolling()) {
+                sleepMillis(5);
+                continue;
+            }
+            long long position = transport->positionMs();
+            if (position < lastPosition) {  // Relocated backwards: find the first entry after the new position
+                next = 0;
+                while (next < entries.size() && entries[next].timestamp < position) next++;
+            }
+            while (next < entries.size() && entries[next].timestamp <= position) {
+                playEntry(entries[next++]);
             }
+            lastPosition = position;
+            sleepMillis(1);
+        }
+        if (stopKeyPressed()) readKey();    // Swallow the key that stopped playback
+        transport->stop();
+    }
+
+    // Function to show and record the events a MIDI keyboard played (the engine already sounded them)
+    void drainMidi() {
+        MidiInputEvent e;
+        while (midi->poll(e)) {
+            Note n;
+            n.timestamp = recorder.offsetOf(e.timeMs); // Kernel timestamp, not the time we got around to it
+            n.key = e.key;
+            n.duration = 0;                 // The recorded NoteOff ends the note
+            n.frequency = 0.0;
+            if (e.type == EngineEventType::NoteOn) {
+                n.kind = NoteKind::Note;
+                n.name = NOTE_NAMES[e.key % 12];
+                n.frequency = getFrequency(e.key);
+                n.velocity = e.velocity;
+                n.instrument = static_cast<unsigned char>(midiInstrument);
+                lastVelocity = e.velocity;
+                metrics.notesPlayed.add();
+                if (log) log->write(log->event("midi_note").integer("key", e.key).integer("velocity", e.velocity));
+                else std::cout << " -> MIDI: " << n.name << e.key / 12 - 1 << " (velocity " << static_cast<int>(e.velocity) << ")      \r";
+            } else if (e.type == EngineEventType::NoteOff) {
+                n.kind = NoteKind::NoteOff;
+                n.name = "Off";
+            } else {
+                n.kind = e.type == EngineEventType::Sustain ? NoteKind::Sustain : NoteKind::Sostenuto;
+                n.name = n.kind == NoteKind::Sustain ? "Ped" : "Sost";
+                n.pedalDown = e.down;
+                (n.kind == NoteKind::Sustain ? sustainDown : sostenutoDown) = e.down; // Keep the status line honest
+            }
+            if (recorder.add(n)) {
+                metrics.recordingBytes.add(sizeof(Note) + n.name.size());
+            }
+        }
+    }
+
+    // Function to take a reloaded config if the watcher has one
+    void pollConfig() {
+        std::unique_ptr<ReloadedConfig> reloaded(configWatcher->take());
+        if (reloaded) applyConfig(*reloaded);
+    }
 
-            // Generate sound using Windows API
-            // Beep blocks execution for the duration
-            Beep(static_cast<DWORD>(finalFreq), BASE_DURATION);
+    // Function to wait for a key press while keeping up with the MIDI keyboard and config reloads
+    char waitForKey() {
+        if (!midi && !configWatcher && !restoring && !audioOpening) return readKey();
+        while (!keyAvailable()) {
+            if (midi) drainMidi();
+            if (configWatcher) pollConfig();
+            if (restoring || audioOpening) adoptBackground(false);
+            sleepMillis(2);                 // Display only: the sound path does not wait for this loop
         }
+        if (midi) drainMidi();
+        return readKey();
     }
 
     // Function to toggle recording state on/off
     void toggleRecording() {
-        if (!isRecording) { // If not currently recording
-            isRecording = true; // Set flag to true
-            currentRecording.clear(); // Clear previous recording data
-            // Get start time for the new recording session
-            auto now = std::chrono::system_clock::now().time_since_epoch();
-            recordingStartTime = std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+        adoptBackground(true);            // The restored take must not land on top of a new one
+        if (!recorder.recording()) { // If not currently recording
+            recorder.start(); // Drop the previous take and start the clock for the new one
+            // Pedals already down are part of the starting state
+            if (sustainDown || sostenutoDown) {
+                for (NoteKind pedal : {NoteKind::Sustain, NoteKind::Sostenuto}) {
+                    if (!(pedal == NoteKind::Sustain ? sustainDown : sostenutoDown)) continue;
+                    Note n;
+                    n.kind = pedal;
+                    n.name = pedal == NoteKind::Sustain ? "Ped" : "Sost";
+                    n.frequency = 0.0;
+                    n.timestamp = 0;
+                    n.pedalDown = true;
+                    recorder.add(n);
+                }
+            }
             drawInterface(); // Redraw UI to show "Recording" status
         } else { // If already recording
-            isRecording = false; // Set flag to false
+            recorder.stop(); // Stop adding entries
+            saveSession();   // A crash later does not lose the take
             drawInterface(); // Redraw UI to show "Saved" status
         }
     }
 
     // Function to play back the saved recording
     void playRecording() {
-        if (currentRecording.empty()) { // Check if vector is empty
+        adoptBackground(true);
+        if (recorder.notes().empty()) { // Check if the take is empty
+            if (log) return;               // The control reply says so
             std::cout << "\nNo recording found!\n"; // Print error
-            Sleep(1000); // Pause for 1 second
+            sleepMillis(1000); // Pause for 1 second
             drawInterface(); // Redraw interface
             return;
         }
 
-        std::cout << "\n\n Playing Recording...\n"; // Print status
-        long long lastTime = 0; // Variable to track time of the previous note
+        if (log) log->write(log->event("playback_start").integer("entries", static_cast<long long>(recorder.notes().size())));
+        else std::cout << "\n\n Playing Recording...\n"; // Print status
 
-        // Loop through every note in the recording vector
-        for (const auto& note : currentRecording) {
-            // Calculate delay = timestamp of current note minus timestamp of previous note
-            long long delay = note.timestamp - lastTime;
-            
-            // If there is a delay needed, sleep the thread
-            if (delay > 0) Sleep(static_cast<DWORD>(delay));
+        // With a MIDI output the whole recording is handed over now with timestamps;
+        // the loop below then only prints the note names along with it
+        if (midiOut) midiOut->start(buildMidiSchedule(recorder.notes()));
 
-            std::cout << note.name << " "; // Print note name
-            // Play the beep sound
-            Beep(static_cast<DWORD>(note.frequency), BASE_DURATION);
-            
-            // Update lastTime to current note's timestamp
-            lastTime = note.timestamp; 
-        }
+        // Play every entry at its timestamp (with a transport, timing comes from the transport instead)
+        if (transport) playWithTransport();
+        else PlaybackScheduler(*clock).run(recorder.notes(), [this](const Note& note) { playEntry(note); });
         
+        if (midiOut) {                                   // Wait for the last messages and show the timing
+            JitterReport jitter = midiOut->finish();
+            if (log) log->write(log->event("midi_out_jitter").text("port", midiOut->describe()).integer("messages", jitter.events)
+                                    .number("mean_us", jitter.meanUs).number("max_us", jitter.maxUs).number("stddev_us", jitter.stddevUs));
+            else std::cout << "\nMIDI out (" << midiOut->describe() << "): " << jitter.events << " messages, jitter mean "
+                      << jitter.meanUs << " us, max " << jitter.maxUs << " us, stddev " << jitter.stddevUs << " us";
+        }
+        soundPedal(NoteKind::Sustain, sustainDown);     // Put the pedals back where the player has them
+        soundPedal(NoteKind::Sostenuto, sostenutoDown);
+        if (log) {
+            log->write(log->event("playback_done"));
+            return;
+        }
         std::cout << "\nDone!\n"; // Print finished message
-        Sleep(1000); // Pause for 1 second
+        sleepMillis(1000); // Pause for 1 second
         drawInterface(); // Return to main screen
     }
 
@@ -183,7 +6298,33 @@ public:                     // Public access modifier (functions accessible from
         octave += delta; // Add delta (+1 or -1) to current octave
         if (octave < 1) octave = 1; // Clamp minimum octave to 1
         if (octave > 8) octave = 8; // Clamp maximum octave to 8
-        drawInterface(); // Redraw UI to update octave number
+        drawStatusLine(); // Update only the octave number, no full redraw
+    }
+
+    // Function to switch to the next key layout
+    void nextLayout() {
+        activeLayout = (activeLayout + 1) % layouts.size();
+        fanout = compileZones(layouts[activeLayout], zones); // Resolve zones for the new layout once
+        drawInterface(); // Redraw UI to show the new keys
+    }
+
+    // Function to switch to the next tuning system (notes already sounding keep their pitch)
+    void nextTuning() {
+        tunings.next();
+        drawStatusLine();
+    }
+
+    // Function to switch to the next velocity curve
+    void nextVelocityCurve() {
+        velocityCurve = static_cast<VelocityCurveKind>((static_cast<int>(velocityCurve) + 1) % NUM_VELOCITY_CURVES);
+        drawStatusLine();
+    }
+
+    // Function to check whether a lowercase command letter is free (not bound to a note)
+    // Uppercase command letters always work, so layouts may use q/r/p as note keys.
+    bool isCommand(char key, char command) {
+        if (key == command - 'a' + 'A') return true;
+        return key == command && layouts[activeLayout].resolve(key) < 0;
     }
 
     // Main loop function to run the application
@@ -191,12 +6332,20 @@ public:                     // Public access modifier (functions accessible from
         drawInterface(); // Draw initial interface
         char key; // Variable to store key press
         while (true) { // Infinite loop
-            // _getch() captures a character directly from console without waiting for Enter
-            key = _getch(); 
+            // readKey() captures a character directly from console without waiting for Enter
+            key = waitForKey(); // (also shows MIDI keyboard notes while waiting)
             
-            if (key == 'q' || key == 'Q') break; // If 'q' pressed, break loop (quit)
-            else if (key == 'r' || key == 'R') toggleRecording(); // If 'r' pressed, toggle recording
-            else if (key == 'p' || key == 'P') playRecording(); // If 'p' pressed, play recording
+            if (isCommand(key, 'q')) { // If 'q' pressed, save the session and break loop (quit)
+                saveSession();
+                break;
+            }
+            else if (isCommand(key, 'r')) toggleRecording(); // If 'r' pressed, toggle recording
+            else if (isCommand(key, 'p')) playRecording(); // If 'p' pressed, play recording
+            else if (key == '\t') nextLayout(); // If Tab pressed, switch key layout
+            else if (key == 'V') nextVelocityCurve(); // If Shift+V pressed, change the touch response
+            else if (key == 'T') nextTuning(); // If Shift+T pressed, change the tuning system
+            else if (key == ' ') togglePedal(NoteKind::Sustain); // If Space pressed, sustain pedal
+            else if (key == '\r') togglePedal(NoteKind::Sostenuto); // If Enter pressed, sostenuto pedal
             else if (key == '+') changeOctave(1); // If '+' pressed, increase octave
             else if (key == '-') changeOctave(-1); // If '-' pressed, decrease octave
             else {
@@ -205,14 +6354,439 @@ public:                     // Public access modifier (functions accessible from
             }
         }
     }
+
+    // Function to run one control command (headless mode), returns the JSON reply
+    // Commands: note <key 0-127> [velocity] [instrument], key <c>, sustain|sostenuto [on|off],
+    // record [start|stop], play, octave <n>|+|-, layout next|<name>, tuning next, curve next,
+    // status, stats, quit. "play" answers when playback has finished.
+    JsonLine execute(const std::string& line, bool& quit) {
+        std::istringstream words(line);
+        std::string command, arg;
+        words >> command >> arg;
+        JsonLine reply;
+        reply.flag("ok", true);
+        if (command == "note") {
+            int key = -1, velocity = 100;
+            std::string instrumentName;
+            std::istringstream(arg) >> key;
+            words >> velocity >> instrumentName;
+            if (key < 0 || key > 127 || velocity < 1 || velocity > 127) {
+                return JsonLine().flag("ok", false).text("error", "usage: note <key 0-127> [velocity 1-127] [instrument]");
+            }
+            Instrument instrument = midiInstrument;
+            if (!instrumentName.empty()) {
+                int found = -1;
+                for (int i = 0; i < NUM_INSTRUMENTS; i++) if (instrumentName == INSTRUMENT_NAMES[i]) found = i;
+                if (found < 0) return JsonLine().flag("ok", false).text("error", "unknown instrument " + instrumentName);
+                instrument = static_cast<Instrument>(found);
+            }
+            lastVelocity = velocity;
+            double hz = strike(key, static_cast<unsigned char>(velocity), instrument, 1.0f, clock->nowMs());
+            if (hz <= 0.0) return JsonLine().flag("ok", false).text("error", "key not mapped in this tuning");
+            reply.number("hz", hz);
+        } else if (command == "key") {
+            if (arg.size() != 1) return JsonLine().flag("ok", false).text("error", "usage: key <character>");
+            if (fanout[static_cast<unsigned char>(tolower(arg[0]))].count == 0) {
+                return JsonLine().flag("ok", false).text("error", "key not mapped in this layout");
+            }
+            playTone(static_cast<char>(tolower(arg[0])));
+            reply.integer("velocity", lastVelocity);
+        } else if (command == "sustain" || command == "sostenuto") {
+            NoteKind pedal = command == "sustain" ? NoteKind::Sustain : NoteKind::Sostenuto;
+            bool down = pedal == NoteKind::Sustain ? sustainDown : sostenutoDown;
+            if (arg.empty() || (arg == "on") != down) togglePedal(pedal);
+            reply.flag("down", pedal == NoteKind::Sustain ? sustainDown : sostenutoDown);
+        } else if (command == "record") {
+            if (arg.empty() || (arg == "start") != recorder.recording()) toggleRecording();
+            reply.flag("recording", recorder.recording()).integer("entries", static_cast<long long>(recorder.notes().size()));
+        } else if (command == "play") {
+            adoptBackground(true);
+            if (recorder.notes().empty()) return JsonLine().flag("ok", false).text("error", "no recording");
+            playRecording();
+            reply.integer("entries", static_cast<long long>(recorder.notes().size()));
+        } else if (command == "octave") {
+            if (arg == "+" || arg == "-") changeOctave(arg == "+" ? 1 : -1);
+            else if (!arg.empty() && std::isdigit(static_cast<unsigned char>(arg[0]))) changeOctave(std::atoi(arg.c_str()) - octave);
+            else return JsonLine().flag("ok", false).text("error", "usage: octave <1-8>|+|-");
+            reply.integer("octave", octave);
+        } else if (command == "layout") {
+            if (arg == "next") nextLayout();
+            else {
+                size_t found = layouts.size();
+                for (size_t i = 0; i < layouts.size(); i++) if (layouts[i].name == arg) found = i;
+                if (found == layouts.size()) return JsonLine().flag("ok", false).text("error", "unknown layout " + arg);
+                activeLayout = found;
+                fanout = compileZones(layouts[activeLayout], zones);
+            }
+            reply.text("layout", layouts[activeLayout].name);
+        } else if (command == "tuning") {
+            nextTuning();
+            reply.text("tuning", tunings.current().name);
+        } else if (command == "curve") {
+            nextVelocityCurve();
+            reply.text("curve", VELOCITY_CURVE_NAMES[static_cast<int>(velocityCurve)]);
+        } else if (command == "status") {
+            reply.integer("octave", octave).text("layout", layouts[activeLayout].name).text("tuning", tunings.current().name)
+                 .text("curve", VELOCITY_CURVE_NAMES[static_cast<int>(velocityCurve)]).integer("velocity", lastVelocity)
+                 .flag("sustain", sustainDown).flag("sostenuto", sostenutoDown).flag("recording", recorder.recording())
+                 .integer("entries", static_cast<long long>(recorder.notes().size())).flag("restoring", restoring != nullptr)
+                 .flag("sound", engine != nullptr || audioOpening != nullptr);
+        } else if (command == "stats") {            // Statistics of the current take, kept while recording
+            RecordingStats stats = recorder.stats();
+            reply.integer("notes", static_cast<long long>(stats.notes)).number("notes_per_second", stats.notesPerSecond())
+                 .integer("busiest_second", stats.busiestSecond).number("tempo_bpm", stats.tempoBpm())
+                 .number("mean_velocity", stats.meanVelocity()).counts("pitch_classes", stats.pitchClass, PITCH_CLASSES)
+                 .counts("intervals", stats.interval, INTERVAL_BUCKETS);
+        } else if (command == "quit") {
+            quit = true;
+        } else {
+            return JsonLine().flag("ok", false).text("error", "unknown command " + command);
+        }
+        return reply;
+    }
+
+    // Main loop without a terminal: commands come from the control server, output goes to the log
+    // Returns when a client sends "quit" or stopRequested is set (SIGINT/SIGTERM).
+    void runHeadless(ControlServer& control, const std::atomic<bool>& stopRequested) {
+        log->write(log->event("ready").text("layout", layouts[activeLayout].name).text("tuning", tunings.current().name)
+                       .integer("octave", octave));
+        bool quit = false;
+        while (!quit && !stopRequested) {
+            if (midi) drainMidi();
+            if (configWatcher) pollConfig();
+            if (restoring || audioOpening) adoptBackground(false);
+            ControlRequest* request = control.next(2); // Also paces the loop, like waitForKey
+            if (!request) continue;
+            JsonLine reply = execute(request->line, quit);
+            log->write(log->event("command").text("line", request->line));
+            request->reply.set_value(reply.done());
+            delete request;
+        }
+        saveSession();
+        log->write(log->event("stopped").text("reason", quit ? "quit" : "signal"));
+    }
 };
 
-int main() {
+// Set by SIGINT/SIGTERM in headless mode (the service loop checks it between commands)
+std::atomic<bool> stopRequested{false};
+
+// Function to handle SIGINT/SIGTERM: only sets the flag, the service loop shuts down cleanly
+void requestStop(int) { stopRequested = true; }
+
+int main(int argc, char* argv[]) {
+    StartupTimeline timeline;       // "Ready to play" is measured from here
+    // Read audio buffer bounds from the command line (e.g. --buffer-min 256 --buffer-max 2048)
+    BufferSizeConfig bufferConfig;
+    int metricsPort = METRICS_PORT; // --metrics-port 0 turns the endpoint off
+    std::string keymapFile;         // --keymaps <file> adds layouts and zones from a config file
+    std::string layoutName;         // --layout <name> picks the starting layout
+    std::string midiIn;             // --midi-in alsa[:client:port] or raw:<device or file>
+    std::string midiOutSpec;        // --midi-out alsa[:client:port], file:<path> or udp:<host>:<port>
+#ifdef _WIN32
+    std::string audioName = "waveout"; // --audio waveout|jack|none
+#elif defined(PIANO_WITH_ALSA)
+    std::string audioName = "alsa";    // --audio alsa|jack|none
+#else
+    std::string audioName = "none";    // --audio jack|none (build with -DPIANO_WITH_ALSA for a sound card)
+#endif
+    bool jackTransport = false;     // --jack-transport: playback follows the JACK transport
+    int graphWorkers = 0;           // --graph-workers N: threads helping the audio thread render voices
+    bool benchGraph = false;        // --bench-graph: print the audio graph benchmark and exit
+    bool benchPool = false;         // --bench-pool: compare the work-stealing pool with a mutex queue pool
+    bool benchVoices = false;       // --bench-voices: CPU cost of one voice per instrument
+    bool benchModal = false;        // --bench-modal: 128 modal notes on one core
+    bool benchOversample = false;   // --bench-oversample: aliasing and cost per oversampling factor
+    int oversample = 0;             // --oversample 1|2|4|8 for square voices and the saturator (0 = session or 2)
+    float drive = -1.0f;            // --drive <amount>: master saturation (< 0 = session or off)
+    std::string sessionFile = "piano_session.snap"; // --session <file>: state kept across restarts
+    bool selfTestClock = false;     // --self-test-clock: simulated hour of recording and playback timing
+    bool verbose = false;           // --verbose: print the startup timeline on exit
+    bool headless = false;          // --headless: no terminal UI, JSON log lines on stdout, control over TCP
+    int controlPort = CONTROL_PORT; // --control-port <n>: where the headless control API listens
+    std::string goldenCheck;        // --golden-check <dir>: compare rendered scenes with stored goldens
+    std::string goldenUpdate;       // --golden-update <dir>: store the current rendering as the goldens
+    std::string renderBatch;        // --render-batch <dir or list>: render recordings to WAV files and exit
+    std::string renderOut = ".";    // --render-out <dir>: where batch rendering writes the WAV files (created if needed)
+    int renderJobs = 0;             // --render-jobs N: recordings rendered at once (0 = one per pool worker)
+    std::string analyzeSource;      // --analyze <dir or list>: statistics over a library of recordings
+    std::string sclFile;            // --tuning <file.scl>: Scala scale, selected at startup
+    std::string kbmFile;            // --kbm <file.kbm>: keyboard mapping for the --tuning scale
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::strcmp(argv[i], "--buffer-min") == 0) bufferConfig.minFrames = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--buffer-max") == 0) bufferConfig.maxFrames = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--buffer-initial") == 0) bufferConfig.initialFrames = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--metrics-port") == 0) metricsPort = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--keymaps") == 0) keymapFile = argv[++i];
+        else if (std::strcmp(argv[i], "--layout") == 0) layoutName = argv[++i];
+        else if (std::strcmp(argv[i], "--midi-in") == 0) midiIn = argv[++i];
+        else if (std::strcmp(argv[i], "--midi-out") == 0) midiOutSpec = argv[++i];
+        else if (std::strcmp(argv[i], "--audio") == 0) audioName = argv[++i];
+        else if (std::strcmp(argv[i], "--graph-workers") == 0) graphWorkers = std::max(0, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--oversample") == 0) oversample = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--tuning") == 0) sclFile = argv[++i];
+        else if (std::strcmp(argv[i], "--kbm") == 0) kbmFile = argv[++i];
+        else if (std::strcmp(argv[i], "--session") == 0) sessionFile = argv[++i];
+        else if (std::strcmp(argv[i], "--control-port") == 0) controlPort = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--golden-check") == 0) goldenCheck = argv[++i];
+        else if (std::strcmp(argv[i], "--golden-update") == 0) goldenUpdate = argv[++i];
+        else if (std::strcmp(argv[i], "--render-batch") == 0) renderBatch = argv[++i];
+        else if (std::strcmp(argv[i], "--render-out") == 0) renderOut = argv[++i];
+        else if (std::strcmp(argv[i], "--analyze") == 0) analyzeSource = argv[++i];
+        else if (std::strcmp(argv[i], "--render-jobs") == 0) renderJobs = std::max(0, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--drive") == 0) drive = static_cast<float>(std::max(0.0, std::atof(argv[++i])));
+    }
+    for (int i = 1; i < argc; i++) {   // Options without a value
+        if (std::strcmp(argv[i], "--jack-transport") == 0) jackTransport = true;
+        else if (std::strcmp(argv[i], "--bench-graph") == 0) benchGraph = true;
+        else if (std::strcmp(argv[i], "--bench-pool") == 0) benchPool = true;
+        else if (std::strcmp(argv[i], "--bench-voices") == 0) benchVoices = true;
+        else if (std::strcmp(argv[i], "--bench-modal") == 0) benchModal = true;
+        else if (std::strcmp(argv[i], "--bench-oversample") == 0) benchOversample = true;
+        else if (std::strcmp(argv[i], "--no-session") == 0) sessionFile.clear();
+        else if (std::strcmp(argv[i], "--self-test-clock") == 0) selfTestClock = true;
+        else if (std::strcmp(argv[i], "--verbose") == 0) verbose = true;
+        else if (std::strcmp(argv[i], "--headless") == 0) headless = true;
+    }
+    if (benchGraph || benchPool || benchVoices || benchModal || benchOversample) {
+        if (benchGraph) runGraphBenchmark(std::cout);
+        if (benchPool) runPoolBenchmark(std::cout);
+        if (benchVoices) runVoiceBenchmark(std::cout);
+        if (benchModal) runModalBenchmark(std::cout);
+        if (benchOversample) runOversampleBenchmark(std::cout);
+        return 0;
+    }
+    if (selfTestClock) return runClockSelfTest(std::cout) ? 0 : 1;
+    if (!goldenUpdate.empty()) return updateGoldens(goldenUpdate, std::cout) ? 0 : 1;
+    if (!goldenCheck.empty()) return checkGoldens(goldenCheck, std::cout) ? 0 : 1;
+    if (!renderBatch.empty()) return runRenderBatch(renderBatch, renderOut, renderJobs, std::cout) ? 0 : 1;
+    if (!analyzeSource.empty()) return runAnalyze(analyzeSource, std::cout) ? 0 : 1;
+    bufferConfig.minFrames = std::max(32, bufferConfig.minFrames);
+    bufferConfig.maxFrames = std::max(bufferConfig.minFrames, bufferConfig.maxFrames);
+    StructuredLog structuredLog(std::cout);                      // Headless output (unused with the console UI)
+    auto startupFailed = [&](const std::string& message) {       // Headless: a log record instead of a console line
+        if (headless) structuredLog.write(structuredLog.event("startup_failed").text("error", message));
+        else std::cout << message << "\n";
+        return 1;
+    };
+    timeline.mark("command line");
+
+    // Startup order: only what the first note needs (settings, tuning, engine, keyboard loop) runs
+    // before the interface comes up; the sound device, the metrics server and the session's
+    // recording load on background threads and are picked up when they are done.
+
+    // Restore the last session (octave, layout, tuning, recording and sound settings);
+    // anything given on the command line or in the config file wins over it
+    SessionSnapshot session;
+    bool haveSession = false;
+    BackgroundLoad<std::vector<Note>> recordingLoad;             // The recording can be large
+    if (!sessionFile.empty()) {
+        std::string error;
+        haveSession = readSession(sessionFile, session, error, false);
+        if (!error.empty() && headless) structuredLog.write(structuredLog.event("session_ignored").text("error", error));
+        else if (!error.empty()) std::cout << "Session ignored: " << error << "\n";
+        if (haveSession) {
+            recordingLoad.start(timeline, "session recording", [sessionFile] {
+                SessionSnapshot full;
+                std::string ignored;
+                readSession(sessionFile, full, ignored);
+                return std::move(full.recording);
+            });
+        }
+        if (haveSession && layoutName.empty()) layoutName = session.layout;
+        timeline.mark("session");
+    }
+
+    // Load key layouts and zones (built-in layouts first, the file may add or replace layouts)
+    ReloadedConfig loadedConfig;
+    PianoConfig& pianoConfig = loadedConfig.config;
+    if (!keymapFile.empty()) {
+        std::string error;
+        if (!loadReloadedConfig(keymapFile, loadedConfig, error)) {
+            return startupFailed(std::string("Config error: ") + error);
+        }
+        if (layoutName.empty()) layoutName = pianoConfig.defaultLayout;
+    }
+    timeline.mark("config");
+    // Tuning systems: built-in ones, plus a Scala scale from the command line or the config file
+    TuningSet tunings;
+    // The config tuning stays in the cycle; a saved session tuning wins and is only added if it differs
+    if (loadedConfig.hasTuning && sclFile.empty()) tunings.select(tunings.addUnique(loadedConfig.tuning));
+    if (haveSession && sclFile.empty()) tunings.select(tunings.addUnique(session.tuning));
+    if (!sclFile.empty()) {
+        TuningTable table;
+        std::string error;
+        if (!loadTuning(sclFile, kbmFile, table, error)) {
+            return startupFailed(std::string("Tuning error: ") + error);
+        }
+        tunings.select(tunings.add(table));
+    } else if (!kbmFile.empty()) {
+        return startupFailed("--kbm needs --tuning");
+    }
+    timeline.mark("tunings");
+    size_t startLayout = 0;
+    for (size_t i = 0; i < pianoConfig.layouts.size(); i++) {
+        if (pianoConfig.layouts[i].name == layoutName) startLayout = i;
+    }
+
     // System command to set the window title of the console
-    system("title C++ Virtual Piano Project");
-    
-    ConsolePiano piano; // Instantiate the ConsolePiano object
-    piano.run();        // Call the run method to start the program loop
-    
+    if (!headless) setConsoleTitle("C++ Virtual Piano Project");
+
+    std::ofstream engineLog("piano_engine.log", std::ios::app); // Buffer size changes are written here
+    PianoMetrics metrics;                                        // Counters shared by every thread
+    AudioEngine engine(metrics);                                 // Software synth
+    engine.setGraphWorkers(graphWorkers);
+    EngineSettings commandLineSettings;                          // The config file overrides these
+    if (haveSession) commandLineSettings = session.settings;
+    if (haveSession && keymapFile.empty()) pianoConfig.fmAlgorithm = session.settings.fmAlgorithm;
+    if (oversample > 0) commandLineSettings.oversample = oversample;
+    if (drive >= 0.0f) commandLineSettings.drive = drive;
+    engine.applySettings(settingsFor(pianoConfig, commandLineSettings));
+    timeline.mark("engine");
+    AdaptiveBufferController controller(bufferConfig, engineLog); // Picks the period size
+    if (jackTransport && audioName != "jack") {
+        return startupFailed("--jack-transport needs --audio jack");
+    }
+    std::unique_ptr<AudioBackend> output;                        // Sound card / audio server connection
+    std::unique_ptr<TransportSync> transport;                    // External transport for playback
+    if (audioName == "jack") {
+#ifdef PIANO_WITH_JACK
+        output.reset(new JackBackend(engine, metrics));
+#else
+        return startupFailed("This build has no JACK support (compile with -DPIANO_WITH_JACK -ljack)");
+#endif
+    } else if (audioName == "waveout") {
+#ifdef _WIN32
+        output.reset(new WaveOutBackend(engine, controller, metrics, bufferConfig.maxFrames));
+#else
+        return startupFailed("waveOut is only available on Windows (use alsa, jack or none)");
+#endif
+    } else if (audioName == "alsa") {
+#ifdef PIANO_WITH_ALSA
+        output.reset(new AlsaPcmBackend(engine, controller, metrics, bufferConfig.maxFrames));
+#else
+        return startupFailed("This build has no ALSA support (compile with -DPIANO_WITH_ALSA -lasound)");
+#endif
+    } else if (audioName != "none") {
+        return startupFailed(std::string("Unknown audio backend '") + audioName + "' (use waveout, alsa, jack or none)");
+    }
+    bool haveAudio = output != nullptr;                          // Falls back to beeps if opening fails
+    BackgroundLoad<bool> audioLoad;
+    if (output && jackTransport) haveAudio = output->start();    // The transport needs the client right away
+    else if (output) {
+        AudioBackend* device = output.get();
+        audioLoad.start(timeline, "audio output", [device] { return device->start(); });
+    }
+    timeline.mark("audio output");
+#ifdef PIANO_WITH_JACK
+    if (haveAudio && jackTransport) {
+        transport.reset(new JackTransport(static_cast<JackBackend*>(output.get())->handle()));
+    }
+#endif
+    MetricsHttpServer metricsServer(metrics.registry);
+    BackgroundLoad<bool> metricsLoad;
+    if (metricsPort > 0) {
+        metricsLoad.start(timeline, "metrics server", [&metricsServer, &engineLog, metricsPort] {
+            if (metricsServer.start(metricsPort)) return true;
+            engineLog << "[metrics] could not listen on port " << metricsPort << std::endl;
+            return false;
+        });
+    }
+
+    // Open the MIDI keyboard input, if one was asked for
+    MidiDispatcher midiDispatcher(engine, pianoConfig.midiInstrument, tunings);
+    std::unique_ptr<MidiInput> midiInput;
+    if (midiIn.compare(0, 4, "raw:") == 0) {
+        midiInput.reset(new RawMidiInput(midiIn.substr(4), midiDispatcher));
+    } else if (midiIn.compare(0, 4, "alsa") == 0) {
+#ifdef PIANO_WITH_ALSA
+        midiInput.reset(new AlsaSeqMidiInput(midiIn.size() > 5 ? midiIn.substr(5) : "", midiDispatcher));
+#else
+        return startupFailed("This build has no ALSA support (compile with -DPIANO_WITH_ALSA -lasound)");
+#endif
+    } else if (!midiIn.empty()) {
+        return startupFailed(std::string("Unknown MIDI input '") + midiIn + "' (use alsa[:client:port] or raw:<path>)");
+    }
+    if (midiInput && !midiInput->start()) {
+        return startupFailed(std::string("Could not open MIDI input '") + midiIn + "'");
+    }
+
+    // Open the MIDI output used by playback, if one was asked for
+    std::unique_ptr<MidiOutput> midiOutput;
+    if (midiOutSpec.compare(0, 5, "file:") == 0) {
+        midiOutput.reset(new FileMidiOutput(midiOutSpec.substr(5)));
+    } else if (midiOutSpec.compare(0, 4, "udp:") == 0) {
+        std::string target = midiOutSpec.substr(4);
+        size_t colon = target.rfind(':');
+        if (colon == std::string::npos) {
+            return startupFailed("Use --midi-out udp:<host>:<port>");
+        }
+        midiOutput.reset(new UdpMidiOutput(target.substr(0, colon), std::atoi(target.c_str() + colon + 1)));
+    } else if (midiOutSpec.compare(0, 4, "alsa") == 0) {
+#ifdef PIANO_WITH_ALSA
+        midiOutput.reset(new AlsaSeqMidiOutput(midiOutSpec.size() > 5 ? midiOutSpec.substr(5) : ""));
+#else
+        return startupFailed("This build has no ALSA support (compile with -DPIANO_WITH_ALSA -lasound)");
+#endif
+    } else if (!midiOutSpec.empty()) {
+        return startupFailed(std::string("Unknown MIDI output '") + midiOutSpec + "' (use alsa[:client:port], file:<path> or udp:<host>:<port>)");
+    }
+    if (midiOutput && !midiOutput->open()) {
+        return startupFailed(std::string("Could not open MIDI output '") + midiOutSpec + "'");
+    }
+    timeline.mark("midi");
+
+    ConsolePiano piano(haveAudio ? &engine : nullptr, metrics, pianoConfig, tunings, startLayout,
+                       midiInput ? &midiDispatcher : nullptr, midiInput ? midiInput->describe() : ""); // Instantiate the ConsolePiano object
+    piano.setMidiOutput(midiOutput.get());
+    piano.setTransport(transport.get());
+    std::unique_ptr<ConfigWatcher> configWatcher;                // Edits to the config file apply while playing
+    if (!keymapFile.empty()) {
+        configWatcher.reset(new ConfigWatcher(keymapFile, engine, commandLineSettings, engineLog));
+        configWatcher->start();
+        piano.setConfigWatcher(configWatcher.get());
+    }
+    if (!sessionFile.empty()) piano.setSessionFile(sessionFile, engine);
+    if (haveSession) piano.restoreSession(session);
+    piano.setBackgroundLoads(&recordingLoad, &audioLoad);
+    timeline.mark("interface");
+    double startupMs = timeline.elapsedMs();
+    std::ostringstream startup;
+    startup.setf(std::ios::fixed);
+    startup.precision(1);
+    startup << "Ready in " << startupMs << " ms" << (haveSession ? " (session restored)" : "");
+    engineLog << "[startup] " << startup.str() << std::endl;
+    piano.setStartupReport(startup.str());
+    if (headless) {
+        // Service mode: nothing touches the terminal, the control port is the only input
+        ControlServer control;
+        if (!control.start(controlPort)) {
+            structuredLog.write(structuredLog.event("control_failed").integer("port", controlPort));
+            return 1;
+        }
+        std::signal(SIGINT, requestStop);
+        std::signal(SIGTERM, requestStop);
+        structuredLog.write(structuredLog.event("startup").number("ready_ms", startupMs).flag("session_restored", haveSession)
+                                .integer("control_port", controlPort).text("audio", audioName));
+        piano.setLog(&structuredLog);
+        piano.runHeadless(control, stopRequested);
+        control.stop();                                          // Clients still waiting get an error reply
+    } else {
+        RawConsole console;                                      // Keys one at a time, no echo
+        piano.run();    // Call the run method to start the program loop
+    }
+
+    if (configWatcher) configWatcher->stop();
+    if (midiInput) midiInput->stop(); // No more MIDI events once the interface is gone
+    if (audioLoad.pending()) audioLoad.take();     // Quit before a background step finished: let it finish first
+    if (metricsLoad.pending()) metricsLoad.take();
+    if (recordingLoad.pending()) recordingLoad.take();
+    if (verbose && headless) timeline.log(structuredLog);
+    else if (verbose) {
+        std::cout << "\n";
+        timeline.print(std::cout);
+    }
+
+    metricsServer.stop(); // Stop serving before the metrics are destroyed
+    if (output) output->stop(); // Close the sound device before the engine goes away
     return 0; // indicate successful execution
 }